@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 /*
  * Provide a storage and retreval mechanism for system coredumps similar to systemd-coredump, but without the requirement on using systemd
  */
@@ -17,6 +18,31 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+/* major, minor */
+#include <sys/sysmacros.h>
+
+/* mmap */
+#include <sys/mman.h>
+
+/* flock */
+#include <sys/file.h>
+
+/* kill */
+#include <signal.h>
+
+/* FICLONE */
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+
+/* statvfs */
+#include <sys/statvfs.h>
+
+/* fsetxattr */
+#include <sys/xattr.h>
+
+/* waitpid */
+#include <sys/wait.h>
+
 /* opendir */
 #include <dirent.h>
 
@@ -33,6 +59,45 @@
 
 #include <sys/prctl.h>
 
+/* isspace */
+#include <ctype.h>
+
+/* setpriority */
+#include <sys/resource.h>
+
+/* ioprio_set */
+#include <sys/syscall.h>
+
+/* deflate, for compressed cores */
+#include <zlib.h>
+
+/* AES-GCM, for encrypted cores */
+#include <openssl/evp.h>
+
+/* getrandom */
+#include <sys/random.h>
+
+/* reading build-ids of mapped objects */
+#include <elf.h>
+
+/* serve */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+
+/* snapshot */
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+#include <sys/procfs.h>
+
+/* the redact matcher, where available */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define CFG_BACKTRACE 1
 #if CFG_BACKTRACE
 #include <execinfo.h>
@@ -42,6 +107,27 @@
 #define CFG_CORE_LIMIT (1024 * 1024 * 1024)
 #endif
 
+/*
+ * Cores are read & compressed in frames of this many bytes. Each compressed
+ * frame is an independent gzip member, so the level can change between frames
+ * and readers can seek using the frame table.
+ */
+#ifndef CFG_FRAME_SIZE
+#define CFG_FRAME_SIZE (1024 * 1024)
+#endif
+
+#ifndef CFG_CONFIG_PATH
+#define CFG_CONFIG_PATH "/etc/dumpctl.conf"
+#endif
+
+#ifndef CFG_RING_SIZE
+#define CFG_RING_SIZE (4ULL * 1024 * 1024 * 1024)
+#endif
+
+#ifndef CFG_CGROUP_PATH
+#define CFG_CGROUP_PATH "/sys/fs/cgroup/dumpctl"
+#endif
+
 /*
  * We don't use any threads or signals, so try using the unlocked_stdio operations
  */
@@ -128,6 +214,11 @@ static void print_backtrace(void)
 	} \
 } while(0)
 
+/* debuginfod's usual port */
+#ifndef CFG_SERVE_PORT
+# define CFG_SERVE_PORT 8002
+#endif
+
 #ifndef CFG_COREDUMP_PATH
 # define CFG_COREDUMP_PATH "/var/lib/systemd/coredump"
 #endif
@@ -135,7 +226,11 @@ static
 const char *default_path = CFG_COREDUMP_PATH;
 
 static
-const char *opts = ":hd:";
+const char *default_config = CFG_CONFIG_PATH;
+
+/* '+': options stop at the action, anything after it is the action's */
+static
+const char *opts = "+:hc:d:";
 
 static
 void usage_(const char *prgmname, int e)
@@ -148,20 +243,38 @@ void usage_(const char *prgmname, int e)
 	fprintf(f,
 "Usage: %s [options] <action-and-args...>\n"
 "       %s [options] store <global-pid> <uid> <gid> <signal-number> <unix-timestamp> <-%%c?-> <executable-filename> <exe-path>\n"
+"       %s [options] store --vmcore <vmcore>\n"
+"       %s [options] snapshot <pid>\n"
 "       %s [options] setup\n"
 "       %s [options] list\n"
-"       %s [options] info\n"
-"       %s [options] gdb\n"
+"       %s [options] info <dump>\n"
+"       %s [options] info --segments <selector>...\n"
+"       %s [options] gdb <dump>\n"
+"       %s [options] export <dump> [<output-file>]\n"
+"       %s [options] bench [<MiB>]\n"
+"       %s [options] serve [<port>]\n"
+"       %s [options] triage all|<dump>|comm=<comm>|sig=<signal>|since=<unix-timestamp>|group=<dump>...\n"
+"       %s [options] search <function-or-file>[*]...\n"
+"       %s [options] similar <dump> [<min-similarity-%%>]\n"
+"       %s [options] cluster [<min-similarity-%%>]\n"
+"       %s [options] vacuum [<max-use>]\n"
+"       %s [options] grep <pattern>... in <selector>...\n"
+"       %s [options] diff <dump-a> <dump-b>\n"
+"       %s [options] analyze-storage [sample=<dumps>] [<selector>...]\n"
+"       %s [options] migrate\n"
+"       %s [options] extract [<dump-name-or-seq>]\n"
 "\n"
 "Use me to handle your coredumps:\n"
 "    # echo '|%s store %%P %%u %%g %%s %%t %%c %%e %%E' | /proc/sys/kernel/core_pattern\n"
 "Or, run:\n"
-"    # %s store-setup\n"
+"    # %s setup\n"
 "\n"
 "Options: -[%s]\n"
 "  -d <directory>     store the coredumps in this directory\n"
 "                     default = '%s'\n"
-		, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, opts, default_path);
+"  -c <config-file>   read settings from this file\n"
+"                     default = '%s'\n"
+		, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, prgmname, opts + 1, default_path, default_config);
 
 	exit(e);
 }
@@ -169,7 +282,7 @@ void usage_(const char *prgmname, int e)
 
 struct fbuf {
 	size_t bytes_in_buf;
-	uint8_t buf[4096];
+	uint8_t buf[CFG_FRAME_SIZE];
 };
 
 static void *fbuf_space_ptr(struct fbuf *f)
@@ -211,6 +324,18 @@ static void fbuf_init(struct fbuf *f)
 	f->bytes_in_buf = 0;
 }
 
+static void fclosep(FILE **p)
+{
+	if (*p)
+		fclose(*p);
+}
+
+static void freep(void *p_)
+{
+	void **p = p_;
+	free(*p);
+}
+
 static
 uintmax_t parse_unum(const char *n, const char *name)
 {
@@ -230,289 +355,9983 @@ uintmax_t parse_unum(const char *n, const char *name)
 	return v;
 }
 
-enum act {
-	ACT_NONE,
-	ACT_SETUP,
-	ACT_STORE,
-	ACT_INFO,
-	ACT_GDB,
-	ACT_LIST,
+enum isolation {
+	ISOLATE_NONE,
+	/* cgroup limits, or failing that idle io priority & nice */
+	ISOLATE_POLITE,
+	/* highest best-effort io priority, no limits */
+	ISOLATE_FAST,
 };
 
-static enum act parse_act(const char *action)
-{
-	switch (action[0]) {
-	case 's':
-		switch (action[1]) {
-		case 'e':
-			return ACT_SETUP;
-		case 't':
-			return ACT_STORE;
-		default:
-			return ACT_NONE;
-		}
-		break;
-	case 'g':
-		return ACT_GDB;
-	case 'l':
-		return ACT_LIST;
-	case 'i':
-		return ACT_INFO;
-	default:
-		return ACT_NONE;
-	}
-}
-
-/*
- * Copy from a FILE * to an fd, trying to avoid blocking too much.
- * We might be able to improve this by using threads or async io.
- */
-static ssize_t copy_file_to_fd(int out_fd, FILE *in_file)
-{
-	size_t read_bytes = 0;
-	size_t written_bytes = 0;
-	unsigned err = 0;
-	bool done_reading = false;
-	/* TODO: replace this with a magic ring buffer */
-	struct fbuf f;
-	fbuf_init(&f);
-
-	for (;;) {
-		if (err > 10) {
-			pr_err("too many errors while copying file");
-			return -1;
-		}
-
-		size_t rl = fread(fbuf_space_ptr(&f), 1, fbuf_space(&f), in_file);
-		if (rl == 0) {
-			if (feof(in_file)) {
-				/* done reading! */	
-				done_reading = true;
-			} else {
-				pr_warn("Error reading input core file\n");
-				err++;
-				continue;
-			}
-		}
-		fbuf_feed(&f, rl);
-		read_bytes += rl;
-		//pr_info("read %zu bytes (%zu total)\n", rl, read_bytes);
+/* Bandwidth share for stores from a uid or comm */
+struct bw_weight {
+	bool is_uid;
+	uintmax_t uid;
+	char comm[32];
+	unsigned weight;
+};
 
-		do {
-			if (fbuf_data(&f) == 0) {
-				return written_bytes;
-			}
+enum metadata {
+	/* info.txt next to the core */
+	METADATA_FILE,
+	/* user.dumpctl.* xattrs on the core, info.txt if they aren't supported */
+	METADATA_XATTR,
+};
 
-			ssize_t wl = write(out_fd, fbuf_data_ptr(&f), fbuf_data(&f));
-			if (wl == 0) {
-				/* ??? */
-				fprintf(stderr, "write returned zero bytes written, will retry\n");
-				err++;
-				break;
-			}
+enum backend {
+	/* a directory per dump */
+	BACKEND_DIR,
+	/* one preallocated file, reused as a circular log */
+	BACKEND_RING,
+};
 
-			if (wl < 0) {
-				fprintf(stderr, "write failed due to %s\n", strerror(errno));
-				err++;
-				break;
-			}
+/* what may follow a redact pattern's literal prefix, see redact_class() */
+#define RC_UPPER	0x01
+#define RC_LOWER	0x02
+#define RC_DIGIT	0x04
+/* '-' & '_' */
+#define RC_TOKEN	0x08
+/* '+', '/' & '=' */
+#define RC_BASE64	0x10
+/* ' ', '\r' & '\n' */
+#define RC_SPACE	0x20
+#define RC_ALNUM	(RC_UPPER | RC_LOWER | RC_DIGIT)
 
-			fbuf_eat(&f, wl);
-			written_bytes += wl;
-			//pr_info("write %zd bytes (%zu total)\n", wl, written_bytes);
+/*
+ * A secret to scrub from cores: a literal prefix followed by min_tail to
+ * max_tail bytes of the classes in 'tail'. The whole match is overwritten.
+ * With 'pem', the prefix is '-----BEGIN ' and what follows must be a private
+ * key's header, the tail being its body, up to the '-----END' line.
+ */
+struct redact_pat {
+	const char *name;
+	const char *lit;
+	size_t lit_len;
+	uint8_t tail;
+	uint16_t min_tail, max_tail;
+	bool pem;
+};
 
-		/* if we've go space to read, do that again. If not, keep trying to write */
-		} while (fbuf_space(&f) == 0 || done_reading);
+/* which other processes are snapshotted when a matching one crashes */
+enum group_by {
+	GROUP_PGRP,
+	GROUP_CGROUP,
+};
 
-		if (read_bytes >= CFG_CORE_LIMIT) {
-			pr_warn("not storing core, too large\n");
-			return -1;
-		}
-	}
-}
+struct group_rule {
+	enum group_by by;
+	/* empty for any */
+	char comm[16];
+};
 
-static int act_store(char *dir, int argc, char *argv[])
-{
-	int e = EXIT_FAILURE;
-	int err = 0;
-	if (argc != 8 && argc != 9) {
-		pr_err("store requires 8 or 9 arguments, got %d\n", argc);
-		err++;
-	}
+enum compress_mode {
+	COMPRESS_NONE,
+	COMPRESS_FIXED,
+	COMPRESS_AUTO,
+};
 
-	/* for store, we require an absolute path */
-	if (dir[0] != '/') {
-		pr_err("store requires an absolute path, but got '%s'\n", dir);
-		err++;
-	}
+#define SINK_MAX 4
+#define GROUP_MAX 1024
 
-	if (err)
-		return EXIT_FAILURE;
+/*
+ * Settings from the config file. The kernel runs us for 'store' with a fixed
+ * command line (see setup), so anything that changes how cores are stored
+ * lives here rather than in options.
+ */
+static struct config {
+	enum compress_mode compress;
+	int compress_level;
 
-	/* FIXME: allow these to be non-fatal errors */
-	uintmax_t pid = parse_unum(argv[1], "pid"),
-		  uid = parse_unum(argv[2], "uid"),
-		  gid = parse_unum(argv[3], "gid"),
-		  sig = parse_unum(argv[4], "signal"),
-		  ts  = parse_unum(argv[5], "timestamp");
-	/* +6 = core limit */
-	const char *comm = argv[7];
+	enum isolation isolation;
+	const char *cgroup;
+	const char *cgroup_io_max;
+	const char *cgroup_cpu_max;
+	const char *cgroup_memory_max;
 
-	/* FIXME: path gotten this way is mangled... for some reason. unmangle.
-	 * Also check if this can be confused (by embedded whitespace or other
-	 * junk */
-	char *path = argv[8];
+	/* bytes/sec shared by all concurrent stores, 0 = unlimited */
+	uint64_t bandwidth;
+	struct bw_weight *bw_weights;
+	size_t bw_weights_ct;
 
-	pr_err("'%s' aborted with signal %ju (pid = %ju, uid = %ju, path = %s)\n",
-			comm, sig, pid, uid, path);
+	/* cores land here first, then get migrated to the storage dir */
+	const char *staging_dir;
+	/* bytes of cores the staging dir may hold, 0 = until it's 95% full */
+	uint64_t staging_max;
 
-	/* create our storage area if it does not exist */
-	/* for each component in path, mkdir() */
-	char *p = dir + 1;
-	for (;;) {
-		p = strchr(p, '/');
-		if (p)
-			*p = '\0';
+	/* bytes the stored dumps may use before retention removes some, 0 = unlimited */
+	uint64_t max_use;
+	/* latest dumps of each crash retention keeps (as well as the first) */
+	unsigned keep_latest;
 
-		int r = mkdir(dir, 0777);
-		if (r == -1) {
-			if (errno != EEXIST) {
-				pr_err("could not create path '%s', mkdir failed: %s\n",
-						dir, strerror(errno));
-				return EXIT_FAILURE;
-			}
-		}
+	enum metadata metadata;
 
-		if (!p)
-			break;
-		*p = '/';
-		p = p + 1;
-	}
+	/* keep the crashing process's executable & libraries by build-id */
+	bool keep_binaries;
 
-	DIR *d = opendir(dir);
-	if (!d) {
-		pr_err("failed to open storage dir '%s', opendir failed: %s\n",
-				dir, strerror(errno));
-		goto e_opendir;
-	}
-	struct tm tm;
-	/* FIXME: check overflow */
-	time_t ts_time = ts;
-	gmtime_r(&ts_time, &tm);
+	/* triage each dump in the background once stored */
+	bool auto_triage;
 
-	/* try to use 'YYYY-MM-DD_HH:MM:SS.pid=PID.uid=UID' */
+	/* secrets to overwrite in cores as they are stored */
+	struct redact_pat *redact;
+	size_t redact_ct;
 
-	char path_buf[PATH_MAX];
-	size_t b = strftime(path_buf, sizeof(path_buf), "%F_%H:%M:%S", &tm);
-	if (b == 0) {
-		pr_err("strftime failed\n");
-		goto e_storefd;
-	}
+	/* encrypt cores with the AES-256 key in this file */
+	const char *encrypt_key;
 
-	p = path_buf + b;
-	int r = snprintf(p, sizeof(path_buf) - b, ".pid=%ju.uid=%ju", pid, uid);
-	if (r < 0) {
-		pr_err("could not format storage path\n");
-		goto e_storefd;
-	}
+	enum backend backend;
+	/* default: 'ring' in the storage dir */
+	const char *ring_file;
+	uint64_t ring_size;
 
-	if ((size_t)r > (sizeof(path_buf) - b - 1)) {
-		pr_err("formatted storage path too long (needed %u bytes)\n", r);
-		goto e_storefd;
-	}
+	/* capture the process group or cgroup of crashing processes */
+	struct group_rule *group_rules;
+	size_t group_rules_ct;
+	/* most processes captured with each crash */
+	unsigned group_max;
 
-	/* XXX: consider making this a temp dir before we fill in the data */
-	r = mkdirat(dirfd(d), path_buf, 0755);
-	if (r < 0) {
-		/* XXX: handle directory collisions when many things fail near each other in time */
-		pr_err("failed to create dump directory: %s\n", strerror(errno));
-		goto e_storefd;
-	}
+	/* 'unix:<path>'s to also stream cores to, see struct sink */
+	const char *sinks[SINK_MAX];
+	size_t sinks_ct;
+} cfg = {
+	.compress = COMPRESS_NONE,
+	.isolation = ISOLATE_NONE,
+	.cgroup = CFG_CGROUP_PATH,
+	.metadata = METADATA_FILE,
+	.backend = BACKEND_DIR,
+	.ring_size = CFG_RING_SIZE,
+	.keep_latest = 3,
+	.group_max = 16,
+};
 
-	int store_fd = openat(dirfd(d), path_buf, O_DIRECTORY, 0755);
-	if (store_fd == -1) {
-		pr_err("could not open storage dir '%s', %s\n", path_buf, strerror(errno));
-		goto e_storefd;
-	}
+/* config values live until exit, so keep our own copies of them */
+static int cfg_str(const char **dst, const char *v)
+{
+	char *c = strdup(v);
+	if (!c)
+		return -1;
+	*dst = c;
+	return 0;
+}
 
-	/* store some data! */
-	int core_fd = openat(store_fd, "core", O_CREAT|O_WRONLY, 0644);
-	if (core_fd == -1) {
-		pr_err("could not open core file: %s\n", strerror(errno));
-		goto e_corefd;
+static int cfg_compress(const char *v)
+{
+	if (!strcmp(v, "none")) {
+		cfg.compress = COMPRESS_NONE;
+		return 0;
 	}
 
-	r = copy_file_to_fd(core_fd, stdin);
-	if (r < 0) {
-		/* error printing already handled, just avoid storage */
-		unlinkat(store_fd, "core", 0);
+	if (!strcmp(v, "auto")) {
+		cfg.compress = COMPRESS_AUTO;
+		cfg.compress_level = 1;
+		return 0;
 	}
 
-	close(core_fd);
+	char *end;
+	long l = strtol(v, &end, 10);
+	if (*end != '\0' || l < 1 || l > 9)
+		return -1;
 
-	int info_fd = openat(store_fd, "info.txt", O_CREAT|O_WRONLY, 0644);
-	if (info_fd == -1) {
-		pr_err("could not open info.txt file: %s\n", strerror(errno));
-		goto e_infofd;
-	}
+	cfg.compress = COMPRESS_FIXED;
+	cfg.compress_level = l;
+	return 0;
+}
 
-	dprintf(info_fd,
-			"pid: %ju\n"
-			"uid: %ju\n"
-			"gid: %ju\n"
-			"signal: %ju\n"
-			"timestamp: %ju\n"
-			"comm: %s\n"
-			"path: %s\n",
-		pid, uid, gid, sig, ts, comm, path);
+static int cfg_isolation(const char *v)
+{
+	if (!strcmp(v, "none"))
+		cfg.isolation = ISOLATE_NONE;
+	else if (!strcmp(v, "polite"))
+		cfg.isolation = ISOLATE_POLITE;
+	else if (!strcmp(v, "fast"))
+		cfg.isolation = ISOLATE_FAST;
+	else
+		return -1;
+	return 0;
+}
 
-	e = EXIT_SUCCESS;
+static int cfg_cgroup(const char *v)
+{
+	if (v[0] != '/')
+		return -1;
+	return cfg_str(&cfg.cgroup, v);
+}
 
-	close(info_fd);
-e_infofd:
-	close(core_fd);
-e_corefd:
-	close(store_fd);
-e_storefd:
-	closedir(d);
-e_opendir:
-	return e;
+static int cfg_cgroup_io_max(const char *v)
+{
+	return cfg_str(&cfg.cgroup_io_max, v);
 }
 
-static void fclosep(FILE **p)
+static int cfg_cgroup_cpu_max(const char *v)
 {
-	if (*p)
-		fclose(*p);
+	return cfg_str(&cfg.cgroup_cpu_max, v);
 }
 
-static int setup_temporal(const char *path)
+static int cfg_cgroup_memory_max(const char *v)
 {
-	pr_info("registering using path '%s'\n", path);
+	return cfg_str(&cfg.cgroup_memory_max, v);
+}
 
-	__attribute__((cleanup(fclosep)))
-	FILE *f = fopen("/proc/sys/kernel/core_pattern", "w");
-	if (!f) {
-		pr_err("could not open /proc/sys/kernel/core_pattern file to configure system: %s\n", strerror(errno));
+/* A byte count, with an optional K, M, G or T (binary) suffix */
+static int parse_size(const char *v, uint64_t *out)
+{
+	char *end;
+	errno = 0;
+	uintmax_t n = strtoumax(v, &end, 10);
+	if (errno || end == v)
 		return -1;
-	}
 
-	int r = fprintf(f, "|%s store %%P %%u %%g %%s %%t %%c %%e %%E", path);
-	if (r <= 0) {
-		pr_err("failed to write to core_pattern (but open worked): %s\n", strerror(errno));
-		return -1;
+	unsigned shift = 0;
+	switch (*end) {
+	case 'T': shift += 10; /* fallthrough */
+	case 'G': shift += 10; /* fallthrough */
+	case 'M': shift += 10; /* fallthrough */
+	case 'K': shift += 10;
+		end++;
+		break;
 	}
 
+	if (*end != '\0' || (shift && n > (UINT64_MAX >> shift)))
+		return -1;
+	*out = (uint64_t)n << shift;
 	return 0;
 }
 
-static int setup_perm(const char *path)
+static int cfg_bandwidth(const char *v)
 {
-	/* TODO: use create+rename to avoid intermediate */
-	__attribute__((cleanup(fclosep)))
-	FILE *f = fopen("/etc/sysctl.d/80-dumpctl.conf", "w");
-	if (!f) {
-		pr_err("could not open /etc/sysctl.d/80-dumpctl.conf file to configure system: %s\n", strerror(errno));
-		return -1;
+	return parse_size(v, &cfg.bandwidth);
+}
+
+/* 'uid=<uid> <weight>' or 'comm=<comm> <weight>' */
+static int cfg_bandwidth_weight(const char *v)
+{
+	struct bw_weight w = { 0 };
+	const char *sp = strchr(v, ' ');
+	if (!sp)
+		return -1;
+
+	char *end;
+	unsigned long wt = strtoul(sp + 1, &end, 10);
+	if (*end != '\0' || wt == 0 || wt > 1000)
+		return -1;
+	w.weight = wt;
+
+	if (!strncmp(v, "uid=", 4)) {
+		w.is_uid = true;
+		w.uid = strtoumax(v + 4, &end, 10);
+		if (end != sp)
+			return -1;
+	} else if (!strncmp(v, "comm=", 5)) {
+		size_t l = sp - (v + 5);
+		if (l == 0 || l >= sizeof(w.comm))
+			return -1;
+		memcpy(w.comm, v + 5, l);
+	} else {
+		return -1;
+	}
+
+	struct bw_weight *n = realloc(cfg.bw_weights, (cfg.bw_weights_ct + 1) * sizeof(*n));
+	if (!n)
+		return -1;
+	n[cfg.bw_weights_ct++] = w;
+	cfg.bw_weights = n;
+	return 0;
+}
+
+static int cfg_staging_dir(const char *v)
+{
+	if (v[0] != '/')
+		return -1;
+	return cfg_str(&cfg.staging_dir, v);
+}
+
+static int cfg_staging_max(const char *v)
+{
+	return parse_size(v, &cfg.staging_max);
+}
+
+static int cfg_max_use(const char *v)
+{
+	return parse_size(v, &cfg.max_use);
+}
+
+static int cfg_keep_per_signature(const char *v)
+{
+	char *end;
+	long l = strtol(v, &end, 10);
+	if (*end != '\0' || l < 0 || l > 1000000)
+		return -1;
+
+	cfg.keep_latest = l;
+	return 0;
+}
+
+static int cfg_metadata(const char *v)
+{
+	if (!strcmp(v, "file"))
+		cfg.metadata = METADATA_FILE;
+	else if (!strcmp(v, "xattr"))
+		cfg.metadata = METADATA_XATTR;
+	else
+		return -1;
+	return 0;
+}
+
+static int cfg_keep_binaries(const char *v)
+{
+	if (!strcmp(v, "yes"))
+		cfg.keep_binaries = true;
+	else if (!strcmp(v, "no"))
+		cfg.keep_binaries = false;
+	else
+		return -1;
+	return 0;
+}
+
+static int cfg_auto_triage(const char *v)
+{
+	if (!strcmp(v, "yes"))
+		cfg.auto_triage = true;
+	else if (!strcmp(v, "no"))
+		cfg.auto_triage = false;
+	else
+		return -1;
+	return 0;
+}
+
+static int cfg_encrypt_key(const char *v)
+{
+	if (v[0] != '/')
+		return -1;
+	return cfg_str(&cfg.encrypt_key, v);
+}
+
+static int cfg_backend(const char *v)
+{
+	if (!strcmp(v, "dir"))
+		cfg.backend = BACKEND_DIR;
+	else if (!strcmp(v, "ring"))
+		cfg.backend = BACKEND_RING;
+	else
+		return -1;
+	return 0;
+}
+
+static int cfg_ring_file(const char *v)
+{
+	return cfg_str(&cfg.ring_file, v);
+}
+
+static int cfg_ring_size(const char *v)
+{
+	if (parse_size(v, &cfg.ring_size) < 0 || cfg.ring_size < 64 * CFG_FRAME_SIZE)
+		return -1;
+	return 0;
+}
+
+/* 'unix:<path>' */
+static int cfg_sink(const char *v)
+{
+	struct sockaddr_un sa;
+	if (strncmp(v, "unix:", 5) || !v[5] || strlen(v + 5) >= sizeof(sa.sun_path)
+			|| cfg.sinks_ct == ARRAY_SIZE(cfg.sinks))
+		return -1;
+	return cfg_str(&cfg.sinks[cfg.sinks_ct++], v);
+}
+
+/* 'pgrp|cgroup [<comm>]' */
+static int cfg_group_capture(const char *v)
+{
+	struct group_rule r = { 0 };
+	size_t l = strcspn(v, " ");
+	if (l == 4 && !strncmp(v, "pgrp", 4))
+		r.by = GROUP_PGRP;
+	else if (l == 6 && !strncmp(v, "cgroup", 6))
+		r.by = GROUP_CGROUP;
+	else
+		return -1;
+
+	if (v[l]) {
+		const char *comm = v + l + 1;
+		if (!*comm || strlen(comm) >= sizeof(r.comm))
+			return -1;
+		strcpy(r.comm, comm);
+	}
+
+	struct group_rule *n = realloc(cfg.group_rules, (cfg.group_rules_ct + 1) * sizeof(*n));
+	if (!n)
+		return -1;
+	n[cfg.group_rules_ct++] = r;
+	cfg.group_rules = n;
+	return 0;
+}
+
+static int cfg_group_capture_max(const char *v)
+{
+	char *end;
+	long l = strtol(v, &end, 10);
+	if (*end != '\0' || l < 1 || l > GROUP_MAX)
+		return -1;
+
+	cfg.group_max = l;
+	return 0;
+}
+
+#define REDACT_PAT(n, l, t, mn, mx) { n, l, sizeof(l) - 1, t, mn, mx, false }
+static const struct redact_pat redact_builtin[] = {
+	REDACT_PAT("aws-access-key", "AKIA", RC_UPPER | RC_DIGIT, 16, 16),
+	REDACT_PAT("aws-access-key", "ASIA", RC_UPPER | RC_DIGIT, 16, 16),
+	REDACT_PAT("github-token", "ghp_", RC_ALNUM, 36, 36),
+	REDACT_PAT("github-token", "gho_", RC_ALNUM, 36, 36),
+	REDACT_PAT("github-token", "ghu_", RC_ALNUM, 36, 36),
+	REDACT_PAT("github-token", "ghs_", RC_ALNUM, 36, 36),
+	REDACT_PAT("github-token", "github_pat_", RC_ALNUM | RC_TOKEN, 22, 255),
+	REDACT_PAT("slack-token", "xoxb-", RC_ALNUM | RC_TOKEN, 10, 255),
+	REDACT_PAT("slack-token", "xoxp-", RC_ALNUM | RC_TOKEN, 10, 255),
+	REDACT_PAT("stripe-key", "sk_live_", RC_ALNUM, 16, 255),
+	/* any '-----BEGIN ... PRIVATE KEY-----' block, up to its END line */
+	{ "private-key", "-----BEGIN ", 11, RC_ALNUM | RC_BASE64 | RC_SPACE, 64, 16384, true },
+};
+
+/* 'builtin' for the patterns above, otherwise a literal prefix of our own */
+static int cfg_redact(const char *v)
+{
+	const struct redact_pat *add = redact_builtin;
+	size_t ct = ARRAY_SIZE(redact_builtin);
+	struct redact_pat own;
+	if (strcmp(v, "builtin")) {
+		own = (struct redact_pat){ "custom", NULL, strlen(v), RC_ALNUM | RC_TOKEN | RC_BASE64, 0, 255 };
+		/* what we overwrite with must not start a match */
+		if (own.lit_len < 4 || v[0] == '*' || cfg_str(&own.lit, v) < 0)
+			return -1;
+		add = &own;
+		ct = 1;
+	}
+
+	struct redact_pat *n = realloc(cfg.redact, (cfg.redact_ct + ct) * sizeof(*n));
+	if (!n)
+		return -1;
+	memcpy(n + cfg.redact_ct, add, ct * sizeof(*n));
+	cfg.redact = n;
+	cfg.redact_ct += ct;
+	return 0;
+}
+
+static const struct cfg_key {
+	const char *name;
+	int (*parse)(const char *value);
+} cfg_keys[] = {
+	{ "compress", cfg_compress },
+	{ "isolation", cfg_isolation },
+	{ "cgroup", cfg_cgroup },
+	{ "cgroup-io-max", cfg_cgroup_io_max },
+	{ "cgroup-cpu-max", cfg_cgroup_cpu_max },
+	{ "cgroup-memory-max", cfg_cgroup_memory_max },
+	{ "bandwidth", cfg_bandwidth },
+	{ "bandwidth-weight", cfg_bandwidth_weight },
+	{ "staging-dir", cfg_staging_dir },
+	{ "staging-max", cfg_staging_max },
+	{ "max-use", cfg_max_use },
+	{ "keep-per-signature", cfg_keep_per_signature },
+	{ "metadata", cfg_metadata },
+	{ "keep-binaries", cfg_keep_binaries },
+	{ "auto-triage", cfg_auto_triage },
+	{ "redact", cfg_redact },
+	{ "encrypt-key", cfg_encrypt_key },
+	{ "backend", cfg_backend },
+	{ "ring-file", cfg_ring_file },
+	{ "ring-size", cfg_ring_size },
+	{ "group-capture", cfg_group_capture },
+	{ "group-capture-max", cfg_group_capture_max },
+	{ "sink", cfg_sink },
+};
+
+static char *strtrim(char *s)
+{
+	while (isspace((unsigned char)*s))
+		s++;
+	char *e = s + strlen(s);
+	while (e > s && isspace((unsigned char)e[-1]))
+		e--;
+	*e = '\0';
+	return s;
+}
+
+/*
+ * The config is a series of 'key: value' lines, the same format as info.txt.
+ * '#' starts a comment. Unknown keys & bad values are reported but do not stop
+ * us from using the rest of the file.
+ */
+static int config_load(const char *path, bool must_exist)
+{
+	__attribute__((cleanup(fclosep)))
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		if (errno == ENOENT && !must_exist)
+			return 0;
+		pr_err("could not open config '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	char line[1024];
+	unsigned lineno = 0;
+	int err = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		char *c = strchr(line, '#');
+		if (c)
+			*c = '\0';
+
+		char *k = strtrim(line);
+		if (!*k)
+			continue;
+
+		char *sep = strchr(k, ':');
+		if (!sep) {
+			pr_err("%s:%u: expected 'key: value'\n", path, lineno);
+			err++;
+			continue;
+		}
+		*sep = '\0';
+		k = strtrim(k);
+		char *v = strtrim(sep + 1);
+
+		size_t i;
+		for (i = 0; i < ARRAY_SIZE(cfg_keys); i++)
+			if (!strcmp(cfg_keys[i].name, k))
+				break;
+
+		if (i == ARRAY_SIZE(cfg_keys)) {
+			pr_warn("%s:%u: unknown setting '%s'\n", path, lineno, k);
+			continue;
+		}
+
+		if (cfg_keys[i].parse(v) < 0) {
+			pr_err("%s:%u: bad value for %s: '%s'\n", path, lineno, k, v);
+			err++;
+		}
+	}
+
+	return err ? -1 : 0;
+}
+
+enum act {
+	ACT_NONE,
+	ACT_SETUP,
+	ACT_STORE,
+	ACT_INFO,
+	ACT_GDB,
+	ACT_LIST,
+	ACT_MIGRATE,
+	ACT_EXTRACT,
+	ACT_EXPORT,
+	ACT_BENCH,
+	ACT_SERVE,
+	ACT_TRIAGE,
+	ACT_SEARCH,
+	ACT_SIMILAR,
+	ACT_CLUSTER,
+	ACT_VACUUM,
+	ACT_GREP,
+	ACT_DIFF,
+	ACT_ANALYZE_STORAGE,
+	ACT_SNAPSHOT,
+};
+
+static const struct act_name {
+	const char *name;
+	enum act act;
+} act_names[] = {
+	{ "setup", ACT_SETUP },
+	{ "store", ACT_STORE },
+	{ "info", ACT_INFO },
+	{ "gdb", ACT_GDB },
+	{ "list", ACT_LIST },
+	{ "migrate", ACT_MIGRATE },
+	{ "extract", ACT_EXTRACT },
+	{ "export", ACT_EXPORT },
+	{ "bench", ACT_BENCH },
+	{ "serve", ACT_SERVE },
+	{ "triage", ACT_TRIAGE },
+	{ "search", ACT_SEARCH },
+	{ "similar", ACT_SIMILAR },
+	{ "cluster", ACT_CLUSTER },
+	{ "vacuum", ACT_VACUUM },
+	{ "grep", ACT_GREP },
+	{ "diff", ACT_DIFF },
+	{ "analyze-storage", ACT_ANALYZE_STORAGE },
+	{ "snapshot", ACT_SNAPSHOT },
+};
+
+static enum act parse_act(const char *action)
+{
+	size_t i;
+	for (i = 0; i < ARRAY_SIZE(act_names); i++)
+		if (!strcmp(act_names[i].name, action))
+			return act_names[i].act;
+	return ACT_NONE;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	unsigned err = 0;
+	while (len) {
+		if (err > 10) {
+			pr_err("too many errors while writing\n");
+			return -1;
+		}
+
+		ssize_t wl = write(fd, p, len);
+		if (wl == 0) {
+			/* ??? */
+			pr_warn("write returned zero bytes written, will retry\n");
+			err++;
+			continue;
+		}
+
+		if (wl < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_warn("write failed due to %s\n", strerror(errno));
+			err++;
+			continue;
+		}
+
+		p += wl;
+		len -= wl;
+	}
+
+	return 0;
+}
+
+/*
+ * Sharing storage bandwidth between concurrent stores.
+ *
+ * Every store maps the same small file in the storage dir. It holds one token
+ * bucket refilled at 'bandwidth' bytes/sec and a slot per running store. Each
+ * slot has a virtual time that advances by bytes written / weight, and only
+ * stores whose virtual time is near the lowest of the active stores may take
+ * tokens (stride scheduling). A store that starts late or goes idle (while
+ * compressing, for example) enters at the current lowest virtual time, so it
+ * gets its share without being owed for the time it wasn't writing.
+ *
+ * Access is serialized with flock(), taken once per frame. A store that dies
+ * releases the lock and has its slot reclaimed by the next one to look.
+ */
+#define BW_MAGIC "DCBW0001"
+#define BW_SLOTS 64
+/* weights are scaled by this so small shares don't vanish in rounding */
+#define BW_VT_SCALE 1024
+/* how far ahead of the slowest active store one may run */
+#define BW_VT_WINDOW ((uint64_t)CFG_FRAME_SIZE * 4 * BW_VT_SCALE)
+/* a slot that hasn't asked for tokens in this long is idle */
+#define BW_IDLE_NS (200 * 1000 * 1000ULL)
+/* stores get a boosted weight until they've written this much */
+#define BW_SMALL_CORE (64 * 1024 * 1024)
+#define BW_SMALL_BOOST 4
+/* longest we sleep before looking at the bucket again */
+#define BW_SLEEP_MAX_NS (1000 * 1000 * 1000ULL)
+
+struct bw_slot {
+	int32_t pid;
+	uint32_t weight;
+	uint64_t vtime;
+	uint64_t last_ns;
+};
+
+struct bw_shared {
+	char magic[8];
+	uint64_t refill_ns;
+	int64_t tokens;
+	struct bw_slot slot[BW_SLOTS];
+};
+
+struct bw {
+	int fd;
+	struct bw_shared *sh;
+	struct bw_slot *me;
+	uint64_t weight;
+	uint64_t bytes;
+	uint64_t wait_ns;
+};
+
+static unsigned bw_weight_for(uintmax_t uid, const char *comm)
+{
+	unsigned w = 1;
+	size_t i;
+	/* last matching line wins */
+	for (i = 0; i < cfg.bw_weights_ct; i++) {
+		struct bw_weight *bw = &cfg.bw_weights[i];
+		if (bw->is_uid ? bw->uid == uid : !strcmp(bw->comm, comm))
+			w = bw->weight;
+	}
+	return w;
+}
+
+static bool bw_slot_active(struct bw_slot *s, uint64_t now)
+{
+	if (!s->pid)
+		return false;
+	if (kill(s->pid, 0) == -1 && errno == ESRCH) {
+		s->pid = 0;
+		return false;
+	}
+	return now - s->last_ns < BW_IDLE_NS;
+}
+
+/* Lowest virtual time of the active stores other than us, or UINT64_MAX */
+static uint64_t bw_min_vtime(struct bw *bw, uint64_t now)
+{
+	uint64_t min = UINT64_MAX;
+	size_t i;
+	for (i = 0; i < BW_SLOTS; i++) {
+		struct bw_slot *s = &bw->sh->slot[i];
+		if (s == bw->me || !bw_slot_active(s, now))
+			continue;
+		if (s->vtime < min)
+			min = s->vtime;
+	}
+	return min;
+}
+
+static int bw_open(struct bw *bw, int dir_fd, uintmax_t uid, const char *comm)
+{
+	memset(bw, 0, sizeof(*bw));
+	bw->fd = -1;
+	if (!cfg.bandwidth)
+		return 0;
+
+	int fd = openat(dir_fd, ".bandwidth", O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+	if (fd == -1) {
+		pr_warn("could not open bandwidth file: %s\n", strerror(errno));
+		return -1;
+	}
+
+	flock(fd, LOCK_EX);
+	struct stat st;
+	if (fstat(fd, &st) == -1 || ((size_t)st.st_size < sizeof(*bw->sh)
+				&& ftruncate(fd, sizeof(*bw->sh)) == -1)) {
+		pr_warn("could not size bandwidth file: %s\n", strerror(errno));
+		goto e_close;
+	}
+
+	bw->sh = mmap(NULL, sizeof(*bw->sh), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (bw->sh == MAP_FAILED) {
+		pr_warn("could not map bandwidth file: %s\n", strerror(errno));
+		bw->sh = NULL;
+		goto e_close;
+	}
+
+	uint64_t now = now_ns();
+	if (memcmp(bw->sh->magic, BW_MAGIC, sizeof(bw->sh->magic))) {
+		memset(bw->sh, 0, sizeof(*bw->sh));
+		memcpy(bw->sh->magic, BW_MAGIC, sizeof(bw->sh->magic));
+		bw->sh->refill_ns = now;
+	}
+
+	size_t i;
+	for (i = 0; i < BW_SLOTS; i++) {
+		struct bw_slot *s = &bw->sh->slot[i];
+		if (!s->pid || (kill(s->pid, 0) == -1 && errno == ESRCH)) {
+			bw->me = s;
+			break;
+		}
+	}
+
+	if (!bw->me) {
+		/* too many stores at once: we just don't take part */
+		pr_warn("no free bandwidth slot, not limiting this store\n");
+		munmap(bw->sh, sizeof(*bw->sh));
+		bw->sh = NULL;
+		goto e_close;
+	}
+
+	uint64_t min = bw_min_vtime(bw, now);
+	bw->me->pid = getpid();
+	bw->me->vtime = min == UINT64_MAX ? 0 : min;
+	bw->me->last_ns = now;
+	bw->weight = bw_weight_for(uid, comm);
+	bw->fd = fd;
+	flock(fd, LOCK_UN);
+	return 0;
+
+e_close:
+	flock(fd, LOCK_UN);
+	close(fd);
+	return -1;
+}
+
+/* Wait until we may write 'n' more bytes */
+static void bw_take(struct bw *bw, size_t n)
+{
+	if (bw->fd == -1)
+		return;
+
+	uint64_t start = now_ns();
+	uint64_t rate = cfg.bandwidth;
+	/* allow bursts of up to 1/10th of a second */
+	int64_t burst = rate / 10 > CFG_FRAME_SIZE ? rate / 10 : CFG_FRAME_SIZE;
+	uint64_t w = bw->weight * BW_VT_SCALE;
+	if (bw->bytes < BW_SMALL_CORE)
+		w *= BW_SMALL_BOOST;
+
+	for (;;) {
+		flock(bw->fd, LOCK_EX);
+		struct bw_shared *sh = bw->sh;
+		uint64_t now = now_ns();
+
+		/*
+		 * Refill, only as far as the time it takes to fill the bucket, so
+		 * long idle times don't overflow. The clock starts over on reboot,
+		 * leaving refill_ns in the future: start with a full bucket then.
+		 */
+		uint64_t dt = now - sh->refill_ns;
+		if (now < sh->refill_ns || sh->tokens > burst
+				|| dt >= (double)(burst - sh->tokens) * 1e9 / rate)
+			sh->tokens = burst;
+		else
+			sh->tokens += (double)dt * rate / 1e9;
+		sh->refill_ns = now;
+
+		uint64_t min = bw_min_vtime(bw, now);
+		/* coming back from idle: don't claim credit for the time away */
+		if (now - bw->me->last_ns >= BW_IDLE_NS && min != UINT64_MAX
+				&& bw->me->vtime < min)
+			bw->me->vtime = min;
+		bw->me->last_ns = now;
+
+		bool my_turn = min == UINT64_MAX || bw->me->vtime <= min + BW_VT_WINDOW;
+		if (my_turn && sh->tokens >= 0) {
+			/* may go into debt for a large frame, others wait it out */
+			sh->tokens -= n;
+			bw->me->vtime += (uint64_t)n * BW_VT_SCALE * BW_VT_SCALE / w;
+			flock(bw->fd, LOCK_UN);
+			break;
+		}
+
+		uint64_t sleep_ns = 1000000;
+		if (my_turn)
+			sleep_ns = (double)-sh->tokens * 1e9 / rate + 1000;
+		if (sleep_ns > BW_SLEEP_MAX_NS)
+			sleep_ns = BW_SLEEP_MAX_NS;
+		flock(bw->fd, LOCK_UN);
+
+		struct timespec ts = {
+			.tv_sec = sleep_ns / 1000000000,
+			.tv_nsec = sleep_ns % 1000000000,
+		};
+		nanosleep(&ts, NULL);
+	}
+
+	bw->bytes += n;
+	bw->wait_ns += now_ns() - start;
+}
+
+static void bw_info(struct bw *bw, int info_fd)
+{
+	if (bw->fd == -1)
+		return;
+	dprintf(info_fd, "bandwidth-weight: %ju\n"
+			"bandwidth-wait-usec: %ju\n",
+			(uintmax_t)bw->weight,
+			(uintmax_t)bw->wait_ns / 1000);
+}
+
+static void bw_close(struct bw *bw)
+{
+	if (bw->fd == -1)
+		return;
+	flock(bw->fd, LOCK_EX);
+	bw->me->pid = 0;
+	flock(bw->fd, LOCK_UN);
+	munmap(bw->sh, sizeof(*bw->sh));
+	close(bw->fd);
+	bw->fd = -1;
+}
+
+/*
+ * Copy a string into a fixed size field, truncating it and keeping it (comm
+ * can be almost anything) from breaking up tab separated lines.
+ */
+static void index_field(char *dst, size_t len, const char *src)
+{
+	size_t i;
+	for (i = 0; i + 1 < len && src[i]; i++)
+		dst[i] = (src[i] == '\t' || src[i] == '\n') ? '?' : src[i];
+	dst[i] = '\0';
+}
+
+/*
+ * The ring backend: every dump goes into one preallocated file, used as a
+ * circular log. A header holds the index of what's in it; writing a new dump
+ * over an old one drops the old one from the index first. No per-dump files
+ * are created, so storing takes no filesystem metadata operations and can't
+ * run out of space.
+ *
+ * Stores take the file's flock for their whole duration, so concurrent stores
+ * go one after the other.
+ */
+#define RING_MAGIC "DCRING01"
+#define RING_ENTRIES 256
+/* what doesn't fit is left out by store_info_text(), with a note */
+#define RING_INFO_MAX 2048
+
+#define RING_COMPLETE 0x1
+
+struct ring_ent {
+	/* 0 = unused */
+	uint64_t seq;
+	/* where the dump starts in the data area, it may wrap around the end */
+	uint64_t off;
+	/* the core as stored, followed by its frame table */
+	uint64_t len;
+	uint64_t frames_len;
+	uint32_t flags;
+	char name[64];
+	char core_name[16];
+	char info[RING_INFO_MAX];
+};
+
+struct ring_hdr {
+	char magic[8];
+	uint64_t size;
+	uint64_t data_off;
+	uint64_t data_size;
+	/* where the next dump starts */
+	uint64_t head;
+	uint64_t seq;
+	struct ring_ent ent[RING_ENTRIES];
+};
+
+struct ring {
+	int fd;
+	struct ring_hdr *h;
+	struct ring_ent *cur;
+};
+
+static int ring_open(struct ring *r, int dir_fd, bool create)
+{
+	const char *path = cfg.ring_file ? cfg.ring_file : "ring";
+	r->fd = openat(dir_fd, path, O_RDWR|O_CLOEXEC|(create ? O_CREAT : 0), 0600);
+	r->h = NULL;
+	r->cur = NULL;
+	if (r->fd == -1) {
+		pr_err("could not open ring file '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	flock(r->fd, LOCK_EX);
+	struct stat st;
+	if (fstat(r->fd, &st) == -1)
+		goto e_close;
+
+	if ((uint64_t)st.st_size < sizeof(*r->h)) {
+		if (!create) {
+			pr_err("ring file '%s' is not set up\n", path);
+			goto e_close;
+		}
+
+		pr_notice("preallocating %ju byte ring file '%s'\n", (uintmax_t)cfg.ring_size, path);
+		int e = posix_fallocate(r->fd, 0, cfg.ring_size);
+		if (e) {
+			pr_err("could not allocate ring file: %s\n", strerror(e));
+			goto e_close;
+		}
+		st.st_size = cfg.ring_size;
+	}
+
+	r->h = mmap(NULL, sizeof(*r->h), PROT_READ|PROT_WRITE, MAP_SHARED, r->fd, 0);
+	if (r->h == MAP_FAILED) {
+		pr_err("could not map ring header: %s\n", strerror(errno));
+		r->h = NULL;
+		goto e_close;
+	}
+
+	if (memcmp(r->h->magic, RING_MAGIC, sizeof(r->h->magic))) {
+		if (!create) {
+			pr_err("'%s' is not a ring file\n", path);
+			goto e_close;
+		}
+		memset(r->h, 0, sizeof(*r->h));
+		r->h->size = st.st_size;
+		r->h->data_off = (sizeof(*r->h) + 4095) & ~4095ULL;
+		r->h->data_size = st.st_size - r->h->data_off;
+		r->h->seq = 1;
+		memcpy(r->h->magic, RING_MAGIC, sizeof(r->h->magic));
+	}
+
+	return 0;
+
+e_close:
+	if (r->h)
+		munmap(r->h, sizeof(*r->h));
+	r->h = NULL;
+	close(r->fd);
+	r->fd = -1;
+	return -1;
+}
+
+static void ring_close(struct ring *r)
+{
+	if (r->fd == -1)
+		return;
+	msync(r->h, sizeof(*r->h), MS_SYNC);
+	munmap(r->h, sizeof(*r->h));
+	close(r->fd);
+	r->fd = -1;
+}
+
+static void ring_begin(struct ring *r, const char *name, const char *core_name)
+{
+	struct ring_ent *e = NULL;
+	size_t i;
+	/* a free entry, or the oldest one */
+	for (i = 0; i < RING_ENTRIES; i++) {
+		struct ring_ent *c = &r->h->ent[i];
+		if (!e || c->seq < e->seq)
+			e = c;
+	}
+
+	memset(e, 0, sizeof(*e));
+	e->seq = r->h->seq++;
+	e->off = r->h->head;
+	index_field(e->name, sizeof(e->name), name);
+	index_field(e->core_name, sizeof(e->core_name), core_name);
+	r->cur = e;
+}
+
+/* Drop any dump (other than the one being written) using [off, off+len) */
+static void ring_clobber(struct ring *r, uint64_t off, uint64_t len)
+{
+	uint64_t ds = r->h->data_size;
+	size_t i;
+	for (i = 0; i < RING_ENTRIES; i++) {
+		struct ring_ent *e = &r->h->ent[i];
+		if (!e->seq || e == r->cur)
+			continue;
+		uint64_t to_e = (e->off + ds - off) % ds;
+		uint64_t from_e = (off + ds - e->off) % ds;
+		if (to_e < len || from_e < e->len)
+			e->seq = 0;
+	}
+}
+
+static int ring_write(struct ring *r, const void *data, size_t len)
+{
+	struct ring_hdr *h = r->h;
+	if (r->cur->len + len > h->data_size) {
+		pr_err("core does not fit in ring file\n");
+		return -1;
+	}
+
+	ring_clobber(r, h->head, len);
+	const uint8_t *p = data;
+	while (len) {
+		size_t n = h->data_size - h->head < len ? h->data_size - h->head : len;
+		ssize_t w = pwrite(r->fd, p, n, h->data_off + h->head);
+		if (w <= 0) {
+			pr_err("could not write to ring file: %s\n", w ? strerror(errno) : "no space");
+			return -1;
+		}
+		h->head = (h->head + w) % h->data_size;
+		r->cur->len += w;
+		p += w;
+		len -= w;
+	}
+	return 0;
+}
+
+static void ring_end(struct ring *r, const char *info)
+{
+	snprintf(r->cur->info, sizeof(r->cur->info), "%s", info);
+	r->cur->flags |= RING_COMPLETE;
+	r->cur = NULL;
+}
+
+static void ring_abort(struct ring *r)
+{
+	r->h->head = r->cur->off;
+	r->cur->seq = 0;
+	r->cur = NULL;
+}
+
+static int ring_read(struct ring *r, struct ring_ent *e, uint64_t off, void *buf, size_t len)
+{
+	struct ring_hdr *h = r->h;
+	uint8_t *p = buf;
+	uint64_t pos = (e->off + off) % h->data_size;
+	while (len) {
+		size_t n = h->data_size - pos < len ? h->data_size - pos : len;
+		ssize_t rl = pread(r->fd, p, n, h->data_off + pos);
+		if (rl <= 0)
+			return -1;
+		pos = (pos + rl) % h->data_size;
+		p += rl;
+		len -= rl;
+	}
+	return 0;
+}
+
+/*
+ * Encrypted cores ('core.enc', 'core.gz.enc') start with this header. Each
+ * frame, as it would otherwise have been stored, follows as a uint32_t length,
+ * its AES-256-GCM ciphertext and tag. Frame i uses the nonce with i xored into
+ * its last 8 bytes, and authenticates this header & its index too, so frames
+ * can't be reordered or moved between cores. Host byte order.
+ */
+#define ENC_MAGIC "DCENC001"
+#define ENC_TAG_LEN 16
+#define ENC_FRAME_OVERHEAD (sizeof(uint32_t) + ENC_TAG_LEN)
+
+struct enc_hdr {
+	char magic[8];
+	uint8_t key_id[8];
+	uint8_t nonce[12];
+	uint32_t frame_size;
+};
+
+static int hex_val(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* The key file holds 32 raw bytes or 64 hex digits */
+static int key_load(uint8_t key[32], uint8_t key_id[8])
+{
+	int fd = open(cfg.encrypt_key, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) {
+		pr_err("could not open key file '%s': %s\n", cfg.encrypt_key, strerror(errno));
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 077))
+		pr_warn("key file '%s' is accessible by other users\n", cfg.encrypt_key);
+
+	char buf[129];
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n == 32) {
+		memcpy(key, buf, 32);
+	} else if (n >= 64) {
+		buf[n] = '\0';
+		char *h = strtrim(buf);
+		size_t i;
+		if (strlen(h) != 64)
+			goto e_fmt;
+		for (i = 0; i < 32; i++) {
+			int hi = hex_val(h[2 * i]), lo = hex_val(h[2 * i + 1]);
+			if (hi < 0 || lo < 0)
+				goto e_fmt;
+			key[i] = hi << 4 | lo;
+		}
+	} else {
+		goto e_fmt;
+	}
+
+	uint8_t md[EVP_MAX_MD_SIZE];
+	if (!EVP_Digest(key, 32, md, NULL, EVP_sha256(), NULL)) {
+		pr_err("could not hash key\n");
+		return -1;
+	}
+	memcpy(key_id, md, 8);
+	return 0;
+
+e_fmt:
+	pr_err("key file '%s' must hold 32 bytes or 64 hex digits\n", cfg.encrypt_key);
+	return -1;
+}
+
+static void enc_iv(const struct enc_hdr *h, uint64_t idx, uint8_t iv[12])
+{
+	size_t i;
+	memcpy(iv, h->nonce, 12);
+	for (i = 0; i < 8; i++)
+		iv[4 + i] ^= idx >> (8 * i);
+}
+
+/* 'out' needs room for len + ENC_FRAME_OVERHEAD bytes */
+static int enc_frame(EVP_CIPHER_CTX *c, const struct enc_hdr *h, uint64_t idx,
+		const uint8_t *in, size_t len, uint8_t *out)
+{
+	uint8_t iv[12];
+	uint32_t l = len;
+	int ol, fl;
+	enc_iv(h, idx, iv);
+	memcpy(out, &l, sizeof(l));
+	if (!EVP_EncryptInit_ex(c, NULL, NULL, NULL, iv)
+			|| !EVP_EncryptUpdate(c, NULL, &ol, (const uint8_t *)h, sizeof(*h))
+			|| !EVP_EncryptUpdate(c, NULL, &ol, (const uint8_t *)&idx, sizeof(idx))
+			|| !EVP_EncryptUpdate(c, out + sizeof(l), &ol, in, len)
+			|| !EVP_EncryptFinal_ex(c, out + sizeof(l) + ol, &fl)
+			|| !EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_GCM_GET_TAG, ENC_TAG_LEN, out + sizeof(l) + len))
+		return -1;
+	return 0;
+}
+
+/* 'out' needs room for in_len - ENC_FRAME_OVERHEAD bytes */
+static int dec_frame(EVP_CIPHER_CTX *c, const struct enc_hdr *h, uint64_t idx,
+		uint8_t *in, size_t in_len, uint8_t *out, size_t *out_len)
+{
+	uint8_t iv[12];
+	uint32_t l;
+	int ol, fl;
+	if (in_len < ENC_FRAME_OVERHEAD)
+		return -1;
+	memcpy(&l, in, sizeof(l));
+	if (l != in_len - ENC_FRAME_OVERHEAD)
+		return -1;
+
+	enc_iv(h, idx, iv);
+	if (!EVP_DecryptInit_ex(c, NULL, NULL, NULL, iv)
+			|| !EVP_DecryptUpdate(c, NULL, &ol, (const uint8_t *)h, sizeof(*h))
+			|| !EVP_DecryptUpdate(c, NULL, &ol, (const uint8_t *)&idx, sizeof(idx))
+			|| !EVP_DecryptUpdate(c, out, &ol, in + sizeof(l), l)
+			|| !EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_GCM_SET_TAG, ENC_TAG_LEN, in + sizeof(l) + l)
+			|| EVP_DecryptFinal_ex(c, out + ol, &fl) <= 0)
+		return -1;
+	*out_len = l;
+	return 0;
+}
+
+/* An AES-256-GCM context using the configured key */
+static EVP_CIPHER_CTX *cipher_new(bool encrypt, uint8_t key_id[8])
+{
+	uint8_t key[32];
+	if (key_load(key, key_id) < 0)
+		return NULL;
+
+	EVP_CIPHER_CTX *c = EVP_CIPHER_CTX_new();
+	int ok = c && (encrypt
+			? EVP_EncryptInit_ex(c, EVP_aes_256_gcm(), NULL, key, NULL)
+			: EVP_DecryptInit_ex(c, EVP_aes_256_gcm(), NULL, key, NULL));
+	OPENSSL_cleanse(key, sizeof(key));
+	if (!ok) {
+		pr_err("could not set up AES-256-GCM\n");
+		EVP_CIPHER_CTX_free(c);
+		return NULL;
+	}
+	return c;
+}
+
+/* Where each frame of the core starts, in the core & in the stored file */
+struct frame_ent {
+	uint64_t raw_off;
+	uint64_t off;
+};
+
+/*
+ * The 'frames' file stored next to a compressed core: this header, followed by
+ * nframes + 1 frame_ent (the final one holding the total sizes). Host byte
+ * order.
+ */
+#define FRAMES_MAGIC "DCFRAME1"
+struct frames_hdr {
+	char magic[8];
+	uint32_t frame_size;
+	uint32_t nframes;
+};
+
+/*
+ * Finding where any of a few patterns may start in a buffer, by their first 2
+ * bytes: 16 positions at a time with SSE2 (or a byte at a time through a
+ * bitmap of the pairs). Candidates are then checked in full by the caller.
+ */
+struct pair_set {
+	uint8_t pairs[32][2];
+	size_t npairs;
+	/* bit (b0 << 8 | b1) set if some pattern starts with b0 b1 */
+	uint64_t map[65536 / 64];
+};
+
+static int pair_set_add(struct pair_set *ps, uint8_t b0, uint8_t b1)
+{
+	unsigned pair = b0 << 8 | b1;
+	if (ps->map[pair / 64] & (1ULL << (pair % 64)))
+		return 0;
+	if (ps->npairs == ARRAY_SIZE(ps->pairs))
+		return -1;
+
+	ps->map[pair / 64] |= 1ULL << (pair % 64);
+	ps->pairs[ps->npairs][0] = b0;
+	ps->pairs[ps->npairs][1] = b1;
+	ps->npairs++;
+	return 0;
+}
+
+/*
+ * Call at() on each candidate in buf[0, scan), in order, skipping to where it
+ * says to resume. Candidates may run on to len.
+ */
+static void pair_scan(const struct pair_set *ps, uint8_t *buf, size_t len, size_t scan,
+		size_t (*at)(void *ctx, uint8_t *buf, size_t len, size_t pos), void *ctx)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	__m128i first[ARRAY_SIZE(ps->pairs)], second[ARRAY_SIZE(ps->pairs)];
+	size_t j, k;
+	for (j = 0; j < ps->npairs; j++) {
+		first[j] = _mm_set1_epi8(ps->pairs[j][0]);
+		second[j] = _mm_set1_epi8(ps->pairs[j][1]);
+	}
+
+	while (i < scan && i + 65 <= len) {
+		/* 64 bytes at a time, as nearly all of them have no candidates */
+		__m128i b0[4], b1[4], m[4];
+		for (k = 0; k < 4; k++) {
+			b0[k] = _mm_loadu_si128((const __m128i *)(buf + i + k * 16));
+			b1[k] = _mm_loadu_si128((const __m128i *)(buf + i + k * 16 + 1));
+			m[k] = _mm_setzero_si128();
+		}
+		for (j = 0; j < ps->npairs; j++)
+			for (k = 0; k < 4; k++)
+				m[k] = _mm_or_si128(m[k], _mm_and_si128(_mm_cmpeq_epi8(b0[k], first[j]),
+									_mm_cmpeq_epi8(b1[k], second[j])));
+
+		uint64_t bits = 0;
+		for (k = 0; k < 4; k++)
+			bits |= (uint64_t)_mm_movemask_epi8(m[k]) << (k * 16);
+
+		/* past the end of what at() last consumed */
+		size_t next = i;
+		while (bits) {
+			size_t pos = i + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			if (pos >= scan)
+				break;
+			if (pos >= next)
+				next = at(ctx, buf, len, pos);
+		}
+		i = next > i + 64 ? next : i + 64;
+	}
+#endif
+
+	for (; i < scan && i + 1 < len; ) {
+		unsigned pair = buf[i] << 8 | buf[i + 1];
+		if (ps->map[pair / 64] & (1ULL << (pair % 64)))
+			i = at(ctx, buf, len, i);
+		else
+			i++;
+	}
+}
+
+/*
+ * Overwriting secrets in cores as they go by. Candidates are found by the
+ * first 2 bytes of each pattern's prefix with pair_scan(), and then checked
+ * against the patterns in full.
+ */
+static struct redactor {
+	bool ready;
+	struct pair_set ps;
+	/* the longest match, less one */
+	size_t hold;
+} redactor;
+
+static uint8_t redact_class(uint8_t c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return RC_UPPER;
+	if (c >= 'a' && c <= 'z')
+		return RC_LOWER;
+	if (c >= '0' && c <= '9')
+		return RC_DIGIT;
+	switch (c) {
+	case '-': case '_':
+		return RC_TOKEN;
+	case '+': case '/': case '=':
+		return RC_BASE64;
+	case ' ': case '\r': case '\n':
+		return RC_SPACE;
+	}
+	return 0;
+}
+
+static int redactor_init(void)
+{
+	struct redactor *r = &redactor;
+	if (r->ready)
+		return 0;
+
+	size_t i;
+	for (i = 0; i < cfg.redact_ct; i++) {
+		const struct redact_pat *p = &cfg.redact[i];
+		if (p->lit_len + p->max_tail - 1 > r->hold)
+			r->hold = p->lit_len + p->max_tail - 1;
+		if (pair_set_add(&r->ps, p->lit[0], p->lit[1]) < 0) {
+			pr_err("too many redact patterns\n");
+			return -1;
+		}
+	}
+
+	r->ready = true;
+	return 0;
+}
+
+/*
+ * Where the body of the PEM block at 'b' starts, past '-----BEGIN <type>
+ * PRIVATE KEY-----', or 0 if it's not a private key (a certificate, say)
+ */
+static size_t redact_pem_body(const uint8_t *b, size_t len)
+{
+	static const char key[] = "PRIVATE KEY";
+	size_t n = 11;
+	/* 'RSA ', 'ENCRYPTED ' & co */
+	while (n < len && n < 64 && ((b[n] >= 'A' && b[n] <= 'Z') || b[n] == ' '))
+		n++;
+	if (n - 11 < sizeof(key) - 1 || memcmp(b + n - (sizeof(key) - 1), key, sizeof(key) - 1)
+			|| len - n < 5 || memcmp(b + n, "-----", 5))
+		return 0;
+	return n + 5;
+}
+
+/* Length of a match of 'p' at 'b', 0 if there isn't one */
+static size_t redact_match(const struct redact_pat *p, const uint8_t *b, size_t len)
+{
+	if (len < p->lit_len || memcmp(b, p->lit, p->lit_len))
+		return 0;
+
+	size_t n = p->lit_len;
+	size_t end = len < n + p->max_tail ? len : n + p->max_tail;
+	if (p->pem && !(n = redact_pem_body(b, end)))
+		return 0;
+	size_t tail = n;
+	for (; n < end; n++) {
+		if (redact_class(b[n]) & p->tail)
+			continue;
+		/* an encrypted key's 'Proc-Type: 4,ENCRYPTED' & co, not the END */
+		if (p->pem && (b[n] == ':' || b[n] == ',' || (b[n] == '-'
+				&& end - n >= 5 && memcmp(b + n, "-----", 5))))
+			continue;
+		break;
+	}
+	if (n - tail < p->min_tail)
+		return 0;
+	return n;
+}
+
+struct redact_stats {
+	uint64_t matches;
+	uint64_t bytes;
+};
+
+/* Check the candidate at buf[at], returns where scanning should resume */
+static size_t redact_at(void *ctx, uint8_t *buf, size_t len, size_t at)
+{
+	struct redact_stats *st = ctx;
+	size_t i;
+	for (i = 0; i < cfg.redact_ct; i++) {
+		size_t n = redact_match(&cfg.redact[i], buf + at, len - at);
+		if (n) {
+			memset(buf + at, '*', n);
+			st->matches++;
+			st->bytes += n;
+			return at + n;
+		}
+	}
+	return at + 1;
+}
+
+/*
+ * Overwrite matches that start in buf[0, scan). They may run on to len, so
+ * the caller must leave redactor.hold bytes past scan unless at the end.
+ */
+static void redact_buf(struct redact_stats *st, uint8_t *buf, size_t len, size_t scan)
+{
+	pair_scan(&redactor.ps, buf, len, scan, redact_at, st);
+}
+
+/*
+ * Each frame read goes down a chain of stages, picked per store by
+ * store_out_init(). A stage is handed a reference to the frame as the stage
+ * before left it, and either works on it in place (redact) or points it at
+ * its own buffer holding the result (compress, encrypt): nothing is copied
+ * from one stage to the next. A new stage is an entry in stage_defs[] and a
+ * line in store_out_init().
+ */
+enum stage_id {
+	/* not run, copy_file_to_fd() does it, but timed like the others */
+	STAGE_READ,
+	STAGE_REDACT,
+	STAGE_SINK,
+	STAGE_COMPRESS,
+	STAGE_ENCRYPT,
+	STAGE_WRITE,
+	STAGE_MAX,
+};
+
+struct frame_ref {
+	uint8_t *data;
+	size_t len;
+	/* bytes readable from data, past len too: context a stage may look
+	 * at, but which goes out with the next frame */
+	size_t avail;
+};
+
+/*
+ * Somewhere else the core is streamed to as it's stored, through a pipe to a
+ * process of its own. A sink that can't keep up is cut off rather than
+ * slowing down the store. A stream that was not cut off ends with SINK_END,
+ * with the size of the core before it, which the forwarder gets from the store
+ * through a second pipe.
+ */
+#define SINK_PIPE_SIZE (4 * 1024 * 1024)
+#define SINK_END "end: %020ju\n"
+#define SINK_END_LEN 26
+
+struct sink {
+	const char *target;
+	/* the pipes to its forwarder, -1 once cut off or done */
+	int fd, end_fd;
+	uint64_t sent;
+	bool cut;
+};
+
+struct stage_stat {
+	uint64_t ns;
+	uint64_t bytes_in, bytes_out;
+	/* smoothed per-frame time */
+	uint64_t avg_ns;
+};
+
+/* Where copy_file_to_fd() puts each frame it reads */
+struct store_out {
+	int fd;
+	/* shared bandwidth limit, consulted before each write */
+	struct bw bw;
+
+	/*
+	 * When writing to the staging dir: how much room there is, and where
+	 * to move the core to if it doesn't fit (see store_out_spill()).
+	 */
+	uint64_t limit;
+	int stage_fd;
+	int spill_fd;
+	const char *name;
+
+	/* with the ring backend, everything goes here instead of fd */
+	struct ring *ring;
+
+	/* set when encrypting, see struct enc_hdr */
+	EVP_CIPHER_CTX *cctx;
+	struct enc_hdr eh;
+	uint8_t *ebuf;
+
+	/* deflate level for the next frame, 0 = store uncompressed */
+	int level;
+	bool adaptive;
+	z_stream z;
+	uint8_t *zbuf;
+	size_t zbuf_size;
+
+	/* secrets overwritten so far, when redacting */
+	bool redact;
+	struct redact_stats redacted;
+
+	uint64_t raw_bytes;
+	uint64_t stored_bytes;
+
+	struct frame_ent *frames;
+	size_t nframes;
+	size_t frames_alloc;
+	unsigned level_frames[10];
+
+	enum stage_id chain[STAGE_MAX];
+	size_t chain_len;
+
+	struct sink sinks[SINK_MAX];
+	size_t sinks_ct;
+	/* sinks get input tee()'d to them, before it's read */
+	bool tee;
+	struct stage_stat stats[STAGE_MAX];
+};
+
+static int store_out_init(struct store_out *o)
+{
+	memset(o, 0, sizeof(*o));
+	o->fd = -1;
+	o->bw.fd = -1;
+	o->stage_fd = -1;
+	o->spill_fd = -1;
+
+	if (cfg.compress != COMPRESS_NONE) {
+		/* 15 + 16: window bits + a gzip wrapper, so zcat can read the result */
+		int r = deflateInit2(&o->z, cfg.compress_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+		if (r != Z_OK) {
+			pr_warn("deflateInit failed (%d), storing core uncompressed\n", r);
+		} else if (!(o->zbuf = malloc(o->zbuf_size = deflateBound(&o->z, CFG_FRAME_SIZE)))) {
+			pr_warn("could not allocate compression buffer, storing core uncompressed\n");
+			deflateEnd(&o->z);
+		} else {
+			o->level = cfg.compress_level;
+			o->adaptive = cfg.compress == COMPRESS_AUTO;
+		}
+	}
+
+	if (cfg.redact_ct) {
+		/* nor may we go without this */
+		if (redactor_init() < 0) {
+			pr_err("cannot redact, not storing core\n");
+			return -1;
+		}
+		o->redact = true;
+	}
+
+	if (cfg.encrypt_key) {
+		/* unlike compression, we must not quietly go without this */
+		o->cctx = cipher_new(true, o->eh.key_id);
+		size_t max = o->zbuf ? o->zbuf_size : CFG_FRAME_SIZE;
+		o->ebuf = malloc(max + ENC_FRAME_OVERHEAD);
+		if (!o->cctx || !o->ebuf || getrandom(o->eh.nonce, sizeof(o->eh.nonce), 0) != sizeof(o->eh.nonce)) {
+			pr_err("cannot encrypt, not storing core\n");
+			return -1;
+		}
+		memcpy(o->eh.magic, ENC_MAGIC, sizeof(o->eh.magic));
+		o->eh.frame_size = CFG_FRAME_SIZE;
+	}
+
+	if (o->redact)
+		o->chain[o->chain_len++] = STAGE_REDACT;
+	if (o->level)
+		o->chain[o->chain_len++] = STAGE_COMPRESS;
+	if (o->cctx)
+		o->chain[o->chain_len++] = STAGE_ENCRYPT;
+	o->chain[o->chain_len++] = STAGE_WRITE;
+	return 0;
+}
+
+/* Without SINK_END, for the collectors to see it's incomplete unless ended */
+static void sinks_close(struct sink *sinks, size_t ct)
+{
+	size_t i;
+	for (i = 0; i < ct; i++)
+		if (sinks[i].fd != -1) {
+			close(sinks[i].fd);
+			close(sinks[i].end_fd);
+		}
+}
+
+static void store_out_destroy(struct store_out *o)
+{
+	sinks_close(o->sinks, o->sinks_ct);
+	bw_close(&o->bw);
+	EVP_CIPHER_CTX_free(o->cctx);
+	free(o->ebuf);
+	if (o->zbuf) {
+		deflateEnd(&o->z);
+		free(o->zbuf);
+	}
+	free(o->frames);
+}
+
+static const char *store_out_name(struct store_out *o)
+{
+	if (o->cctx)
+		return o->level ? "core.gz.enc" : "core.enc";
+	return o->level ? "core.gz" : "core";
+}
+
+/* Cores that are compressed or encrypted are stored in frames */
+static bool store_out_framed(struct store_out *o)
+{
+	return o->level || o->cctx;
+}
+
+static int store_out_push_frame(struct store_out *o)
+{
+	if (o->nframes == o->frames_alloc) {
+		size_t n = o->frames_alloc ? o->frames_alloc * 2 : 64;
+		struct frame_ent *fe = realloc(o->frames, n * sizeof(*fe));
+		if (!fe) {
+			pr_err("could not grow frame table\n");
+			return -1;
+		}
+		o->frames = fe;
+		o->frames_alloc = n;
+	}
+
+	o->frames[o->nframes].raw_off = o->raw_bytes;
+	o->frames[o->nframes].off = o->stored_bytes;
+	o->nframes++;
+	return 0;
+}
+
+/*
+ * Copy 'len' bytes from the start of in_fd to out_fd, sharing extents when
+ * the filesystem allows it.
+ */
+static int copy_fd_range(int in_fd, int out_fd, uint64_t len)
+{
+	struct stat st;
+	if (fstat(in_fd, &st) == 0 && (uint64_t)st.st_size == len
+			&& ioctl(out_fd, FICLONE, in_fd) == 0)
+		return 0;
+
+	loff_t in_off = 0, out_off = 0;
+	while ((uint64_t)in_off < len) {
+		ssize_t r = copy_file_range(in_fd, &in_off, out_fd, &out_off, len - in_off, 0);
+		if (r > 0)
+			continue;
+		if (r == 0)
+			break;
+		if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+			return -1;
+
+		/* no in-kernel copy between these files, do it ourselves */
+		__attribute__((cleanup(freep)))
+		uint8_t *buf = malloc(CFG_FRAME_SIZE);
+		if (!buf)
+			return -1;
+		while ((uint64_t)in_off < len) {
+			size_t want = len - in_off < CFG_FRAME_SIZE ? len - in_off : CFG_FRAME_SIZE;
+			ssize_t rl = pread(in_fd, buf, want, in_off);
+			if (rl <= 0)
+				return -1;
+			/* at out_off: copy_file_range() didn't move out_fd's position */
+			ssize_t done = 0;
+			while (done < rl) {
+				ssize_t wl = pwrite(out_fd, buf + done, rl - done, out_off + done);
+				if (wl <= 0)
+					return -1;
+				done += wl;
+			}
+			in_off += rl;
+			out_off += rl;
+		}
+	}
+
+	return (uint64_t)in_off == len ? 0 : -1;
+}
+
+/*
+ * The core outgrew the room left in the staging dir: copy what we have so far
+ * into the storage dir, put it in place of the symlink to the staged core and
+ * keep going there.
+ */
+static int store_out_spill(struct store_out *o)
+{
+	pr_notice("staging dir full, moving core to storage dir\n");
+	int fd = openat(o->spill_fd, ".spill", O_CREAT|O_RDWR|O_TRUNC, 0644);
+	if (fd == -1) {
+		pr_err("could not open core file in storage dir: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (copy_fd_range(o->fd, fd, o->stored_bytes) < 0
+			|| lseek(fd, 0, SEEK_END) == -1
+			|| renameat(o->spill_fd, ".spill", o->spill_fd, o->name) < 0) {
+		pr_err("could not move core out of staging dir: %s\n", strerror(errno));
+		unlinkat(o->spill_fd, ".spill", 0);
+		close(fd);
+		return -1;
+	}
+
+	unlinkat(o->stage_fd, o->name, 0);
+	close(o->fd);
+	o->fd = fd;
+	o->limit = 0;
+	return 0;
+}
+
+static int store_out_write(struct store_out *o, const void *data, size_t len)
+{
+	if (o->ring) {
+		bw_take(&o->bw, len);
+		return ring_write(o->ring, data, len);
+	}
+
+	if (o->limit && o->stored_bytes + len > o->limit && store_out_spill(o) < 0)
+		return -1;
+
+	/* the bandwidth limit is for the storage dir, staging is meant to be fast */
+	if (!o->limit)
+		bw_take(&o->bw, len);
+
+	return write_all(o->fd, data, len);
+}
+
+static void ewma(uint64_t *avg, uint64_t sample)
+{
+	*avg = *avg ? (*avg * 3 + sample) / 4 : sample;
+}
+
+/*
+ * Pick the level for the next frame. Storing is one serial loop, so each frame
+ * costs the time we wait on the kernel for input, plus compressing, plus
+ * writing. When the compressor is the slowest of those, back off. When we
+ * spend much more time waiting on input or on the disk than compressing, the
+ * CPU is idle anyway: spend it making the output (and the writes) smaller.
+ */
+static void store_out_adapt(struct store_out *o)
+{
+	uint64_t t_in = o->stats[STAGE_READ].avg_ns, t_out = o->stats[STAGE_WRITE].avg_ns;
+	uint64_t wait = t_in > t_out ? t_in : t_out;
+	uint64_t t_z = o->stats[STAGE_COMPRESS].avg_ns + o->stats[STAGE_ENCRYPT].avg_ns;
+
+	if (t_z > wait + wait / 4) {
+		if (o->level > 1)
+			o->level--;
+	} else if (t_z < wait / 2) {
+		if (o->level < 9)
+			o->level++;
+	}
+}
+
+static int stage_redact(struct store_out *o, struct frame_ref *f)
+{
+	redact_buf(&o->redacted, f->data, f->avail, f->len);
+	return 0;
+}
+
+static int stage_compress(struct store_out *o, struct frame_ref *f)
+{
+	deflateReset(&o->z);
+	o->z.next_out = o->zbuf;
+	o->z.avail_out = o->zbuf_size;
+	int r = deflateParams(&o->z, o->level, Z_DEFAULT_STRATEGY);
+	if (r != Z_OK) {
+		pr_err("deflateParams failed: %d\n", r);
+		return -1;
+	}
+
+	o->z.next_in = f->data;
+	o->z.avail_in = f->len;
+	r = deflate(&o->z, Z_FINISH);
+	if (r != Z_STREAM_END) {
+		pr_err("deflate failed: %d\n", r);
+		return -1;
+	}
+
+	f->data = o->zbuf;
+	f->avail = f->len = o->zbuf_size - o->z.avail_out;
+	o->level_frames[o->level]++;
+	return 0;
+}
+
+static int stage_encrypt(struct store_out *o, struct frame_ref *f)
+{
+	if (enc_frame(o->cctx, &o->eh, o->nframes - 1, f->data, f->len, o->ebuf) < 0) {
+		pr_err("encrypting frame failed\n");
+		return -1;
+	}
+	f->data = o->ebuf;
+	f->avail = f->len += ENC_FRAME_OVERHEAD;
+	return 0;
+}
+
+static int stage_write(struct store_out *o, struct frame_ref *f)
+{
+	if (store_out_write(o, f->data, f->len) < 0)
+		return -1;
+	o->stored_bytes += f->len;
+	return 0;
+}
+
+static void sink_cut(struct sink *s)
+{
+	pr_warn("sink %s can't keep up, cut off after %ju bytes\n", s->target, (uintmax_t)s->sent);
+	close(s->fd);
+	close(s->end_fd);
+	s->fd = -1;
+	s->cut = true;
+}
+
+/* When the input can't be tee()'d, each sink gets a copy of the frame */
+static int stage_sink(struct store_out *o, struct frame_ref *f)
+{
+	size_t i;
+	for (i = 0; i < o->sinks_ct; i++) {
+		struct sink *s = &o->sinks[i];
+		if (s->fd == -1)
+			continue;
+		ssize_t w = write(s->fd, f->data, f->len);
+		if (w > 0)
+			s->sent += w;
+		if (w != (ssize_t)f->len)
+			sink_cut(s);
+	}
+	return 0;
+}
+
+static const struct stage_def {
+	const char *name;
+	int (*run)(struct store_out *o, struct frame_ref *f);
+} stage_defs[STAGE_MAX] = {
+	[STAGE_READ] = { "read", NULL },
+	[STAGE_REDACT] = { "redact", stage_redact },
+	[STAGE_SINK] = { "sink", stage_sink },
+	[STAGE_COMPRESS] = { "compress", stage_compress },
+	[STAGE_ENCRYPT] = { "encrypt", stage_encrypt },
+	[STAGE_WRITE] = { "write", stage_write },
+};
+
+static void stage_account(struct store_out *o, enum stage_id id, uint64_t ns,
+		size_t in, size_t out)
+{
+	struct stage_stat *st = &o->stats[id];
+	st->ns += ns;
+	st->bytes_in += in;
+	st->bytes_out += out;
+	ewma(&st->avg_ns, ns);
+}
+
+/*
+ * Stream what's in the pipe to 'sock' until the pipe is closed, leaving the
+ * socket blocking again. splice() holds the pipe's lock while it waits on the
+ * socket, stalling store's tee() into the same pipe, so the socket is
+ * nonblocking and we wait for room outside it.
+ */
+static int sink_forward(int in, int sock)
+{
+	struct pollfd out = { .fd = sock, .events = POLLOUT };
+	struct pollfd pin = { .fd = in, .events = POLLIN };
+	int fl = fcntl(sock, F_GETFL);
+	if (fl == -1 || fcntl(sock, F_SETFL, fl | O_NONBLOCK) == -1)
+		return -1;
+	for (;;) {
+		ssize_t n = splice(in, NULL, sock, NULL, CFG_FRAME_SIZE,
+				SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (n > 0)
+			continue;
+		if (n == 0)
+			return fcntl(sock, F_SETFL, fl) == -1 ? -1 : 0;
+		if (errno == EAGAIN) {
+			if ((poll(&out, 1, -1) == -1 || poll(&pin, 1, -1) == -1) && errno != EINTR)
+				return -1;
+			continue;
+		}
+		if (errno != EINVAL)
+			return -1;
+
+		/* no splice to this socket, copy */
+		uint8_t buf[65536];
+		if (fcntl(sock, F_SETFL, fl) == -1)
+			return -1;
+		while ((n = read(in, buf, sizeof(buf))) > 0)
+			if (write_all(sock, buf, n) < 0)
+				return -1;
+		return n < 0 ? -1 : 0;
+	}
+}
+
+/* The stream was complete: have the forwarders end it with SINK_END */
+static void store_out_sinks_end(struct store_out *o)
+{
+	size_t i;
+	for (i = 0; i < o->sinks_ct; i++) {
+		struct sink *s = &o->sinks[i];
+		if (s->fd != -1)
+			dprintf(s->end_fd, SINK_END, (uintmax_t)s->sent);
+	}
+}
+
+/*
+ * Close every fd from 3 up but the ones in 'keep', for a process that outlives
+ * us and mustn't hold on to our locks or pipes.
+ */
+static void close_fds_except(int *keep, size_t n)
+{
+	size_t i, j;
+	for (i = 1; i < n; i++)
+		for (j = i; j > 0 && keep[j - 1] > keep[j]; j--) {
+			int t = keep[j];
+			keep[j] = keep[j - 1];
+			keep[j - 1] = t;
+		}
+
+	unsigned lo = 3;
+	for (i = 0; i < n; i++) {
+		if ((unsigned)keep[i] < lo)
+			continue;
+		if ((unsigned)keep[i] > lo)
+			close_range(lo, keep[i] - 1, 0);
+		lo = keep[i] + 1;
+	}
+	close_range(lo, ~0U, 0);
+}
+
+/*
+ * Read up to 'len' bytes from the pipe 'fd', having first tee()'d them to
+ * each sink: the data is duplicated in the kernel, never copied by us. A sink
+ * whose pipe is full can't be given the same bytes as the others, and is cut
+ * off.
+ */
+static ssize_t sink_tee_read(struct store_out *o, int fd, void *buf, size_t len)
+{
+	/* tee() can't tell us the input is empty from a sink being full */
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	while (poll(&pfd, 1, -1) == -1)
+		if (errno != EINTR)
+			return -1;
+
+	/* all that's there, to each sink: one that takes less is cut off, not waited for */
+	int avail;
+	if (ioctl(fd, FIONREAD, &avail) == -1 || avail <= 0)
+		return read(fd, buf, len);
+	size_t t = (size_t)avail < len ? (size_t)avail : len;
+	size_t i;
+	for (i = 0; i < o->sinks_ct; i++) {
+		struct sink *s = &o->sinks[i];
+		if (s->fd == -1)
+			continue;
+		ssize_t n = tee(fd, s->fd, t, SPLICE_F_NONBLOCK);
+		if (n == (ssize_t)t)
+			s->sent += n;
+		else
+			sink_cut(s);
+	}
+
+	size_t got = 0;
+	while (got < t) {
+		ssize_t r = read(fd, (uint8_t *)buf + got, t - got);
+		if (r <= 0) {
+			if (r == -1 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		got += r;
+	}
+	return got;
+}
+
+/*
+ * Run a frame of 'len' bytes at 'data' down the chain. 'avail' bytes may be
+ * read there, see struct frame_ref. 't_in' is how long reading it took.
+ */
+static int store_out_frame(struct store_out *o, uint8_t *data, size_t len, size_t avail,
+		uint64_t t_in)
+{
+	if (o->cctx && !o->stored_bytes) {
+		if (store_out_write(o, &o->eh, sizeof(o->eh)) < 0)
+			return -1;
+		o->stored_bytes += sizeof(o->eh);
+	}
+
+	if (store_out_framed(o) && store_out_push_frame(o) < 0)
+		return -1;
+
+	stage_account(o, STAGE_READ, t_in, len, len);
+	struct frame_ref f = { data, len, avail };
+	size_t i;
+	for (i = 0; i < o->chain_len; i++) {
+		size_t in = f.len;
+		uint64_t t0 = now_ns();
+		if (stage_defs[o->chain[i]].run(o, &f) < 0)
+			return -1;
+		stage_account(o, o->chain[i], now_ns() - t0, in, f.len);
+	}
+
+	o->raw_bytes += len;
+	if (o->adaptive)
+		store_out_adapt(o);
+	return 0;
+}
+
+/* Write out the frame table for a compressed or encrypted core */
+static int store_out_finish(struct store_out *o, int store_fd)
+{
+	if (!store_out_framed(o))
+		return 0;
+
+	if (store_out_push_frame(o) < 0)
+		return -1;
+
+	struct frames_hdr h = {
+		.magic = FRAMES_MAGIC,
+		.frame_size = CFG_FRAME_SIZE,
+		.nframes = o->nframes - 1,
+	};
+
+	if (o->ring) {
+		/* the frame table follows the core in the ring */
+		size_t fl = o->nframes * sizeof(*o->frames);
+		if (ring_write(o->ring, &h, sizeof(h)) < 0
+				|| ring_write(o->ring, o->frames, fl) < 0)
+			return -1;
+		o->ring->cur->frames_len = sizeof(h) + fl;
+		return 0;
+	}
+
+	int fd = openat(store_fd, "frames", O_CREAT|O_WRONLY|O_TRUNC, 0644);
+	if (fd == -1) {
+		pr_err("could not open frames file: %s\n", strerror(errno));
+		return -1;
+	}
+
+	int r = write_all(fd, &h, sizeof(h));
+	if (r == 0)
+		r = write_all(fd, o->frames, o->nframes * sizeof(*o->frames));
+	close(fd);
+	return r;
+}
+
+static void store_out_info(struct store_out *o, int info_fd)
+{
+	dprintf(info_fd, "size: %ju\n", (uintmax_t)o->raw_bytes);
+	bw_info(&o->bw, info_fd);
+	if (o->redact)
+		dprintf(info_fd, "redactions: %ju\n"
+				"redacted-bytes: %ju\n",
+				(uintmax_t)o->redacted.matches, (uintmax_t)o->redacted.bytes);
+	dprintf(info_fd, "stage-usec: %s=%ju", stage_defs[STAGE_READ].name,
+			(uintmax_t)o->stats[STAGE_READ].ns / 1000);
+	size_t i;
+	for (i = 0; i < o->chain_len; i++)
+		dprintf(info_fd, " %s=%ju", stage_defs[o->chain[i]].name,
+				(uintmax_t)o->stats[o->chain[i]].ns / 1000);
+	dprintf(info_fd, "\n");
+	for (i = 0; i < o->sinks_ct; i++)
+		dprintf(info_fd, "sink-%zu: %s %ju %s\n", i, o->sinks[i].target,
+				(uintmax_t)o->sinks[i].sent, o->sinks[i].cut ? "cut" : o->tee ? "tee" : "copy");
+	if (o->cctx)
+		dprintf(info_fd, "encrypt: aes-256-gcm\n"
+				"encrypt-key-id: %02x%02x%02x%02x%02x%02x%02x%02x\n",
+				o->eh.key_id[0], o->eh.key_id[1], o->eh.key_id[2], o->eh.key_id[3],
+				o->eh.key_id[4], o->eh.key_id[5], o->eh.key_id[6], o->eh.key_id[7]);
+	if (!o->level)
+		return;
+
+	dprintf(info_fd, "compress: gzip\n"
+			"stored-size: %ju\n"
+			"compress-levels:",
+			(uintmax_t)o->stored_bytes);
+	for (i = 0; i < ARRAY_SIZE(o->level_frames); i++)
+		if (o->level_frames[i])
+			dprintf(info_fd, " %zu=%u", i, o->level_frames[i]);
+	dprintf(info_fd, "\n");
+}
+
+/*
+ * Copy from a FILE * into storage, a frame at a time. The time spent waiting
+ * on the kernel for each frame is passed along so compression can adapt.
+ */
+static ssize_t copy_file_to_fd(struct store_out *o, FILE *in_file, uint64_t limit)
+{
+	size_t read_bytes = 0;
+	unsigned err = 0;
+	bool done_reading = false;
+	uint64_t t_in = 0;
+	__attribute__((cleanup(freep)))
+	struct fbuf *f = malloc(sizeof(*f));
+	if (!f) {
+		pr_err("could not allocate copy buffer\n");
+		return -1;
+	}
+	fbuf_init(f);
+
+	for (;;) {
+		if (err > 10) {
+			pr_err("too many errors while copying file\n");
+			return -1;
+		}
+
+		uint64_t t0 = now_ns();
+		ssize_t rl;
+		if (o->tee) {
+			rl = sink_tee_read(o, fileno(in_file), fbuf_space_ptr(f), fbuf_space(f));
+		} else {
+			rl = fread(fbuf_space_ptr(f), 1, fbuf_space(f), in_file);
+			if (rl == 0 && !feof(in_file))
+				rl = -1;
+		}
+		t_in += now_ns() - t0;
+		if (rl == 0) {
+			/* done reading! */
+			done_reading = true;
+		} else if (rl < 0) {
+			pr_warn("Error reading input core file\n");
+			err++;
+			continue;
+		}
+		fbuf_feed(f, rl);
+		read_bytes += rl;
+
+		/* only hand over full frames, except at the end */
+		if (fbuf_space(f) != 0 && !done_reading)
+			continue;
+
+		/*
+		 * A secret may straddle frames, so keep back the end of this one
+		 * (it starts the next), unless we're done.
+		 */
+		size_t out = fbuf_data(f);
+		if (o->redact && !done_reading)
+			out -= redactor.hold;
+
+		if (out) {
+			if (store_out_frame(o, fbuf_data_ptr(f), out, fbuf_data(f), t_in) < 0)
+				return -1;
+			fbuf_eat(f, out);
+			t_in = 0;
+		}
+
+		if (done_reading)
+			return read_bytes;
+
+		if (read_bytes >= limit) {
+			pr_warn("not storing core, too large\n");
+			return -1;
+		}
+	}
+}
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+static int ioprio_set_self(int class, int data)
+{
+	return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (class << IOPRIO_CLASS_SHIFT) | data);
+}
+
+/* Find 'key' in a file of 'key value' lines (like cpu.stat) */
+static int read_keyed_u64(int dir_fd, const char *file, const char *key, uint64_t *v)
+{
+	int fd = openat(dir_fd, file, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	__attribute__((cleanup(fclosep)))
+	FILE *f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return -1;
+	}
+
+	char line[256];
+	size_t kl = strlen(key);
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, key, kl) && line[kl] == ' ') {
+			*v = strtoull(line + kl + 1, NULL, 10);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* The 'total=' stall time of the 'some' line of a PSI file, in usec */
+static int read_pressure(int dir_fd, const char *file, uint64_t *v)
+{
+	int fd = openat(dir_fd, file, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	__attribute__((cleanup(fclosep)))
+	FILE *f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return -1;
+	}
+
+	char line[256];
+	while (fgets(line, sizeof(line), f)) {
+		char *t = strstr(line, "total=");
+		if (!strncmp(line, "some ", 5) && t) {
+			*v = strtoull(t + 6, NULL, 10);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+struct iso_stat {
+	uint64_t nr_throttled;
+	uint64_t throttled_usec;
+	uint64_t cpu_stall_usec;
+	uint64_t io_stall_usec;
+	uint64_t memory_stall_usec;
+	/* from /proc/self/schedstat, ns spent runnable but not running */
+	uint64_t run_delay_ns;
+};
+
+struct isolate {
+	const char *how;
+	int cg_fd;
+	struct iso_stat start;
+};
+
+static void iso_stat_read(struct isolate *iso, struct iso_stat *st)
+{
+	memset(st, 0, sizeof(*st));
+
+	__attribute__((cleanup(fclosep)))
+	FILE *f = fopen("/proc/self/schedstat", "r");
+	if (f) {
+		uint64_t run_ns;
+		if (fscanf(f, "%" SCNu64 " %" SCNu64, &run_ns, &st->run_delay_ns) != 2)
+			st->run_delay_ns = 0;
+	}
+
+	if (iso->cg_fd == -1)
+		return;
+
+	read_keyed_u64(iso->cg_fd, "cpu.stat", "nr_throttled", &st->nr_throttled);
+	read_keyed_u64(iso->cg_fd, "cpu.stat", "throttled_usec", &st->throttled_usec);
+	read_pressure(iso->cg_fd, "cpu.pressure", &st->cpu_stall_usec);
+	read_pressure(iso->cg_fd, "io.pressure", &st->io_stall_usec);
+	read_pressure(iso->cg_fd, "memory.pressure", &st->memory_stall_usec);
+}
+
+/*
+ * Keep a big store from competing with the workload that just crashed (or
+ * the rest of the box) according to the 'isolation' policy. Never fatal: if
+ * we can't isolate, we still store the core.
+ */
+static void isolate_self(struct isolate *iso)
+{
+	iso->how = "none";
+	iso->cg_fd = -1;
+
+	switch (cfg.isolation) {
+	case ISOLATE_NONE:
+		break;
+	case ISOLATE_FAST:
+		if (ioprio_set_self(IOPRIO_CLASS_BE, 0) == -1)
+			pr_warn("could not raise io priority: %s\n", strerror(errno));
+		else
+			iso->how = "fast";
+		break;
+	case ISOLATE_POLITE:
+		iso->cg_fd = open(cfg.cgroup, O_DIRECTORY|O_RDONLY);
+		if (iso->cg_fd != -1) {
+			int fd = openat(iso->cg_fd, "cgroup.procs", O_WRONLY);
+			if (fd != -1 && dprintf(fd, "%d\n", (int)getpid()) > 0) {
+				close(fd);
+				iso->how = "cgroup";
+				break;
+			}
+			pr_warn("could not join cgroup '%s': %s\n", cfg.cgroup, strerror(errno));
+			if (fd != -1)
+				close(fd);
+			close(iso->cg_fd);
+			iso->cg_fd = -1;
+		}
+
+		/* no cgroup (not set up, or no cgroup2): be nice instead */
+		if (ioprio_set_self(IOPRIO_CLASS_IDLE, 0) == -1)
+			pr_warn("could not lower io priority: %s\n", strerror(errno));
+		if (setpriority(PRIO_PROCESS, 0, 19) == -1)
+			pr_warn("could not lower cpu priority: %s\n", strerror(errno));
+		iso->how = "ioprio";
+		break;
+	}
+
+	iso_stat_read(iso, &iso->start);
+}
+
+/*
+ * Record how much we were held back. The cgroup numbers cover every store
+ * running in it at the time, not just this one.
+ */
+static void isolate_info(struct isolate *iso, int info_fd)
+{
+	struct iso_stat end;
+	iso_stat_read(iso, &end);
+
+	dprintf(info_fd, "isolation: %s\n"
+			"run-delay-usec: %ju\n",
+			iso->how,
+			(uintmax_t)(end.run_delay_ns - iso->start.run_delay_ns) / 1000);
+
+	if (iso->cg_fd == -1)
+		return;
+
+	dprintf(info_fd,
+			"throttled-periods: %ju\n"
+			"throttled-cpu-usec: %ju\n"
+			"stall-cpu-usec: %ju\n"
+			"stall-io-usec: %ju\n"
+			"stall-memory-usec: %ju\n",
+			(uintmax_t)(end.nr_throttled - iso->start.nr_throttled),
+			(uintmax_t)(end.throttled_usec - iso->start.throttled_usec),
+			(uintmax_t)(end.cpu_stall_usec - iso->start.cpu_stall_usec),
+			(uintmax_t)(end.io_stall_usec - iso->start.io_stall_usec),
+			(uintmax_t)(end.memory_stall_usec - iso->start.memory_stall_usec));
+}
+
+static void isolate_destroy(struct isolate *iso)
+{
+	if (iso->cg_fd != -1)
+		close(iso->cg_fd);
+}
+
+/*
+ * The index: an append-only log of the storage dir's contents, one tab
+ * separated record per line, the first field giving its kind:
+ *
+ *   D <name> <timestamp> <pid> <uid> <gid> <signal> <comm> <size> <stored-size>
+ *	a dump was stored in '<dir>/<name>'
+ *   S <name> <signature> <frames>
+ *	triage got a backtrace for dump <name>, see triage_signature()
+ *   R <name>
+ *	retention removed dump <name>, see retain_run()
+ *   G <name> pgrp=<pgrp>|cgroup=<path> <pid>,...
+ *	the crash of dump <name> had the listed processes of its group
+ *	snapshotted, see group_capture_start()
+ *
+ * Each record goes out in a single write() to an O_APPEND fd, so concurrent
+ * stores don't interleave. A dump is always found at '<dir>/<name>', whichever
+ * tier its core is on at the moment.
+ */
+__attribute__((format(printf,2,3)))
+static int index_append(int dir_fd, const char *fmt, ...)
+{
+	char buf[1024];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (n < 0 || (size_t)n >= sizeof(buf)) {
+		pr_err("index record too long\n");
+		return -1;
+	}
+
+	int fd = openat(dir_fd, "index", O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+	if (fd == -1) {
+		pr_err("could not open index: %s\n", strerror(errno));
+		return -1;
+	}
+
+	ssize_t r = write(fd, buf, n);
+	close(fd);
+	if (r != n) {
+		pr_err("could not append to index: %s\n", r < 0 ? strerror(errno) : "short write");
+		return -1;
+	}
+	return 0;
+}
+
+/* Bytes used by the (per-dump) directories in the staging dir */
+static uint64_t staging_used(int stage_dir_fd)
+{
+	uint64_t used = 0;
+	int fd = dup(stage_dir_fd);
+	DIR *d = fd == -1 ? NULL : fdopendir(fd);
+	if (!d) {
+		if (fd != -1)
+			close(fd);
+		return 0;
+	}
+
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+		int sub = openat(stage_dir_fd, de->d_name, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+		DIR *sd = sub == -1 ? NULL : fdopendir(sub);
+		if (!sd) {
+			if (sub != -1)
+				close(sub);
+			continue;
+		}
+
+		struct dirent *se;
+		while ((se = readdir(sd))) {
+			struct stat st;
+			if (se->d_name[0] != '.' && fstatat(sub, se->d_name, &st, 0) == 0)
+				used += (uint64_t)st.st_blocks * 512;
+		}
+		closedir(sd);
+	}
+
+	closedir(d);
+	return used;
+}
+
+/*
+ * Make '<staging-dir>/<name>' for a new core, returning its fd & how many bytes
+ * it may hold, or -1 if there's no staging dir or no room in it.
+ */
+static int staging_open(const char *name, uint64_t *room)
+{
+	if (!cfg.staging_dir)
+		return -1;
+
+	if (mkdir(cfg.staging_dir, 0755) == -1 && errno != EEXIST) {
+		pr_warn("could not create staging dir '%s': %s\n", cfg.staging_dir, strerror(errno));
+		return -1;
+	}
+
+	int sfd = open(cfg.staging_dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (sfd == -1) {
+		pr_warn("could not open staging dir '%s': %s\n", cfg.staging_dir, strerror(errno));
+		return -1;
+	}
+
+	uint64_t avail = 0;
+	struct statvfs sv;
+	if (cfg.staging_max) {
+		uint64_t used = staging_used(sfd);
+		if (used < cfg.staging_max)
+			avail = cfg.staging_max - used;
+	} else if (fstatvfs(sfd, &sv) == 0) {
+		/* leave 5% of the filesystem free */
+		uint64_t free_b = (uint64_t)sv.f_bavail * sv.f_frsize;
+		uint64_t reserve = (uint64_t)sv.f_blocks * sv.f_frsize / 20;
+		if (free_b > reserve)
+			avail = free_b - reserve;
+	}
+
+	int fd = -1;
+	if (avail < CFG_FRAME_SIZE) {
+		pr_notice("staging dir full, storing core directly\n");
+	} else if (mkdirat(sfd, name, 0755) == -1) {
+		pr_warn("could not create staging dir for dump: %s\n", strerror(errno));
+	} else {
+		fd = openat(sfd, name, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+		if (fd == -1)
+			unlinkat(sfd, name, AT_REMOVEDIR);
+	}
+
+	close(sfd);
+	*room = avail;
+	return fd;
+}
+
+#define XATTR_PREFIX "user.dumpctl."
+
+/* Copy our xattrs (the dump's metadata, if stored that way) between files */
+static int copy_xattrs(int in_fd, int out_fd)
+{
+	char names[4096];
+	ssize_t nl = flistxattr(in_fd, names, sizeof(names));
+	if (nl < 0)
+		return (errno == ENOTSUP) ? 0 : -1;
+
+	char *n;
+	for (n = names; n < names + nl; n += strlen(n) + 1) {
+		char v[1024];
+		if (strncmp(n, XATTR_PREFIX, strlen(XATTR_PREFIX)))
+			continue;
+		ssize_t vl = fgetxattr(in_fd, n, v, sizeof(v));
+		if (vl < 0 || fsetxattr(out_fd, n, v, vl, 0) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Move the staged files of dump 'name' into place in the storage dir. Each one
+ * replaces the symlink to it with a rename(), so readers of '<dir>/<name>/core'
+ * see either the staged core or the migrated one, never nothing.
+ */
+static int migrate_one(int stage_fd, int dir_fd, const char *name)
+{
+	int sd = openat(stage_fd, name, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (sd == -1)
+		return -1;
+
+	/* a store still writing here holds this lock */
+	if (flock(sd, LOCK_EX|LOCK_NB) == -1) {
+		close(sd);
+		return 0;
+	}
+
+	DIR *d = fdopendir(sd);
+	if (!d) {
+		close(sd);
+		return -1;
+	}
+
+	/* if the dump was deleted meanwhile, just drop the staged files */
+	int dd = openat(dir_fd, name, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	int err = 0;
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (dd == -1) {
+			unlinkat(sd, de->d_name, 0);
+			continue;
+		}
+
+		char tmp[NAME_MAX + 16];
+		snprintf(tmp, sizeof(tmp), ".%s.migrating", de->d_name);
+		int in = openat(sd, de->d_name, O_RDONLY|O_CLOEXEC);
+		int out = openat(dd, tmp, O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC, 0644);
+		struct stat st;
+		if (in == -1 || out == -1 || fstat(in, &st) == -1
+				|| copy_fd_range(in, out, st.st_size) < 0
+				|| copy_xattrs(in, out) < 0
+				|| fsync(out) == -1
+				|| renameat(dd, tmp, dd, de->d_name) == -1) {
+			pr_err("could not migrate '%s/%s': %s\n", name, de->d_name, strerror(errno));
+			unlinkat(dd, tmp, 0);
+			err++;
+		} else {
+			unlinkat(sd, de->d_name, 0);
+		}
+
+		if (in != -1)
+			close(in);
+		if (out != -1)
+			close(out);
+	}
+
+	if (dd != -1)
+		close(dd);
+	closedir(d);
+	if (!err && unlinkat(stage_fd, name, AT_REMOVEDIR) == -1)
+		err++;
+	return err ? -1 : 1;
+}
+
+static int migrate_all(const char *dir)
+{
+	if (!cfg.staging_dir) {
+		pr_err("no staging-dir configured, nothing to migrate\n");
+		return -1;
+	}
+
+	int stage_fd = open(cfg.staging_dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (stage_fd == -1) {
+		pr_err("could not open staging dir '%s': %s\n", cfg.staging_dir, strerror(errno));
+		return -1;
+	}
+
+	int dir_fd = open(dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (dir_fd == -1) {
+		pr_err("could not open storage dir '%s': %s\n", dir, strerror(errno));
+		close(stage_fd);
+		return -1;
+	}
+
+	/* one migrator at a time. Anything stored while we hold this gets
+	 * picked up by the migrator its store starts after we're done. */
+	flock(stage_fd, LOCK_EX);
+
+	int err = 0;
+	for (;;) {
+		unsigned moved = 0;
+		int fd = dup(stage_fd);
+		DIR *d = fd == -1 ? NULL : fdopendir(fd);
+		if (!d) {
+			if (fd != -1)
+				close(fd);
+			err++;
+			break;
+		}
+
+		struct dirent *de;
+		while ((de = readdir(d))) {
+			if (de->d_name[0] == '.')
+				continue;
+			int r = migrate_one(stage_fd, dir_fd, de->d_name);
+			if (r < 0)
+				err++;
+			else if (r > 0)
+				moved++;
+		}
+		closedir(d);
+
+		if (!moved || err)
+			break;
+	}
+
+	close(dir_fd);
+	close(stage_fd);
+	return err ? -1 : 0;
+}
+
+/* Run the migrator detached from the kernel's wait on us */
+static void migrate_spawn(const char *dir)
+{
+	pid_t p = fork();
+	if (p == -1) {
+		pr_warn("could not start migrator: %s\n", strerror(errno));
+		return;
+	}
+
+	if (p) {
+		waitpid(p, NULL, 0);
+		return;
+	}
+
+	setsid();
+	if (fork() != 0)
+		_exit(EXIT_SUCCESS);
+
+	int null_fd = open("/dev/null", O_RDONLY);
+	if (null_fd != -1)
+		dup2(null_fd, STDIN_FILENO);
+	_exit(migrate_all(dir) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/*
+ * The executable & libraries a crashing process had mapped, held open from
+ * before we read the core (after which the process may be gone) until we've
+ * saved them into '<dir>/.build-id/xx/yyyy...', the layout gdb & debuginfod
+ * use. Each build-id is only ever copied once.
+ */
+#define BUILD_ID_DIR ".build-id"
+#define BUILD_ID_MAX 64
+#define BUILD_OBJ_MAX 512
+
+struct build_obj {
+	int fd;
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	/* hex, empty if the object has none */
+	char id[BUILD_ID_MAX * 2 + 1];
+};
+
+struct build_ids {
+	struct build_obj *objs;
+	size_t ct;
+	/* the executable, or -1 */
+	ssize_t exe;
+	/* copied into the store by this dump */
+	unsigned saved;
+};
+
+/* Find the NT_GNU_BUILD_ID note of the ELF file in 'fd', as hex */
+static int elf_build_id(int fd, char *hex, size_t hex_len)
+{
+	unsigned char eh[sizeof(Elf64_Ehdr)];
+	if (pread(fd, eh, sizeof(eh), 0) != sizeof(eh) || memcmp(eh, ELFMAG, SELFMAG))
+		return -1;
+
+	bool is64 = eh[EI_CLASS] == ELFCLASS64;
+	uint64_t phoff;
+	size_t phnum, phentsize;
+	if (is64) {
+		const Elf64_Ehdr *e = (const Elf64_Ehdr *)eh;
+		phoff = e->e_phoff;
+		phnum = e->e_phnum;
+		phentsize = e->e_phentsize;
+	} else {
+		Elf32_Ehdr e;
+		memcpy(&e, eh, sizeof(e));
+		phoff = e.e_phoff;
+		phnum = e.e_phnum;
+		phentsize = e.e_phentsize;
+	}
+	if (phentsize < (is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr)))
+		return -1;
+
+	size_t i;
+	for (i = 0; i < phnum && i < 256; i++) {
+		Elf64_Phdr ph;
+		if (is64) {
+			if (pread(fd, &ph, sizeof(ph), phoff + i * phentsize) != sizeof(ph))
+				return -1;
+		} else {
+			Elf32_Phdr ph32;
+			if (pread(fd, &ph32, sizeof(ph32), phoff + i * phentsize) != sizeof(ph32))
+				return -1;
+			ph.p_type = ph32.p_type;
+			ph.p_offset = ph32.p_offset;
+			ph.p_filesz = ph32.p_filesz;
+		}
+		if (ph.p_type != PT_NOTE || ph.p_filesz > 65536)
+			continue;
+
+		uint8_t notes[65536];
+		if (pread(fd, notes, ph.p_filesz, ph.p_offset) != (ssize_t)ph.p_filesz)
+			continue;
+
+		size_t off = 0;
+		while (off + sizeof(Elf64_Nhdr) <= ph.p_filesz) {
+			Elf64_Nhdr n;
+			memcpy(&n, notes + off, sizeof(n));
+			size_t name_off = off + sizeof(n);
+			size_t desc_off = name_off + ((n.n_namesz + 3) & ~3u);
+			off = desc_off + ((n.n_descsz + 3) & ~3u);
+			if (off > ph.p_filesz)
+				break;
+			if (n.n_type != NT_GNU_BUILD_ID || n.n_namesz != 4
+					|| memcmp(notes + name_off, "GNU", 4)
+					|| n.n_descsz == 0 || n.n_descsz * 2 >= hex_len)
+				continue;
+
+			size_t j;
+			for (j = 0; j < n.n_descsz; j++)
+				sprintf(hex + j * 2, "%02x", notes[desc_off + j]);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* Open everything file backed that 'pid' has mapped, before it goes away */
+static void build_ids_capture(struct build_ids *b, uintmax_t pid)
+{
+	memset(b, 0, sizeof(*b));
+	b->exe = -1;
+
+	char p[128];
+	snprintf(p, sizeof(p), "/proc/%ju/maps", pid);
+	__attribute__((cleanup(fclosep)))
+	FILE *maps = fopen(p, "r");
+	if (!maps) {
+		pr_warn("could not read maps of %ju, not keeping binaries: %s\n", pid, strerror(errno));
+		return;
+	}
+
+	struct stat exe_st;
+	snprintf(p, sizeof(p), "/proc/%ju/exe", pid);
+	if (stat(p, &exe_st) == -1)
+		exe_st.st_ino = 0;
+
+	char line[PATH_MAX + 128];
+	while (fgets(line, sizeof(line), maps) && b->ct < BUILD_OBJ_MAX) {
+		char range[64];
+		unsigned long ino;
+		int path_at = 0;
+		if (sscanf(line, "%63s %*s %*s %*s %lu %n", range, &ino, &path_at) < 2
+				|| !path_at || line[path_at] != '/' || !ino)
+			continue;
+		char *path = line + path_at;
+		path[strcspn(path, "\n")] = '\0';
+
+		size_t i;
+		for (i = 0; i < b->ct; i++)
+			if (b->objs[i].ino == ino && !strcmp(b->objs[i].path, path))
+				break;
+		if (i < b->ct)
+			continue;
+
+		/* map_files gets us the very file mapped, even if since replaced */
+		snprintf(p, sizeof(p), "/proc/%ju/map_files/%s", pid, range);
+		struct stat st;
+		int fd = open(p, O_RDONLY|O_CLOEXEC);
+		if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+			if (fd != -1)
+				close(fd);
+			continue;
+		}
+
+		struct build_obj *n = realloc(b->objs, (b->ct + 1) * sizeof(*n));
+		char *pc = strdup(path);
+		if (!n || !pc) {
+			if (n)
+				b->objs = n;
+			free(pc);
+			close(fd);
+			break;
+		}
+		b->objs = n;
+		struct build_obj *o = &b->objs[b->ct];
+		*o = (struct build_obj) { .fd = fd, .path = pc, .dev = st.st_dev, .ino = ino };
+		if (elf_build_id(fd, o->id, sizeof(o->id)) < 0)
+			o->id[0] = '\0';
+		if (st.st_dev == exe_st.st_dev && st.st_ino == exe_st.st_ino)
+			b->exe = b->ct;
+		b->ct++;
+	}
+}
+
+/* Copy each object into the store, unless its build-id is already there */
+static void build_ids_save(struct build_ids *b, int dir_fd)
+{
+	if (!b->ct)
+		return;
+
+	if (mkdirat(dir_fd, BUILD_ID_DIR, 0755) == -1 && errno != EEXIST) {
+		pr_warn("could not create %s: %s\n", BUILD_ID_DIR, strerror(errno));
+		return;
+	}
+	int bd = openat(dir_fd, BUILD_ID_DIR, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (bd == -1)
+		return;
+
+	size_t i;
+	for (i = 0; i < b->ct; i++) {
+		struct build_obj *o = &b->objs[i];
+		if (!o->id[0])
+			continue;
+
+		char sub[3] = { o->id[0], o->id[1], '\0' };
+		const char *rest = o->id + 2;
+		if (mkdirat(bd, sub, 0755) == -1 && errno != EEXIST)
+			continue;
+		int sd = openat(bd, sub, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+		if (sd == -1)
+			continue;
+		if (faccessat(sd, rest, F_OK, 0) == 0) {
+			close(sd);
+			continue;
+		}
+
+		/* copy under a temporary name, so a half copied object is never
+		 * found under its build-id */
+		char tmp[sizeof(o->id) + 32];
+		snprintf(tmp, sizeof(tmp), ".%s.%d", rest, (int)getpid());
+		struct stat st;
+		int out = -1;
+		if (fstat(o->fd, &st) == 0)
+			out = openat(sd, tmp, O_CREAT|O_EXCL|O_WRONLY|O_CLOEXEC, st.st_mode & 0755);
+		if (out == -1 || copy_fd_range(o->fd, out, st.st_size) < 0
+				|| renameat(sd, tmp, sd, rest) == -1) {
+			pr_warn("could not keep '%s': %s\n", o->path, strerror(errno));
+			unlinkat(sd, tmp, 0);
+		} else {
+			b->saved++;
+		}
+		if (out != -1)
+			close(out);
+		close(sd);
+	}
+	close(bd);
+}
+
+/* 'build-ids' in the dump's directory: '<build-id> <path>' per object */
+static void build_ids_list(struct build_ids *b, int store_fd)
+{
+	if (!b->ct)
+		return;
+	int fd = openat(store_fd, "build-ids", O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd == -1)
+		return;
+	size_t i;
+	for (i = 0; i < b->ct; i++)
+		dprintf(fd, "%s %s\n", b->objs[i].id[0] ? b->objs[i].id : "-", b->objs[i].path);
+	close(fd);
+}
+
+static void build_ids_destroy(struct build_ids *b)
+{
+	size_t i;
+	for (i = 0; i < b->ct; i++) {
+		close(b->objs[i].fd);
+		free(b->objs[i].path);
+	}
+	free(b->objs);
+	b->objs = NULL;
+	b->ct = 0;
+}
+
+/* What the kernel told us about a dump */
+struct dump_meta {
+	uintmax_t pid, uid, gid, sig, ts;
+	const char *comm;
+	const char *path;
+	/* set when keeping binaries */
+	struct build_ids *bids;
+	/* set when captured as part of a group */
+	const char *group;
+	/* what a snapshot had to leave out, if anything */
+	const char *truncated;
+	/* most bytes of core to take, 0 = CFG_CORE_LIMIT */
+	uint64_t limit;
+};
+
+/* info.txt. 'o' is NULL if the core could not be stored. */
+static void store_info(int info_fd, const struct dump_meta *m, struct store_out *o,
+		struct isolate *iso)
+{
+	dprintf(info_fd,
+			"pid: %ju\n"
+			"uid: %ju\n"
+			"gid: %ju\n"
+			"signal: %ju\n"
+			"timestamp: %ju\n"
+			"comm: %s\n"
+			"path: %s\n",
+		m->pid, m->uid, m->gid, m->sig, m->ts, m->comm, m->path);
+	if (m->bids && m->bids->exe != -1 && m->bids->objs[m->bids->exe].id[0])
+		dprintf(info_fd, "build-id: %s\n", m->bids->objs[m->bids->exe].id);
+	if (m->bids)
+		dprintf(info_fd, "binaries: %zu\n"
+				"binaries-saved: %u\n",
+				m->bids->ct, m->bids->saved);
+	if (m->group)
+		dprintf(info_fd, "group: %s\n", m->group);
+	if (m->truncated)
+		dprintf(info_fd, "snapshot-truncated: %s\n", m->truncated);
+	if (o)
+		store_out_info(o, info_fd);
+	else
+		dprintf(info_fd, "error: core not stored\n");
+	isolate_info(iso, info_fd);
+}
+
+/*
+ * The text of info.txt, for when it isn't going into a file of its own. Lines
+ * that don't fit (a very long path, say) are left out, loudly, with a
+ * 'truncated: <full size>' line in their place.
+ */
+static size_t store_info_text(char *buf, size_t len, const struct dump_meta *m,
+		struct store_out *o, struct isolate *iso)
+{
+	size_t il = 0;
+	struct stat st;
+	char *all = NULL;
+	int info_fd = memfd_create("info.txt", MFD_CLOEXEC);
+	if (info_fd != -1) {
+		store_info(info_fd, m, o, iso);
+		if (fstat(info_fd, &st) == 0 && (all = malloc(st.st_size + 1))
+				&& pread(info_fd, all, st.st_size, 0) != st.st_size) {
+			free(all);
+			all = NULL;
+		}
+		close(info_fd);
+	}
+	if (!all) {
+		pr_warn("could not collect dump info\n");
+		buf[0] = '\0';
+		return 0;
+	}
+	all[st.st_size] = '\0';
+
+	/* room for the note, should it be needed */
+	char note[48];
+	size_t nl = snprintf(note, sizeof(note), "truncated: %ju\n", (uintmax_t)st.st_size);
+	bool cut = false;
+	char *l, *e;
+	for (l = all; *l; l = e) {
+		e = strchrnul(l, '\n');
+		e += *e == '\n';
+		if (il + (e - l) + ((size_t)st.st_size > len - 1 ? nl : 0) < len) {
+			memcpy(buf + il, l, e - l);
+			il += e - l;
+		} else {
+			cut = true;
+		}
+	}
+	if (cut) {
+		pr_warn("dump info is %ju bytes, only %zu fit: some of it is left out\n",
+				(uintmax_t)st.st_size, len - 1);
+		memcpy(buf + il, note, nl);
+		il += nl;
+	}
+	buf[il] = '\0';
+	free(all);
+	return il;
+}
+
+/*
+ * Put the metadata on the core as 'user.dumpctl.<key>' xattrs, saving a file
+ * (and an open for everyone reading it). Fails if the filesystem can't do it.
+ */
+static int store_xattrs(int core_fd, const struct dump_meta *m, struct store_out *o,
+		struct isolate *iso)
+{
+	char info[4096];
+	store_info_text(info, sizeof(info), m, o, iso);
+
+	char *l, *save;
+	for (l = strtok_r(info, "\n", &save); l; l = strtok_r(NULL, "\n", &save)) {
+		char *sep = strchr(l, ':');
+		if (!sep)
+			continue;
+		*sep = '\0';
+
+		char name[128];
+		const char *v = sep + 1 + (sep[1] == ' ');
+		snprintf(name, sizeof(name), XATTR_PREFIX "%s", l);
+		if (fsetxattr(core_fd, name, v, strlen(v), 0) < 0) {
+			if (errno != ENOTSUP)
+				pr_warn("could not set xattr %s: %s\n", name, strerror(errno));
+			goto e_remove;
+		}
+	}
+
+	return 0;
+
+e_remove:
+	/* readers prefer the xattrs, don't leave a partial set of them */
+	{
+		char names[4096];
+		ssize_t nl = flistxattr(core_fd, names, sizeof(names));
+		char *n;
+		for (n = names; nl > 0 && n < names + nl; n += strlen(n) + 1)
+			if (!strncmp(n, XATTR_PREFIX, strlen(XATTR_PREFIX)))
+				fremovexattr(core_fd, n);
+	}
+	return -1;
+}
+
+static void store_index(int dir_fd, const char *name, const struct dump_meta *m,
+		uint64_t size, uint64_t stored_size)
+{
+	char comm_f[64];
+	index_field(comm_f, sizeof(comm_f), m->comm);
+	index_append(dir_fd, "D\t%s\t%ju\t%ju\t%ju\t%ju\t%ju\t%s\t%ju\t%ju\n",
+			name, m->ts, m->pid, m->uid, m->gid, m->sig, comm_f,
+			(uintmax_t)size, (uintmax_t)stored_size);
+}
+
+/* Find 'key: value' in the text of an info.txt, copying out the value */
+static bool info_get(const char *info, const char *key, char *buf, size_t len)
+{
+	size_t kl = strlen(key);
+	const char *l = info;
+	while (l && *l) {
+		if (!strncmp(l, key, kl) && l[kl] == ':') {
+			const char *v = l + kl + 1;
+			while (*v == ' ')
+				v++;
+			size_t vl = strcspn(v, "\n");
+			if (vl >= len)
+				vl = len - 1;
+			memcpy(buf, v, vl);
+			buf[vl] = '\0';
+			return true;
+		}
+		l = strchr(l, '\n');
+		if (l)
+			l++;
+	}
+	return false;
+}
+
+static uintmax_t info_get_unum(const char *info, const char *key)
+{
+	char buf[32];
+	if (!info_get(info, key, buf, sizeof(buf)))
+		return 0;
+	return strtoumax(buf, NULL, 10);
+}
+
+/*
+ * Connect the configured sinks and send each a header: the dump's name &
+ * metadata as 'key: value' lines, then a blank line, then the core. Sinks
+ * that can't be reached are skipped. This comes before the store locks or maps
+ * anything, as the forwarders outlive it (and a mapping holds a flock too).
+ * Sinks are sent the plain core, so with encryption there are none.
+ */
+static size_t sinks_open(struct sink *sinks, const char *name, const struct dump_meta *m)
+{
+	size_t i, ct = 0;
+	if (cfg.sinks_ct && cfg.encrypt_key) {
+		pr_warn("not streaming to sinks: cores are encrypted\n");
+		return 0;
+	}
+	for (i = 0; i < cfg.sinks_ct; i++) {
+		const char *t = cfg.sinks[i];
+		struct sockaddr_un sa = { .sun_family = AF_UNIX };
+		snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", t + 5);
+		int sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+		if (sock == -1 || connect(sock, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+			pr_warn("could not connect to sink %s: %s\n", t, strerror(errno));
+			if (sock != -1)
+				close(sock);
+			continue;
+		}
+
+		int fds[2], ends[2];
+		if (pipe2(fds, O_CLOEXEC) == -1) {
+			close(sock);
+			continue;
+		}
+		if (pipe2(ends, O_CLOEXEC) == -1) {
+			close(fds[0]);
+			close(fds[1]);
+			close(sock);
+			continue;
+		}
+		/* as much slack as we're allowed */
+		int sz;
+		for (sz = SINK_PIPE_SIZE; sz > 65536; sz /= 2)
+			if (fcntl(fds[1], F_SETPIPE_SZ, sz) != -1)
+				break;
+		dprintf(fds[1], "name: %s\npid: %ju\nuid: %ju\ngid: %ju\nsignal: %ju\n"
+				"timestamp: %ju\ncomm: %s\npath: %s\n\n",
+				name, m->pid, m->uid, m->gid, m->sig, m->ts, m->comm, m->path);
+
+		/* on its own, so it may take as long as it needs */
+		pid_t p = fork();
+		if (p == 0) {
+			setsid();
+			if (fork() != 0)
+				_exit(EXIT_SUCCESS);
+
+			/* none of store's fds: not the core, nor its locks */
+			int null_fd = open("/dev/null", O_RDWR);
+			if (null_fd != -1) {
+				dup2(null_fd, STDIN_FILENO);
+				dup2(null_fd, STDOUT_FILENO);
+				dup2(null_fd, STDERR_FILENO);
+			}
+			int keep[] = { fds[0], sock, ends[0] };
+			close_fds_except(keep, ARRAY_SIZE(keep));
+
+			char end[SINK_END_LEN];
+			if (sink_forward(fds[0], sock) == 0
+					&& read(ends[0], end, sizeof(end)) == sizeof(end))
+				write_all(sock, end, sizeof(end));
+			_exit(EXIT_SUCCESS);
+		}
+		if (p > 0)
+			waitpid(p, NULL, 0);
+		close(fds[0]);
+		close(ends[0]);
+		close(sock);
+		if (p == -1 || fcntl(fds[1], F_SETFL, O_NONBLOCK) == -1) {
+			close(fds[1]);
+			close(ends[1]);
+			continue;
+		}
+
+		sinks[ct++] = (struct sink) { .target = t, .fd = fds[1], .end_fd = ends[1] };
+	}
+	return ct;
+}
+
+/* Stream the core to the sinks from sinks_open(), which 'o' now owns */
+static void store_out_sinks(struct store_out *o, const struct sink *sinks, size_t ct)
+{
+	memcpy(o->sinks, sinks, ct * sizeof(*sinks));
+	o->sinks_ct = ct;
+	if (!o->sinks_ct)
+		return;
+	signal(SIGPIPE, SIG_IGN);
+
+	/* straight from the kernel's pipe, unless we change the data first */
+	struct stat st;
+	o->tee = !o->redact && fstat(STDIN_FILENO, &st) == 0 && S_ISFIFO(st.st_mode);
+	if (o->tee)
+		return;
+
+	/* after redact, if that's there */
+	size_t at = o->chain_len && o->chain[0] == STAGE_REDACT;
+	memmove(o->chain + at + 1, o->chain + at, (o->chain_len - at) * sizeof(*o->chain));
+	o->chain[at] = STAGE_SINK;
+	o->chain_len++;
+}
+
+/* Store the core from stdin into the ring file */
+static int store_ring(int dir_fd, const char *name, const struct dump_meta *m,
+		struct isolate *iso, struct sink *sinks, size_t sinks_ct)
+{
+	struct ring r;
+	if (ring_open(&r, dir_fd, true) < 0) {
+		sinks_close(sinks, sinks_ct);
+		return EXIT_FAILURE;
+	}
+
+	struct store_out o;
+	int e = EXIT_FAILURE;
+	if (store_out_init(&o) < 0) {
+		sinks_close(sinks, sinks_ct);
+		goto out;
+	}
+	o.ring = &r;
+	ring_begin(&r, name, store_out_name(&o));
+	bw_open(&o.bw, dir_fd, m->uid, m->comm);
+	store_out_sinks(&o, sinks, sinks_ct);
+
+	(void) fcntl(STDIN_FILENO, F_SETPIPE_SZ, CFG_FRAME_SIZE);
+
+	ssize_t cr = copy_file_to_fd(&o, stdin, m->limit ? m->limit : CFG_CORE_LIMIT);
+	if (cr >= 0)
+		cr = store_out_finish(&o, -1);
+	if (cr >= 0)
+		store_out_sinks_end(&o);
+	if (cr < 0) {
+		ring_abort(&r);
+		goto out;
+	}
+
+	if (m->bids)
+		build_ids_save(m->bids, dir_fd);
+
+	char info[RING_INFO_MAX];
+	store_info_text(info, sizeof(info), m, &o, iso);
+	ring_end(&r, info);
+	e = EXIT_SUCCESS;
+out:
+	store_out_destroy(&o);
+	ring_close(&r);
+	return e;
+}
+
+static int ring_extract_file(struct ring *r, struct ring_ent *e, int out_dir,
+		const char *name, uint64_t off, uint64_t len)
+{
+	int fd = openat(out_dir, name, O_CREAT|O_EXCL|O_WRONLY|O_CLOEXEC, 0644);
+	if (fd == -1)
+		return -1;
+
+	__attribute__((cleanup(freep)))
+	uint8_t *buf = malloc(CFG_FRAME_SIZE);
+	int ret = buf ? 0 : -1;
+	while (!ret && len) {
+		size_t n = len < CFG_FRAME_SIZE ? len : CFG_FRAME_SIZE;
+		if (ring_read(r, e, off, buf, n) < 0 || write_all(fd, buf, n) < 0)
+			ret = -1;
+		off += n;
+		len -= n;
+	}
+
+	close(fd);
+	return ret;
+}
+
+/*
+ * Copy a dump out of the ring into the storage dir (where every other action
+ * finds it), or with no dump given, list the ring's contents.
+ */
+static int act_extract(const char *dir, int argc, char *argv[])
+{
+	int dir_fd = open(dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (dir_fd == -1) {
+		pr_err("could not open storage dir '%s': %s\n", dir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	struct ring r;
+	if (ring_open(&r, dir_fd, false) < 0) {
+		close(dir_fd);
+		return EXIT_FAILURE;
+	}
+
+	int e = EXIT_FAILURE;
+	size_t i;
+	if (argc < 2) {
+		for (i = 0; i < RING_ENTRIES; i++) {
+			struct ring_ent *re = &r.h->ent[i];
+			char comm[64] = "?";
+			if (!re->seq || !(re->flags & RING_COMPLETE))
+				continue;
+			info_get(re->info, "comm", comm, sizeof(comm));
+			printf("%ju\t%s\t%s\t%ju\n", (uintmax_t)re->seq, re->name, comm,
+					(uintmax_t)info_get_unum(re->info, "size"));
+		}
+		e = EXIT_SUCCESS;
+		goto out;
+	}
+
+	char *end;
+	uintmax_t seq = strtoumax(argv[1], &end, 10);
+	struct ring_ent *re = NULL;
+	for (i = 0; i < RING_ENTRIES; i++) {
+		struct ring_ent *c = &r.h->ent[i];
+		if (!c->seq || !(c->flags & RING_COMPLETE))
+			continue;
+		if ((*end == '\0' && c->seq == seq) || !strcmp(c->name, argv[1]))
+			re = c;
+	}
+
+	if (!re) {
+		pr_err("no dump '%s' in the ring\n", argv[1]);
+		goto out;
+	}
+
+	if (mkdirat(dir_fd, re->name, 0755) == -1) {
+		pr_err("could not create dump directory '%s': %s\n", re->name, strerror(errno));
+		goto out;
+	}
+
+	int out_dir = openat(dir_fd, re->name, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	uint64_t core_len = re->len - re->frames_len;
+	if (out_dir == -1
+			|| ring_extract_file(&r, re, out_dir, re->core_name, 0, core_len) < 0
+			|| (re->frames_len && ring_extract_file(&r, re, out_dir, "frames",
+					core_len, re->frames_len) < 0)) {
+		pr_err("could not extract '%s': %s\n", re->name, strerror(errno));
+		goto out_dir;
+	}
+
+	int info_fd = openat(out_dir, "info.txt", O_CREAT|O_EXCL|O_WRONLY|O_CLOEXEC, 0644);
+	if (info_fd == -1 || write_all(info_fd, re->info, strlen(re->info)) < 0) {
+		pr_err("could not write info.txt for '%s'\n", re->name);
+		if (info_fd != -1)
+			close(info_fd);
+		goto out_dir;
+	}
+	close(info_fd);
+
+	char comm[64];
+	char path[PATH_MAX];
+	info_get(re->info, "comm", comm, sizeof(comm));
+	info_get(re->info, "path", path, sizeof(path));
+	struct dump_meta m = {
+		.pid = info_get_unum(re->info, "pid"),
+		.uid = info_get_unum(re->info, "uid"),
+		.gid = info_get_unum(re->info, "gid"),
+		.sig = info_get_unum(re->info, "signal"),
+		.ts = info_get_unum(re->info, "timestamp"),
+		.comm = comm,
+		.path = path,
+	};
+	store_index(dir_fd, re->name, &m, info_get_unum(re->info, "size"), core_len);
+	printf("%s/%s\n", dir, re->name);
+	e = EXIT_SUCCESS;
+
+out_dir:
+	if (out_dir != -1)
+		close(out_dir);
+out:
+	ring_close(&r);
+	close(dir_fd);
+	return e;
+}
+
+static const char *const core_names[] = { "core", "core.gz", "core.enc", "core.gz.enc" };
+
+/* Open the core of the dump in dump_fd, however it was stored */
+static int dump_core_open(int dump_fd, const char **name)
+{
+	size_t i;
+	for (i = 0; i < ARRAY_SIZE(core_names); i++) {
+		int fd = openat(dump_fd, core_names[i], O_RDONLY|O_CLOEXEC);
+		if (fd != -1) {
+			if (name)
+				*name = core_names[i];
+			return fd;
+		}
+	}
+	return -1;
+}
+
+/*
+ * A dump's metadata, as the text of an info.txt: from the xattrs on its core
+ * when it has them (so no extra open), from info.txt otherwise.
+ */
+static ssize_t dump_info_read(int dump_fd, int core_fd, char *buf, size_t len)
+{
+	size_t used = 0;
+	buf[0] = '\0';
+	if (core_fd != -1) {
+		char names[4096];
+		ssize_t nl = flistxattr(core_fd, names, sizeof(names));
+		char *n;
+		for (n = names; nl > 0 && n < names + nl; n += strlen(n) + 1) {
+			char v[1024];
+			if (strncmp(n, XATTR_PREFIX, strlen(XATTR_PREFIX)))
+				continue;
+			ssize_t vl = fgetxattr(core_fd, n, v, sizeof(v));
+			if (vl < 0)
+				continue;
+			int w = snprintf(buf + used, len - used, "%s: %.*s\n",
+					n + strlen(XATTR_PREFIX), (int)vl, v);
+			if (w < 0 || (size_t)w >= len - used)
+				break;
+			used += w;
+		}
+		if (used)
+			return used;
+	}
+
+	int fd = openat(dump_fd, "info.txt", O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	ssize_t rl = read(fd, buf, len - 1);
+	close(fd);
+	if (rl < 0)
+		return -1;
+	buf[rl] = '\0';
+	return rl;
+}
+
+/*
+ * Call fn for every dump directory in the storage dir, in readdir() order.
+ * Stops early (returning it) if fn returns non-zero.
+ */
+static int for_each_dump(int dir_fd, int (*fn)(int dump_fd, const char *name, void *ctx), void *ctx)
+{
+	int fd = dup(dir_fd);
+	DIR *d = fd == -1 ? NULL : fdopendir(fd);
+	if (!d) {
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	rewinddir(d);
+
+	int r = 0;
+	struct dirent *de;
+	while (!r && (de = readdir(d))) {
+		/* skip the index, ring, bandwidth file, ... without a stat() */
+		if (de->d_name[0] == '.' || (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN))
+			continue;
+		int dump_fd = openat(dir_fd, de->d_name, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+		if (dump_fd == -1)
+			continue;
+		r = fn(dump_fd, de->d_name, ctx);
+		close(dump_fd);
+	}
+
+	closedir(d);
+	return r;
+}
+
+struct list_ent {
+	char name[NAME_MAX + 1];
+	char comm[32];
+	uintmax_t sig;
+	uintmax_t size;
+};
+
+struct list_ctx {
+	struct list_ent *ents;
+	size_t ct, alloc;
+};
+
+static int list_one(int dump_fd, const char *name, void *ctx_)
+{
+	struct list_ctx *ctx = ctx_;
+	if (ctx->ct == ctx->alloc) {
+		size_t n = ctx->alloc ? ctx->alloc * 2 : 256;
+		struct list_ent *le = realloc(ctx->ents, n * sizeof(*le));
+		if (!le)
+			return -1;
+		ctx->ents = le;
+		ctx->alloc = n;
+	}
+
+	char info[4096];
+	int core_fd = dump_core_open(dump_fd, NULL);
+	ssize_t il = dump_info_read(dump_fd, core_fd, info, sizeof(info));
+	if (core_fd != -1)
+		close(core_fd);
+	if (il < 0)
+		return 0;
+
+	struct list_ent *le = &ctx->ents[ctx->ct++];
+	index_field(le->name, sizeof(le->name), name);
+	if (!info_get(info, "comm", le->comm, sizeof(le->comm)))
+		strcpy(le->comm, "?");
+	le->sig = info_get_unum(info, "signal");
+	le->size = info_get_unum(info, "size");
+	return 0;
+}
+
+static int list_ent_cmp(const void *a_, const void *b_)
+{
+	const struct list_ent *a = a_, *b = b_;
+	return strcmp(a->name, b->name);
+}
+
+static int act_list(const char *dir)
+{
+	int dir_fd = open(dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (dir_fd == -1) {
+		pr_err("could not open storage dir '%s': %s\n", dir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	struct list_ctx ctx = { 0 };
+	int r = for_each_dump(dir_fd, list_one, &ctx);
+	close(dir_fd);
+	if (r) {
+		pr_err("could not list dumps in '%s'\n", dir);
+		free(ctx.ents);
+		return EXIT_FAILURE;
+	}
+
+	/* names start with the time, so this is oldest first */
+	qsort(ctx.ents, ctx.ct, sizeof(*ctx.ents), list_ent_cmp);
+	printf("%-44s %3s %12s %s\n", "NAME", "SIG", "SIZE", "COMM");
+	size_t i;
+	for (i = 0; i < ctx.ct; i++) {
+		struct list_ent *le = &ctx.ents[i];
+		printf("%-44s %3ju %12ju %s\n", le->name, le->sig, le->size, le->comm);
+	}
+
+	free(ctx.ents);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Reading a stored core back, whichever way it was stored: plain cores are
+ * read directly, framed ones a frame at a time (found with the frame table),
+ * decrypting and inflating as needed.
+ */
+struct core_reader {
+	int fd;
+	bool gz;
+	uint64_t size;
+
+	struct frame_ent *frames;
+	size_t nframes;
+	uint32_t frame_size;
+
+	EVP_CIPHER_CTX *cctx;
+	struct enc_hdr eh;
+
+	z_stream z;
+	uint8_t *sbuf;
+	size_t sbuf_size;
+	uint8_t *tbuf;
+	uint8_t *dbuf;
+	size_t dbuf_len;
+	/* the frame in dbuf, or -1 */
+	ssize_t cur;
+};
+
+static void core_reader_close(struct core_reader *cr)
+{
+	if (cr->fd != -1)
+		close(cr->fd);
+	if (cr->gz)
+		inflateEnd(&cr->z);
+	EVP_CIPHER_CTX_free(cr->cctx);
+	free(cr->frames);
+	free(cr->sbuf);
+	free(cr->tbuf);
+	free(cr->dbuf);
+	cr->fd = -1;
+}
+
+static int core_reader_open(struct core_reader *cr, int dump_fd)
+{
+	memset(cr, 0, sizeof(*cr));
+	cr->cur = -1;
+
+	const char *name;
+	cr->fd = dump_core_open(dump_fd, &name);
+	if (cr->fd == -1) {
+		pr_err("dump has no core\n");
+		return -1;
+	}
+
+	bool enc = strstr(name, ".enc");
+	cr->gz = strstr(name, ".gz");
+	if (!enc && !cr->gz) {
+		struct stat st;
+		if (fstat(cr->fd, &st) == -1)
+			goto e_close;
+		cr->size = st.st_size;
+		return 0;
+	}
+
+	if (cr->gz && inflateInit2(&cr->z, 15 + 16) != Z_OK) {
+		cr->gz = false;
+		goto e_close;
+	}
+
+	struct frames_hdr fh;
+	int ffd = openat(dump_fd, "frames", O_RDONLY|O_CLOEXEC);
+	if (ffd == -1 || read(ffd, &fh, sizeof(fh)) != sizeof(fh)
+			|| memcmp(fh.magic, FRAMES_MAGIC, sizeof(fh.magic))) {
+		pr_err("missing or bad frame table\n");
+		if (ffd != -1)
+			close(ffd);
+		goto e_close;
+	}
+
+	size_t fl = ((size_t)fh.nframes + 1) * sizeof(*cr->frames);
+	cr->frames = malloc(fl);
+	ssize_t rl = cr->frames ? read(ffd, cr->frames, fl) : -1;
+	close(ffd);
+	if (rl != (ssize_t)fl) {
+		pr_err("truncated frame table\n");
+		goto e_close;
+	}
+	cr->nframes = fh.nframes;
+	cr->frame_size = fh.frame_size;
+	cr->size = cr->frames[cr->nframes].raw_off;
+
+	size_t i;
+	for (i = 0; i < cr->nframes; i++) {
+		size_t sl = cr->frames[i + 1].off - cr->frames[i].off;
+		if (sl > cr->sbuf_size)
+			cr->sbuf_size = sl;
+	}
+	cr->sbuf = malloc(cr->sbuf_size);
+	cr->tbuf = malloc(cr->sbuf_size);
+	cr->dbuf = malloc(cr->frame_size);
+	if (!cr->sbuf || !cr->tbuf || !cr->dbuf)
+		goto e_close;
+
+	if (enc) {
+		uint8_t key_id[8];
+		if (!cfg.encrypt_key) {
+			pr_err("core is encrypted, but no encrypt-key is configured\n");
+			goto e_close;
+		}
+		if (pread(cr->fd, &cr->eh, sizeof(cr->eh), 0) != sizeof(cr->eh)
+				|| memcmp(cr->eh.magic, ENC_MAGIC, sizeof(cr->eh.magic))) {
+			pr_err("bad encrypted core header\n");
+			goto e_close;
+		}
+		cr->cctx = cipher_new(false, key_id);
+		if (!cr->cctx)
+			goto e_close;
+		if (memcmp(key_id, cr->eh.key_id, sizeof(key_id))) {
+			pr_err("core was encrypted with a different key\n");
+			goto e_close;
+		}
+	}
+
+	return 0;
+
+e_close:
+	core_reader_close(cr);
+	return -1;
+}
+
+static int core_reader_load(struct core_reader *cr, size_t idx)
+{
+	struct frame_ent *f = &cr->frames[idx];
+	size_t sl = f[1].off - f[0].off;
+	size_t rl = f[1].raw_off - f[0].raw_off;
+	if (rl > cr->frame_size || pread(cr->fd, cr->sbuf, sl, f->off) != (ssize_t)sl)
+		goto e_frame;
+
+	uint8_t *p = cr->sbuf;
+	if (cr->cctx) {
+		if (dec_frame(cr->cctx, &cr->eh, idx, cr->sbuf, sl, cr->tbuf, &sl) < 0) {
+			pr_err("frame %zu failed to decrypt (corrupted or tampered with)\n", idx);
+			return -1;
+		}
+		p = cr->tbuf;
+	}
+
+	if (cr->gz) {
+		inflateReset(&cr->z);
+		cr->z.next_in = p;
+		cr->z.avail_in = sl;
+		cr->z.next_out = cr->dbuf;
+		cr->z.avail_out = cr->frame_size;
+		if (inflate(&cr->z, Z_FINISH) != Z_STREAM_END
+				|| cr->frame_size - cr->z.avail_out != rl)
+			goto e_frame;
+	} else {
+		if (sl != rl)
+			goto e_frame;
+		memcpy(cr->dbuf, p, rl);
+	}
+
+	cr->dbuf_len = rl;
+	cr->cur = idx;
+	return 0;
+
+e_frame:
+	pr_err("frame %zu of core is corrupt\n", idx);
+	return -1;
+}
+
+/* Read from the core as it was dumped, returns bytes read (0 at the end) */
+static ssize_t core_reader_pread(struct core_reader *cr, void *buf, size_t len, uint64_t off)
+{
+	if (off >= cr->size)
+		return 0;
+	if (len > cr->size - off)
+		len = cr->size - off;
+	if (!cr->frames)
+		return pread(cr->fd, buf, len, off);
+
+	size_t lo = 0, hi = cr->nframes;
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		if (cr->frames[mid].raw_off <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	if ((size_t)cr->cur != lo && core_reader_load(cr, lo) < 0)
+		return -1;
+
+	uint64_t in = off - cr->frames[lo].raw_off;
+	if (len > cr->dbuf_len - in)
+		len = cr->dbuf_len - in;
+	memcpy(buf, cr->dbuf + in, len);
+	return len;
+}
+
+/* Write out the whole core as it was dumped */
+static int core_reader_copy(struct core_reader *cr, int out_fd)
+{
+	__attribute__((cleanup(freep)))
+	uint8_t *buf = malloc(CFG_FRAME_SIZE);
+	if (!buf)
+		return -1;
+
+	uint64_t off = 0;
+	for (;;) {
+		ssize_t rl = core_reader_pread(cr, buf, CFG_FRAME_SIZE, off);
+		if (rl < 0)
+			return -1;
+		if (rl == 0)
+			return 0;
+		if (write_all(out_fd, buf, rl) < 0)
+			return -1;
+		off += rl;
+	}
+}
+
+/* Read len bytes at off, across frames; short only at the end of the core */
+static ssize_t core_reader_read(struct core_reader *cr, void *buf, size_t len, uint64_t off)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t rl = core_reader_pread(cr, (uint8_t *)buf + done, len - done, off + done);
+		if (rl < 0)
+			return -1;
+		if (rl == 0)
+			break;
+		done += rl;
+	}
+	return done;
+}
+
+/* A PT_LOAD segment of a core: where its memory was, & where it is in the core */
+struct core_seg {
+	uint64_t vaddr;
+	uint64_t off;
+	uint64_t filesz;
+	uint64_t memsz;
+	uint32_t flags;
+};
+
+/*
+ * The PT_LOAD segments of the core, in the order of its program headers
+ * (which the kernel writes in address order). Segments with nothing of their
+ * memory in the core (filesz 0) are included. The (first) PT_NOTE goes in
+ * 'note', if given.
+ */
+static int core_segments(struct core_reader *cr, struct core_seg **segs, size_t *ct,
+		struct core_seg *note)
+{
+	unsigned char eh[sizeof(Elf64_Ehdr)];
+	*segs = NULL;
+	*ct = 0;
+	if (core_reader_read(cr, eh, sizeof(eh), 0) != sizeof(eh) || memcmp(eh, ELFMAG, SELFMAG)) {
+		pr_err("core is not an ELF file\n");
+		return -1;
+	}
+
+	bool is64 = eh[EI_CLASS] == ELFCLASS64;
+	uint64_t phoff;
+	size_t phnum, phentsize;
+	if (is64) {
+		Elf64_Ehdr e;
+		memcpy(&e, eh, sizeof(e));
+		phoff = e.e_phoff;
+		phnum = e.e_phnum;
+		phentsize = e.e_phentsize;
+		/* more than 65534 segments: the real count is in section 0 */
+		if (phnum == PN_XNUM) {
+			Elf64_Shdr sh;
+			if (core_reader_read(cr, &sh, sizeof(sh), e.e_shoff) != sizeof(sh))
+				return -1;
+			phnum = sh.sh_info;
+		}
+	} else {
+		Elf32_Ehdr e;
+		memcpy(&e, eh, sizeof(e));
+		phoff = e.e_phoff;
+		phnum = e.e_phnum;
+		phentsize = e.e_phentsize;
+	}
+	if (phentsize < (is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr)) || phnum > (1 << 24)) {
+		pr_err("core has bad program headers\n");
+		return -1;
+	}
+
+	uint8_t *ph = malloc(phnum * phentsize);
+	*segs = malloc((phnum ? phnum : 1) * sizeof(**segs));
+	if (!ph || !*segs || core_reader_read(cr, ph, phnum * phentsize, phoff) != (ssize_t)(phnum * phentsize)) {
+		pr_err("could not read the core's program headers\n");
+		free(ph);
+		free(*segs);
+		*segs = NULL;
+		return -1;
+	}
+
+	if (note)
+		memset(note, 0, sizeof(*note));
+	size_t i;
+	for (i = 0; i < phnum; i++) {
+		struct core_seg *s = &(*segs)[*ct];
+		uint32_t type;
+		if (is64) {
+			Elf64_Phdr p;
+			memcpy(&p, ph + i * phentsize, sizeof(p));
+			type = p.p_type;
+			*s = (struct core_seg) { p.p_vaddr, p.p_offset, p.p_filesz, p.p_memsz, p.p_flags };
+		} else {
+			Elf32_Phdr p;
+			memcpy(&p, ph + i * phentsize, sizeof(p));
+			type = p.p_type;
+			*s = (struct core_seg) { p.p_vaddr, p.p_offset, p.p_filesz, p.p_memsz, p.p_flags };
+		}
+		if (type == PT_LOAD)
+			(*ct)++;
+		else if (type == PT_NOTE && note && !note->filesz)
+			*note = *s;
+	}
+	free(ph);
+	return 0;
+}
+
+/* A dump, by name in the storage dir or by path */
+static int dump_open(const char *dir, const char *dump)
+{
+	int dir_fd = open(dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	int fd = openat(dir_fd, dump, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		pr_err("could not open dump '%s': %s\n", dump, strerror(errno));
+	if (dir_fd != -1)
+		close(dir_fd);
+	return fd;
+}
+
+static int act_export(const char *dir, int argc, char *argv[])
+{
+	if (argc < 2 || argc > 3) {
+		pr_err("export requires a dump & optionally an output file\n");
+		return EXIT_FAILURE;
+	}
+
+	int dump_fd = dump_open(dir, argv[1]);
+	if (dump_fd == -1)
+		return EXIT_FAILURE;
+
+	struct core_reader cr;
+	int r = core_reader_open(&cr, dump_fd);
+	close(dump_fd);
+	if (r < 0)
+		return EXIT_FAILURE;
+
+	int out_fd = STDOUT_FILENO;
+	if (argc == 3 && strcmp(argv[2], "-")) {
+		out_fd = open(argv[2], O_CREAT|O_EXCL|O_WRONLY|O_CLOEXEC, 0600);
+		if (out_fd == -1) {
+			pr_err("could not create '%s': %s\n", argv[2], strerror(errno));
+			core_reader_close(&cr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	r = core_reader_copy(&cr, out_fd);
+	core_reader_close(&cr);
+	if (out_fd != STDOUT_FILENO)
+		close(out_fd);
+	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* The kernel's %E replaces '/' with '!' */
+static void unmangle_path(char *p)
+{
+	for (; *p; p++)
+		if (*p == '!')
+			*p = '/';
+}
+
+/*
+ * Copies of kept objects with a .gdb_index added (by gdb-add-index), so gdb
+ * needn't build its symbol tables from the DWARF every time:
+ * '<dir>/.gdb-index/xx/yyyy...', by build-id. Objects that can't be indexed
+ * (no DWARF, say) get an empty 'yyyy....none' so we don't keep trying.
+ */
+#define GDB_INDEX_DIR ".gdb-index"
+
+static int mkdirat_p(int dir_fd, const char *path, mode_t mode)
+{
+	char p[PATH_MAX];
+	if (snprintf(p, sizeof(p), "%s", path) >= (int)sizeof(p))
+		return -1;
+
+	char *s;
+	for (s = strchr(p + 1, '/'); ; s = strchr(s + 1, '/')) {
+		if (s)
+			*s = '\0';
+		if (mkdirat(dir_fd, p, mode) == -1 && errno != EEXIST)
+			return -1;
+		if (!s)
+			return 0;
+		*s = '/';
+	}
+}
+
+/* Whether there's a readable '<dir>/<store>/xx/yyyy...' for 'id', in buf */
+static bool bid_path(char *buf, size_t len, const char *dir, const char *store, const char *id)
+{
+	if (strlen(id) < 3)
+		return false;
+	int r = snprintf(buf, len, "%s/%s/%.2s/%s", dir, store, id, id + 2);
+	return r > 0 && (size_t)r < len && access(buf, R_OK) == 0;
+}
+
+/*
+ * Make the indexed copy of 'id' if there isn't one (or one being made).
+ * Returns -1 if there's no gdb-add-index to make it with. Whoever is making
+ * it holds a flock() on the kept object, so a '.indexing' copy that isn't
+ * locked was left by an indexer that died, and is started over.
+ */
+static int gdb_index_one(int dir_fd, const char *id)
+{
+	char kept[PATH_MAX], tmp[PATH_MAX], done[PATH_MAX], none[PATH_MAX + 8];
+	snprintf(kept, sizeof(kept), BUILD_ID_DIR "/%.2s/%s", id, id + 2);
+	snprintf(tmp, sizeof(tmp), GDB_INDEX_DIR "/%.2s/.%s.indexing", id, id + 2);
+	snprintf(done, sizeof(done), GDB_INDEX_DIR "/%.2s/%s", id, id + 2);
+	snprintf(none, sizeof(none), "%s.none", done);
+	if (faccessat(dir_fd, done, F_OK, 0) == 0 || faccessat(dir_fd, none, F_OK, 0) == 0)
+		return 0;
+
+	char sub[sizeof(GDB_INDEX_DIR) + 3];
+	snprintf(sub, sizeof(sub), GDB_INDEX_DIR "/%.2s", id);
+	if (mkdirat_p(dir_fd, sub, 0755) < 0)
+		return 0;
+
+	int in = openat(dir_fd, kept, O_RDONLY|O_CLOEXEC);
+	if (in == -1)
+		return 0;
+	/* someone else is already on it */
+	if (flock(in, LOCK_EX|LOCK_NB) == -1) {
+		close(in);
+		return 0;
+	}
+	int out = openat(dir_fd, tmp, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0644);
+	struct stat st;
+	int r = -1;
+	if (out != -1 && fstat(in, &st) == 0)
+		r = copy_fd_range(in, out, st.st_size);
+	if (out == -1) {
+		close(in);
+		return 0;
+	}
+	close(out);
+
+	if (r == 0) {
+		pid_t p = fork();
+		if (p == 0) {
+			/* gdb-add-index wants a path, & writes next to it */
+			if (fchdir(dir_fd) == 0 && chdir(sub) == 0) {
+				int null_fd = open("/dev/null", O_WRONLY);
+				if (null_fd != -1) {
+					dup2(null_fd, STDOUT_FILENO);
+					dup2(null_fd, STDERR_FILENO);
+				}
+				execlp("gdb-add-index", "gdb-add-index", strrchr(tmp, '/') + 1, (char *)NULL);
+			}
+			_exit(127);
+		}
+		int status = 0;
+		r = p == -1 || waitpid(p, &status, 0) == -1 || !WIFEXITED(status)
+			|| WEXITSTATUS(status) ? -1 : 0;
+		if (p != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+			unlinkat(dir_fd, tmp, 0);
+			close(in);
+			return -1;
+		}
+	}
+
+	if (r == 0 && renameat(dir_fd, tmp, dir_fd, done) == 0) {
+		close(in);
+		return 0;
+	}
+	unlinkat(dir_fd, tmp, 0);
+	int nfd = openat(dir_fd, none, O_CREAT|O_WRONLY|O_CLOEXEC, 0644);
+	if (nfd != -1)
+		close(nfd);
+	close(in);
+	return 0;
+}
+
+/* Index the objects of a dump, detached & at low priority, so gdb needn't wait */
+static void gdb_index_spawn(const char *dir, char **ids, size_t ct)
+{
+	pid_t p = fork();
+	if (p == -1) {
+		pr_warn("could not start indexer: %s\n", strerror(errno));
+		return;
+	}
+
+	if (p) {
+		waitpid(p, NULL, 0);
+		return;
+	}
+
+	setsid();
+	if (fork() != 0)
+		_exit(EXIT_SUCCESS);
+
+	ioprio_set_self(IOPRIO_CLASS_IDLE, 0);
+	setpriority(PRIO_PROCESS, 0, 19);
+	int null_fd = open("/dev/null", O_RDWR);
+	if (null_fd != -1) {
+		dup2(null_fd, STDIN_FILENO);
+		dup2(null_fd, STDOUT_FILENO);
+		dup2(null_fd, STDERR_FILENO);
+	}
+
+	int dir_fd = open(dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	size_t i;
+	for (i = 0; dir_fd != -1 && i < ct; i++)
+		if (gdb_index_one(dir_fd, ids[i]) < 0)
+			break;
+	_exit(EXIT_SUCCESS);
+}
+
+/*
+ * With the objects a dump had mapped kept, build a sysroot for gdb out of
+ * symlinks to them ('<dir>/.gdb-index/root/<dump>/<path>'), preferring indexed
+ * copies, and start indexing any that aren't yet. Returns false (leaving gdb
+ * to find libraries itself) if the dump has no list of its objects.
+ */
+static bool gdb_sysroot(const char *dir, const char *dump, int dump_fd,
+		char *root, size_t root_len)
+{
+	int fd = openat(dump_fd, "build-ids", O_RDONLY|O_CLOEXEC);
+	FILE *f = fd == -1 ? NULL : fdopen(fd, "r");
+	if (!f) {
+		if (fd != -1)
+			close(fd);
+		return false;
+	}
+
+	/* a dump given by path is known by its last component */
+	char name[NAME_MAX + 1];
+	size_t nl = strlen(dump);
+	while (nl > 1 && dump[nl - 1] == '/')
+		nl--;
+	const char *base = memrchr(dump, '/', nl);
+	base = base ? base + 1 : dump;
+	nl -= base - dump;
+	if (nl == 0 || nl > NAME_MAX || (base[0] == '.' && (nl == 1 || (nl == 2 && base[1] == '.')))) {
+		fclose(f);
+		return false;
+	}
+	memcpy(name, base, nl);
+	name[nl] = '\0';
+
+	int dir_fd = open(dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	char rel[PATH_MAX];
+	snprintf(rel, sizeof(rel), GDB_INDEX_DIR "/root/%s", name);
+	if (dir_fd == -1 || mkdirat_p(dir_fd, rel, 0755) < 0) {
+		if (dir_fd != -1)
+			close(dir_fd);
+		fclose(f);
+		return false;
+	}
+	int rl = snprintf(root, root_len, "%s/%s", dir, rel);
+	if (rl < 0 || (size_t)rl >= root_len) {
+		close(dir_fd);
+		fclose(f);
+		return false;
+	}
+
+	char **todo = NULL;
+	size_t todo_ct = 0;
+	char line[PATH_MAX + 160];
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		char *path = strchr(line, ' ');
+		if (!path || path[1] != '/')
+			continue;
+		*path++ = '\0';
+		const char *id = line;
+
+		/* the indexed copy, the kept one, or what's on this host */
+		char target[PATH_MAX];
+		if (!bid_path(target, sizeof(target), dir, GDB_INDEX_DIR, id)) {
+			if (!bid_path(target, sizeof(target), dir, BUILD_ID_DIR, id)) {
+				snprintf(target, sizeof(target), "%s", path);
+			} else {
+				char **n = realloc(todo, (todo_ct + 1) * sizeof(*n));
+				if (n) {
+					todo = n;
+					todo[todo_ct] = strdup(id);
+					if (todo[todo_ct])
+						todo_ct++;
+				}
+			}
+		}
+
+		char link[PATH_MAX];
+		if (snprintf(link, sizeof(link), "%s%s", rel, path) >= (int)sizeof(link))
+			continue;
+		char *slash = strrchr(link, '/');
+		*slash = '\0';
+		mkdirat_p(dir_fd, link, 0755);
+		*slash = '/';
+		unlinkat(dir_fd, link, 0);
+		symlinkat(target, dir_fd, link);
+	}
+	fclose(f);
+	close(dir_fd);
+
+	if (todo_ct)
+		gdb_index_spawn(dir, todo, todo_ct);
+	size_t i;
+	for (i = 0; i < todo_ct; i++)
+		free(todo[i]);
+	free(todo);
+	return true;
+}
+
+/* What gdb needs to look at a dump */
+struct gdb_args {
+	char exe[PATH_MAX];
+	/* 'set sysroot ...', if we have the dump's libraries */
+	char sysroot[PATH_MAX + 16];
+	char core[64];
+};
+
+/*
+ * Work out what gdb should open for a dump. Cores that are stored compressed
+ * or encrypted are decoded into a memfd (so plaintext never touches the disk)
+ * that gdb opens by path. Kept objects (with a .gdb_index, once one's been
+ * made) stand in for the executable & libraries.
+ */
+static int gdb_prepare(const char *dir, const char *dump, int dump_fd, struct gdb_args *g)
+{
+	char info[4096];
+	const char *name;
+	int core_fd = dump_core_open(dump_fd, &name);
+	if (dump_info_read(dump_fd, core_fd, info, sizeof(info)) < 0
+			|| !info_get(info, "path", g->exe, sizeof(g->exe))) {
+		pr_err("no executable path recorded for '%s'\n", dump);
+		goto e_core;
+	}
+	unmangle_path(g->exe);
+
+	/* the very executable that crashed, if we kept it */
+	char id[BUILD_ID_MAX * 2 + 1];
+	if (info_get(info, "build-id", id, sizeof(id)) && strlen(id) > 2) {
+		char kept[PATH_MAX];
+		if (bid_path(kept, sizeof(kept), dir, GDB_INDEX_DIR, id)
+				|| bid_path(kept, sizeof(kept), dir, BUILD_ID_DIR, id))
+			strcpy(g->exe, kept);
+	}
+
+	char root[PATH_MAX];
+	g->sysroot[0] = '\0';
+	if (gdb_sysroot(dir, dump, dump_fd, root, sizeof(root)))
+		snprintf(g->sysroot, sizeof(g->sysroot), "set sysroot %s", root);
+
+	if (core_fd != -1 && !strcmp(name, "core")) {
+		snprintf(g->core, sizeof(g->core), "/proc/self/fd/%d", core_fd);
+		/* gdb needs to be able to open it */
+		fcntl(core_fd, F_SETFD, 0);
+		return 0;
+	}
+
+	struct core_reader cr;
+	if (core_reader_open(&cr, dump_fd) < 0)
+		goto e_core;
+	int mfd = memfd_create("core", 0);
+	if (mfd == -1 || core_reader_copy(&cr, mfd) < 0) {
+		pr_err("could not decode core\n");
+		core_reader_close(&cr);
+		goto e_core;
+	}
+	core_reader_close(&cr);
+	snprintf(g->core, sizeof(g->core), "/proc/self/fd/%d", mfd);
+	if (core_fd != -1)
+		close(core_fd);
+	return 0;
+
+e_core:
+	if (core_fd != -1)
+		close(core_fd);
+	return -1;
+}
+
+/* Run gdb on what gdb_prepare() found, with 'extra' args before them */
+static void gdb_exec(const struct gdb_args *g, const char *const *extra)
+{
+	const char *args[32];
+	size_t n = 0;
+	args[n++] = "gdb";
+	for (; extra && *extra && n < ARRAY_SIZE(args) - 5; extra++)
+		args[n++] = *extra;
+	if (g->sysroot[0]) {
+		args[n++] = "-iex";
+		args[n++] = g->sysroot;
+	}
+	args[n++] = g->exe;
+	args[n++] = g->core;
+	args[n] = NULL;
+	execvp("gdb", (char *const *)args);
+}
+
+static int act_gdb(const char *dir, int argc, char *argv[])
+{
+	if (argc != 2) {
+		pr_err("gdb requires a dump\n");
+		return EXIT_FAILURE;
+	}
+
+	int dump_fd = dump_open(dir, argv[1]);
+	if (dump_fd == -1)
+		return EXIT_FAILURE;
+
+	struct gdb_args g;
+	if (gdb_prepare(dir, argv[1], dump_fd, &g) < 0)
+		return EXIT_FAILURE;
+
+	gdb_exec(&g, NULL);
+	pr_err("could not run gdb: %s\n", strerror(errno));
+	return EXIT_FAILURE;
+}
+
+/*
+ * Add 'key: value' to a dump's metadata, wherever it keeps it: as an xattr on
+ * the core if that's where the rest is, in info.txt otherwise.
+ */
+static int dump_meta_add(int dump_fd, const char *key, const char *value)
+{
+	char name[128];
+	snprintf(name, sizeof(name), XATTR_PREFIX "%s", key);
+	int core_fd = dump_core_open(dump_fd, NULL);
+	if (core_fd != -1) {
+		int r = 1;
+		if (fgetxattr(core_fd, XATTR_PREFIX "pid", NULL, 0) >= 0)
+			r = fsetxattr(core_fd, name, value, strlen(value), 0);
+		close(core_fd);
+		if (r <= 0)
+			return r;
+	}
+
+	int fd = openat(dump_fd, "info.txt", O_WRONLY|O_APPEND|O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	int r = dprintf(fd, "%s: %s\n", key, value);
+	close(fd);
+	return r < 0 ? -1 : 0;
+}
+
+/*
+ * An inverted index of triaged backtraces, '<dir>/.search/': which dumps have
+ * a frame in each function or source file. Triage appends 'term\tid' lines
+ * to 'log'; once that grows past SEARCH_LOG_MAX it is folded into 'terms',
+ * which is sorted & mmap()ed by search:
+ *
+ *	search_hdr, search_term[nterms] (sorted by term), uint32_t posts[nposts]
+ *	(sorted dump ids for each term), then the terms' text
+ *
+ * Dump ids are line numbers in 'names'. Writers hold an exclusive flock() on
+ * 'lock', readers a shared one.
+ */
+#define SEARCH_DIR ".search"
+#define SEARCH_MAGIC "DCSRCH01"
+#define SEARCH_LOG_MAX (256 * 1024)
+
+struct search_hdr {
+	char magic[8];
+	uint32_t nterms;
+	uint32_t nposts;
+	uint32_t strs_len;
+	uint32_t reserved;
+};
+
+struct search_term {
+	uint32_t str_off;
+	uint32_t post_off;
+	uint32_t post_ct;
+};
+
+struct search_map {
+	void *map;
+	size_t len;
+	const struct search_hdr *h;
+	const struct search_term *terms;
+	const uint32_t *posts;
+	const char *strs;
+};
+
+static int search_map_open(int sd, struct search_map *m)
+{
+	memset(m, 0, sizeof(*m));
+	int fd = openat(sd, "terms", O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return errno == ENOENT ? 0 : -1;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*m->h)) {
+		close(fd);
+		return -1;
+	}
+	m->len = st.st_size;
+	m->map = mmap(NULL, m->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m->map == MAP_FAILED) {
+		m->map = NULL;
+		return -1;
+	}
+
+	m->h = m->map;
+	size_t need = sizeof(*m->h) + (size_t)m->h->nterms * sizeof(*m->terms)
+		+ (size_t)m->h->nposts * sizeof(*m->posts) + m->h->strs_len;
+	if (memcmp(m->h->magic, SEARCH_MAGIC, sizeof(m->h->magic)) || need > m->len)
+		goto e_corrupt;
+	m->terms = (const void *)(m->h + 1);
+	m->posts = (const void *)(m->terms + m->h->nterms);
+	m->strs = (const char *)(m->posts + m->h->nposts);
+
+	/* every term's string & postings inside the file, once, so lookups needn't check */
+	if (m->h->nterms && (!m->h->strs_len || m->strs[m->h->strs_len - 1]))
+		goto e_corrupt;
+	size_t i;
+	for (i = 0; i < m->h->nterms; i++) {
+		const struct search_term *t = &m->terms[i];
+		if (t->str_off >= m->h->strs_len || t->post_off > m->h->nposts
+				|| t->post_ct > m->h->nposts - t->post_off)
+			goto e_corrupt;
+	}
+	return 0;
+
+e_corrupt:
+	pr_err("search index is corrupt\n");
+	munmap(m->map, m->len);
+	memset(m, 0, sizeof(*m));
+	return -1;
+}
+
+static void search_map_close(struct search_map *m)
+{
+	if (m->map)
+		munmap(m->map, m->len);
+	m->map = NULL;
+}
+
+/* The first term >= 'key' */
+static size_t search_map_lower(const struct search_map *m, const char *key)
+{
+	size_t lo = 0, hi = m->h ? m->h->nterms : 0;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (strcmp(m->strs + m->terms[mid].str_off, key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* A term & a dump it was found in */
+struct search_post {
+	char *term;
+	uint32_t id;
+};
+
+static int search_post_cmp(const void *a_, const void *b_)
+{
+	const struct search_post *a = a_, *b = b_;
+	int c = strcmp(a->term, b->term);
+	if (c)
+		return c;
+	return a->id < b->id ? -1 : a->id > b->id;
+}
+
+/* Parse the 'term\tid' lines of the log, calling fn for each */
+static int search_log_each(int sd, int (*fn)(const char *term, uint32_t id, void *ctx), void *ctx)
+{
+	int fd = openat(sd, "log", O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return errno == ENOENT ? 0 : -1;
+	__attribute__((cleanup(fclosep)))
+	FILE *f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return -1;
+	}
+
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		char *tab = strrchr(line, '\t');
+		if (!tab)
+			continue;
+		*tab = '\0';
+		if (fn(line, strtoul(tab + 1, NULL, 10), ctx) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+struct search_posts {
+	struct search_post *p;
+	size_t ct, alloc;
+};
+
+static int search_posts_push(const char *term, uint32_t id, void *ctx)
+{
+	struct search_posts *ps = ctx;
+	if (ps->ct == ps->alloc) {
+		size_t n = ps->alloc ? ps->alloc * 2 : 1024;
+		struct search_post *np = realloc(ps->p, n * sizeof(*np));
+		if (!np)
+			return -1;
+		ps->p = np;
+		ps->alloc = n;
+	}
+	ps->p[ps->ct].term = strdup(term);
+	if (!ps->p[ps->ct].term)
+		return -1;
+	ps->p[ps->ct++].id = id;
+	return 0;
+}
+
+/* Fold the log into a new 'terms', with the exclusive lock held */
+static int search_compact(int sd)
+{
+	struct search_posts ps = { 0 };
+	struct search_map m;
+	int r = -1;
+	if (search_map_open(sd, &m) < 0)
+		return -1;
+
+	size_t i, j;
+	for (i = 0; m.h && i < m.h->nterms; i++)
+		for (j = 0; j < m.terms[i].post_ct; j++)
+			if (search_posts_push(m.strs + m.terms[i].str_off,
+					m.posts[m.terms[i].post_off + j], &ps) < 0)
+				goto out;
+	if (search_log_each(sd, search_posts_push, &ps) < 0)
+		goto out;
+
+	qsort(ps.p, ps.ct, sizeof(*ps.p), search_post_cmp);
+
+	struct search_hdr h = { .magic = SEARCH_MAGIC };
+	size_t nposts = 0;
+	for (i = 0; i < ps.ct; i++) {
+		if (i && !search_post_cmp(&ps.p[i - 1], &ps.p[i]))
+			continue;
+		nposts++;
+		if (!i || strcmp(ps.p[i - 1].term, ps.p[i].term)) {
+			h.nterms++;
+			h.strs_len += strlen(ps.p[i].term) + 1;
+		}
+	}
+	h.nposts = nposts;
+
+	struct search_term *terms = calloc(h.nterms ? h.nterms : 1, sizeof(*terms));
+	uint32_t *posts = calloc(nposts ? nposts : 1, sizeof(*posts));
+	char *strs = malloc(h.strs_len ? h.strs_len : 1);
+	int fd = -1;
+	if (!terms || !posts || !strs)
+		goto out_bufs;
+
+	size_t t = 0, p = 0, so = 0;
+	for (i = 0; i < ps.ct; i++) {
+		if (i && !search_post_cmp(&ps.p[i - 1], &ps.p[i]))
+			continue;
+		if (!i || strcmp(ps.p[i - 1].term, ps.p[i].term)) {
+			size_t l = strlen(ps.p[i].term) + 1;
+			terms[t++] = (struct search_term) { .str_off = so, .post_off = p };
+			memcpy(strs + so, ps.p[i].term, l);
+			so += l;
+		}
+		terms[t - 1].post_ct++;
+		posts[p++] = ps.p[i].id;
+	}
+
+	/* readers keep the old one until they're done with it */
+	fd = openat(sd, "terms.new", O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0644);
+	if (fd == -1 || write_all(fd, &h, sizeof(h)) < 0
+			|| write_all(fd, terms, h.nterms * sizeof(*terms)) < 0
+			|| write_all(fd, posts, nposts * sizeof(*posts)) < 0
+			|| write_all(fd, strs, h.strs_len) < 0
+			|| renameat(sd, "terms.new", sd, "terms") == -1) {
+		pr_err("could not write search index: %s\n", strerror(errno));
+		unlinkat(sd, "terms.new", 0);
+		goto out_bufs;
+	}
+
+	int lfd = openat(sd, "log", O_WRONLY|O_TRUNC|O_CLOEXEC);
+	if (lfd != -1)
+		close(lfd);
+	r = 0;
+
+out_bufs:
+	if (fd != -1)
+		close(fd);
+	free(terms);
+	free(posts);
+	free(strs);
+out:
+	for (i = 0; i < ps.ct; i++)
+		free(ps.p[i].term);
+	free(ps.p);
+	search_map_close(&m);
+	return r;
+}
+
+/* The id of dump 'name', adding it to 'names' if it's new (and 'add') */
+static int search_id(int sd, const char *name, uint32_t *id, bool add)
+{
+	int fd = openat(sd, "names", add ? O_CREAT|O_RDWR|O_APPEND|O_CLOEXEC : O_RDONLY|O_CLOEXEC, 0644);
+	if (fd == -1)
+		return -1;
+	FILE *f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return -1;
+	}
+
+	char line[NAME_MAX + 2];
+	uint32_t n = 0;
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (!strcmp(line, name)) {
+			*id = n;
+			fclose(f);
+			return 0;
+		}
+		n++;
+	}
+
+	int r = add ? dprintf(fd, "%s\n", name) : -1;
+	fclose(f);
+	*id = n;
+	return r < 0 ? -1 : 0;
+}
+
+/* Open (creating, when writing) the search dir, locked with *lock_fd */
+static int search_open(int dir_fd, int lock, int *lock_fd)
+{
+	if (lock == LOCK_EX && mkdirat(dir_fd, SEARCH_DIR, 0755) == -1 && errno != EEXIST)
+		return -1;
+	int sd = openat(dir_fd, SEARCH_DIR, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (sd == -1)
+		return -1;
+	*lock_fd = openat(sd, "lock", O_CREAT|O_RDONLY|O_CLOEXEC, 0644);
+	if (*lock_fd == -1 || flock(*lock_fd, lock) == -1) {
+		if (*lock_fd != -1)
+			close(*lock_fd);
+		close(sd);
+		return -1;
+	}
+	return sd;
+}
+
+/* Index dump 'name' under each of the '\n' separated 'terms' */
+static int search_add(int dir_fd, const char *name, const char *terms)
+{
+	int lock_fd;
+	int sd = search_open(dir_fd, LOCK_EX, &lock_fd);
+	if (sd == -1)
+		return -1;
+
+	int r = -1;
+	uint32_t id;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *m = NULL;
+	if (search_id(sd, name, &id, true) < 0 || !(m = open_memstream(&buf, &len)))
+		goto out;
+
+	const char *t = terms;
+	while (*t) {
+		size_t tl = strcspn(t, "\n");
+		if (tl)
+			fprintf(m, "%.*s\t%" PRIu32 "\n", (int)tl, t, id);
+		t += tl + (t[tl] == '\n');
+	}
+	fclose(m);
+
+	/* one write, so a crash never leaves half a line */
+	struct stat st;
+	int fd = openat(sd, "log", O_CREAT|O_WRONLY|O_APPEND|O_CLOEXEC, 0644);
+	if (fd == -1 || write_all(fd, buf, len) < 0 || fstat(fd, &st) == -1) {
+		if (fd != -1)
+			close(fd);
+		goto out;
+	}
+	close(fd);
+
+	r = 0;
+	if (st.st_size > SEARCH_LOG_MAX)
+		r = search_compact(sd);
+out:
+	free(buf);
+	close(lock_fd);
+	close(sd);
+	return r;
+}
+
+/* The ids of dumps with a term (or with a term starting with 'key*') */
+struct search_hits {
+	const char *key;
+	size_t key_len;
+	bool prefix;
+	uint32_t *ids;
+	size_t ct, alloc;
+};
+
+static int search_hit(struct search_hits *h, uint32_t id)
+{
+	if (h->ct == h->alloc) {
+		size_t n = h->alloc ? h->alloc * 2 : 256;
+		uint32_t *ni = realloc(h->ids, n * sizeof(*ni));
+		if (!ni)
+			return -1;
+		h->ids = ni;
+		h->alloc = n;
+	}
+	h->ids[h->ct++] = id;
+	return 0;
+}
+
+static bool search_matches(struct search_hits *h, const char *term)
+{
+	if (h->prefix)
+		return !strncmp(term, h->key, h->key_len);
+	return !strcmp(term, h->key);
+}
+
+static int search_log_hit(const char *term, uint32_t id, void *ctx)
+{
+	struct search_hits *h = ctx;
+	if (search_matches(h, term))
+		return search_hit(h, id);
+	return 0;
+}
+
+static int u32_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static int search_lookup(int sd, const struct search_map *m, struct search_hits *h)
+{
+	size_t i = search_map_lower(m, h->key);
+	for (; m->h && i < m->h->nterms && search_matches(h, m->strs + m->terms[i].str_off); i++) {
+		const struct search_term *t = &m->terms[i];
+		size_t j;
+		for (j = 0; j < t->post_ct; j++)
+			if (search_hit(h, m->posts[t->post_off + j]) < 0)
+				return -1;
+		if (!h->prefix)
+			break;
+	}
+
+	/* what hasn't been folded in yet */
+	if (search_log_each(sd, search_log_hit, h) < 0)
+		return -1;
+
+	if (h->ct)
+		qsort(h->ids, h->ct, sizeof(*h->ids), u32_cmp);
+	size_t o = 0;
+	for (i = 0; i < h->ct; i++)
+		if (!o || h->ids[o - 1] != h->ids[i])
+			h->ids[o++] = h->ids[i];
+	h->ct = o;
+	return 0;
+}
+
+/*
+ * Find the dumps whose (triaged) crashing thread went through all of the given
+ * functions or source files. A trailing '*' matches any term with that prefix.
+ */
+static int act_search(const char *dir, int argc, char *argv[])
+{
+	if (argc < 2) {
+		pr_err("search requires a function or source file name\n");
+		return EXIT_FAILURE;
+	}
+
+	int dir_fd = open(dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	int lock_fd;
+	int sd = dir_fd == -1 ? -1 : search_open(dir_fd, LOCK_SH, &lock_fd);
+	if (sd == -1) {
+		pr_err("no search index in '%s' (dumps are indexed by triage)\n", dir);
+		return EXIT_FAILURE;
+	}
+
+	struct search_map m;
+	if (search_map_open(sd, &m) < 0)
+		return EXIT_FAILURE;
+
+	/* intersect the hits for each term */
+	uint32_t *ids = NULL;
+	size_t ct = 0, i;
+	int a;
+	for (a = 1; a < argc; a++) {
+		struct search_hits h = { .key = argv[a] };
+		char key[512];
+		h.key_len = snprintf(key, sizeof(key), "%s", argv[a]);
+		if (h.key_len && h.key_len < sizeof(key) && key[h.key_len - 1] == '*') {
+			key[--h.key_len] = '\0';
+			h.prefix = true;
+		}
+		h.key = key;
+		if (search_lookup(sd, &m, &h) < 0) {
+			pr_err("search failed\n");
+			return EXIT_FAILURE;
+		}
+
+		if (a == 1) {
+			ids = h.ids;
+			ct = h.ct;
+			continue;
+		}
+		size_t o = 0, j = 0;
+		for (i = 0; i < ct; i++) {
+			while (j < h.ct && h.ids[j] < ids[i])
+				j++;
+			if (j < h.ct && h.ids[j] == ids[i])
+				ids[o++] = ids[i];
+		}
+		ct = o;
+		free(h.ids);
+	}
+	search_map_close(&m);
+
+	/* ids back to names */
+	int nfd = openat(sd, "names", O_RDONLY|O_CLOEXEC);
+	FILE *f = nfd == -1 ? NULL : fdopen(nfd, "r");
+	char line[NAME_MAX + 2];
+	uint32_t id = 0;
+	i = 0;
+	while (f && i < ct && fgets(line, sizeof(line), f)) {
+		if (id++ != ids[i])
+			continue;
+		fputs(line, stdout);
+		i++;
+	}
+	if (f)
+		fclose(f);
+	else if (nfd != -1)
+		close(nfd);
+
+	free(ids);
+	close(lock_fd);
+	close(sd);
+	close(dir_fd);
+	return ct ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#define TRIAGE_FRAMES 5
+/* How long gdb may take over one dump */
+#define TRIAGE_TIMEOUT_SEC 300
+
+/*
+ * The function in a frame line of gdb's backtrace, '#1  0x00007f... in fn
+ * (args) at file:line' or '#0  fn (args) ...'. NULL if there isn't one.
+ */
+static const char *bt_frame_fn(const char *line, size_t *len)
+{
+	const char *f = line + 1 + strspn(line + 1, "0123456789");
+	f += strspn(f, " ");
+	if (!strncmp(f, "0x", 2)) {
+		const char *in = strstr(f, " in ");
+		if (!in)
+			return NULL;
+		f = in + 4;
+	}
+	*len = strcspn(f, " (\n");
+	return *len ? f : NULL;
+}
+
+static uint64_t fnv1a(const void *p, size_t len, uint64_t h)
+{
+	const uint8_t *c = p;
+	while (len--) {
+		h ^= *c++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+
+/*
+ * The function names of the first frames of the first backtrace gdb printed
+ * (the crashing thread), ';' separated, and a hash of them: dumps with the same
+ * signature most likely crashed the same way.
+ */
+static int triage_signature(FILE *bt, char *frames, size_t frames_len, char *sig, size_t sig_len)
+{
+	char line[4096];
+	size_t n = 0, used = 0;
+	bool seen = false;
+	frames[0] = '\0';
+	while (fgets(line, sizeof(line), bt)) {
+		if (line[0] != '#') {
+			if (seen)
+				break;
+			continue;
+		}
+		seen = true;
+		if (n == TRIAGE_FRAMES)
+			continue;
+
+		size_t fl;
+		const char *f = bt_frame_fn(line, &fl);
+		if (!f)
+			continue;
+		int w = snprintf(frames + used, frames_len - used, "%s%.*s", n ? ";" : "", (int)fl, f);
+		if (w < 0 || (size_t)w >= frames_len - used)
+			break;
+		used += w;
+		n++;
+	}
+	if (!n)
+		return -1;
+
+	snprintf(sig, sig_len, "%016jx", (uintmax_t)fnv1a(frames, strlen(frames), FNV1A_INIT));
+	return 0;
+}
+
+/* Add 'len' bytes of 't' as a term, unless it's already there */
+static void triage_term(char *terms, size_t terms_len, const char *t, size_t len)
+{
+	if (!len || len > 256)
+		return;
+	const char *p = terms;
+	while (*p) {
+		size_t l = strcspn(p, "\n");
+		if (l == len && !memcmp(p, t, len))
+			return;
+		p += l + 1;
+	}
+
+	size_t used = strlen(terms);
+	if (used + len + 2 > terms_len)
+		return;
+	memcpy(terms + used, t, len);
+	terms[used + len] = '\n';
+	terms[used + len + 1] = '\0';
+}
+
+/*
+ * What the crashing thread's backtrace gets indexed under for search: every
+ * function, source file & library in it, '\n' separated.
+ */
+static void triage_terms(FILE *bt, char *terms, size_t terms_len)
+{
+	char line[4096];
+	bool seen = false;
+	terms[0] = '\0';
+	rewind(bt);
+	while (fgets(line, sizeof(line), bt)) {
+		if (line[0] != '#') {
+			if (seen)
+				break;
+			continue;
+		}
+		seen = true;
+		line[strcspn(line, "\n")] = '\0';
+
+		size_t fnl;
+		const char *fn = bt_frame_fn(line, &fnl);
+		if (fn)
+			triage_term(terms, terms_len, fn, fnl);
+
+		/* ' at dir/file.c:123' or ' from /lib/libfoo.so' */
+		char *at = strstr(line, ") at ");
+		char *from = strstr(line, ") from ");
+		char *file = at ? at + 5 : from ? from + 7 : NULL;
+		if (file) {
+			size_t fl = at ? strcspn(file, ":") : strlen(file);
+			char *base = memrchr(file, '/', fl);
+			if (base) {
+				fl -= base + 1 - file;
+				file = base + 1;
+			}
+			triage_term(terms, terms_len, file, fl);
+		}
+	}
+}
+
+/*
+ * MinHash sketches of each triaged dump's crashing thread, for finding crashes
+ * that are alike without having the same signature (inlined or cloned
+ * functions, unsymbolized frames, ...). Appended by triage to
+ * '.search/sketches' as sketch_rec, with ids as in 'names'.
+ *
+ * Similar dumps are found by LSH: the SKETCH_K minimums are split into
+ * SKETCH_BANDS bands, and only dumps sharing all of some band's values with
+ * another are compared in full. '.search/bands' keeps the sketches in
+ * buckets by the hash of each band (chained band_links after a band_hdr), so
+ * similar looks at only the dumps in its buckets. It's brought up to date
+ * with the sketches file as each sketch is added.
+ */
+#define SKETCH_K 64
+#define SKETCH_BANDS 16
+#define SKETCH_ROWS (SKETCH_K / SKETCH_BANDS)
+#define SKETCH_BUCKETS 65536
+/* default for similar & cluster, in percent */
+#define SKETCH_MIN_SIM 50
+
+struct sketch_rec {
+	uint32_t id;
+	uint32_t min[SKETCH_K];
+};
+
+struct band_hdr {
+	/* sketches (by position in the file) & links in the index so far */
+	uint32_t recs, links;
+	/* the latest link in each bucket, + 1 */
+	uint32_t head[SKETCH_BUCKETS];
+};
+
+struct band_link {
+	uint64_t hash;
+	uint32_t rec;
+	/* the one before it in the bucket, + 1 */
+	uint32_t next;
+};
+
+static uint64_t mix64(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+static void sketch_feature(struct sketch_rec *r, uint64_t h)
+{
+	size_t i;
+	for (i = 0; i < SKETCH_K; i++) {
+		uint32_t v = mix64(h + i * 0x9e3779b97f4a7c15ULL) >> 32;
+		if (v < r->min[i])
+			r->min[i] = v;
+	}
+}
+
+/*
+ * Sketch the crashing thread's frames, each on its own & with the next
+ * (so order counts for something). Names are normalized: no glibc '__GI_'
+ * prefixes, gcc clone suffixes ('.isra.0', '.cold', ...) or '@plt', and no
+ * unsymbolized frames.
+ */
+static int sketch_make(FILE *bt, struct sketch_rec *r)
+{
+	char line[4096];
+	bool seen = false;
+	uint64_t prev = 0;
+	size_t n = 0;
+	memset(r->min, 0xff, sizeof(r->min));
+	rewind(bt);
+	while (fgets(line, sizeof(line), bt)) {
+		if (line[0] != '#') {
+			if (seen)
+				break;
+			continue;
+		}
+		seen = true;
+
+		size_t len;
+		const char *f = bt_frame_fn(line, &len);
+		if (!f || (len == 2 && !memcmp(f, "??", 2)))
+			continue;
+		if (len > 5 && !memcmp(f, "__GI_", 5)) {
+			f += 5;
+			len -= 5;
+		}
+		len = strcspn(f, ".@ (\n") < len ? strcspn(f, ".@ (\n") : len;
+		if (!len)
+			continue;
+
+		uint64_t h = fnv1a(f, len, FNV1A_INIT);
+		sketch_feature(r, h);
+		if (n)
+			sketch_feature(r, mix64(prev) ^ h);
+		prev = h;
+		n++;
+	}
+	return n ? 0 : -1;
+}
+
+/* Estimated Jaccard similarity of the frames of two dumps, in percent */
+static unsigned sketch_sim(const struct sketch_rec *a, const struct sketch_rec *b)
+{
+	unsigned same = 0;
+	size_t i;
+	for (i = 0; i < SKETCH_K; i++)
+		same += a->min[i] == b->min[i];
+	return same * 100 / SKETCH_K;
+}
+
+static bool sketch_band_eq(const struct sketch_rec *a, const struct sketch_rec *b, size_t band)
+{
+	return !memcmp(a->min + band * SKETCH_ROWS, b->min + band * SKETCH_ROWS,
+			SKETCH_ROWS * sizeof(a->min[0]));
+}
+
+static uint64_t sketch_band(const struct sketch_rec *r, size_t band)
+{
+	return fnv1a(r->min + band * SKETCH_ROWS, SKETCH_ROWS * sizeof(r->min[0]), FNV1A_INIT + band);
+}
+
+/* Put the sketches not in 'bands' yet in it, with the exclusive lock held */
+static int sketch_bands_update(int sd, int sketches_fd)
+{
+	struct stat st;
+	if (fstat(sketches_fd, &st) == -1)
+		return -1;
+	uint32_t ct = st.st_size / sizeof(struct sketch_rec);
+
+	int fd = openat(sd, "bands", O_CREAT|O_RDWR|O_CLOEXEC, 0644);
+	if (fd == -1)
+		return -1;
+	__attribute__((cleanup(freep)))
+	struct band_hdr *h = calloc(1, sizeof(*h));
+	int ret = -1;
+	ssize_t hl = h ? pread(fd, h, sizeof(*h), 0) : -1;
+	if (hl < 0)
+		goto out;
+	/* new, or not what we'd have written: start over */
+	if (hl != sizeof(*h) || h->recs > ct)
+		memset(h, 0, sizeof(*h));
+
+	for (; h->recs < ct; h->recs++) {
+		struct sketch_rec r;
+		struct band_link l[SKETCH_BANDS];
+		if (pread(sketches_fd, &r, sizeof(r), (off_t)h->recs * sizeof(r)) != sizeof(r))
+			goto out;
+		size_t b;
+		for (b = 0; b < SKETCH_BANDS; b++) {
+			l[b].hash = sketch_band(&r, b);
+			l[b].rec = h->recs;
+			l[b].next = h->head[l[b].hash % SKETCH_BUCKETS];
+			h->head[l[b].hash % SKETCH_BUCKETS] = h->links + b + 1;
+		}
+		if (pwrite(fd, l, sizeof(l), sizeof(*h) + (off_t)h->links * sizeof(l[0])) != sizeof(l))
+			goto out;
+		h->links += SKETCH_BANDS;
+	}
+	if (pwrite(fd, h, sizeof(*h), 0) == sizeof(*h))
+		ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+static int sketch_add(int dir_fd, const char *name, struct sketch_rec *r)
+{
+	int lock_fd;
+	int sd = search_open(dir_fd, LOCK_EX, &lock_fd);
+	if (sd == -1)
+		return -1;
+
+	int ret = -1;
+	if (search_id(sd, name, &r->id, true) == 0) {
+		int fd = openat(sd, "sketches", O_CREAT|O_RDWR|O_APPEND|O_CLOEXEC, 0644);
+		if (fd != -1) {
+			ret = write_all(fd, r, sizeof(*r));
+			if (ret == 0 && sketch_bands_update(sd, fd) < 0)
+				pr_warn("could not update the sketch band index\n");
+			close(fd);
+		}
+	}
+	close(lock_fd);
+	close(sd);
+	return ret;
+}
+
+/* Everything similar & cluster need, with the search dir's shared lock held */
+struct sketches {
+	int sd, lock_fd;
+	struct sketch_rec *recs;
+	size_t ct;
+	size_t map_len;
+
+	/* 'bands', NULL if there's none that can be used */
+	struct band_hdr *bh;
+	size_t bands_len;
+
+	/* names[id], from 'names' */
+	char *names_buf;
+	char **names;
+	size_t names_ct;
+};
+
+static void sketches_close(struct sketches *k)
+{
+	if (k->recs)
+		munmap(k->recs, k->map_len);
+	if (k->bh)
+		munmap(k->bh, k->bands_len);
+	free(k->names_buf);
+	free(k->names);
+	if (k->sd != -1) {
+		close(k->lock_fd);
+		close(k->sd);
+	}
+}
+
+static int sketches_open(struct sketches *k, const char *dir)
+{
+	memset(k, 0, sizeof(*k));
+	int dir_fd = open(dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	k->sd = dir_fd == -1 ? -1 : search_open(dir_fd, LOCK_SH, &k->lock_fd);
+	if (dir_fd != -1)
+		close(dir_fd);
+	if (k->sd == -1) {
+		pr_err("no sketches in '%s' (dumps are sketched by triage)\n", dir);
+		return -1;
+	}
+
+	int fd = openat(k->sd, "sketches", O_RDONLY|O_CLOEXEC);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*k->recs)) {
+		if (fd != -1)
+			close(fd);
+		pr_err("no sketches in '%s' (dumps are sketched by triage)\n", dir);
+		return -1;
+	}
+	k->ct = st.st_size / sizeof(*k->recs);
+	k->map_len = k->ct * sizeof(*k->recs);
+	k->recs = mmap(NULL, k->map_len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (k->recs == MAP_FAILED) {
+		k->recs = NULL;
+		return -1;
+	}
+
+	fd = openat(k->sd, "bands", O_RDONLY|O_CLOEXEC);
+	if (fd != -1 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(*k->bh)) {
+		k->bands_len = st.st_size;
+		k->bh = mmap(NULL, k->bands_len, PROT_READ, MAP_SHARED, fd, 0);
+		if (k->bh == MAP_FAILED)
+			k->bh = NULL;
+		else if (k->bh->recs > k->ct || sizeof(*k->bh) + (uint64_t)k->bh->links
+				* sizeof(struct band_link) > k->bands_len) {
+			munmap(k->bh, k->bands_len);
+			k->bh = NULL;
+		}
+	}
+	if (fd != -1)
+		close(fd);
+
+	fd = openat(k->sd, "names", O_RDONLY|O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &st) == -1 || !(k->names_buf = malloc(st.st_size + 1))
+			|| read(fd, k->names_buf, st.st_size) != st.st_size) {
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	close(fd);
+	k->names_buf[st.st_size] = '\0';
+
+	char *p = k->names_buf;
+	while (*p) {
+		char **n = realloc(k->names, (k->names_ct + 1) * sizeof(*n));
+		if (!n)
+			return -1;
+		k->names = n;
+		k->names[k->names_ct++] = p;
+		p += strcspn(p, "\n");
+		if (*p)
+			*p++ = '\0';
+	}
+	return 0;
+}
+
+static const char *sketches_name(struct sketches *k, uint32_t id)
+{
+	return id < k->names_ct ? k->names[id] : "?";
+}
+
+struct sim_hit {
+	unsigned sim;
+	uint32_t id;
+};
+
+static int sim_hit_cmp(const void *a_, const void *b_)
+{
+	const struct sim_hit *a = a_, *b = b_;
+	if (a->sim != b->sim)
+		return a->sim > b->sim ? -1 : 1;
+	return a->id < b->id ? -1 : a->id > b->id;
+}
+
+/* Dumps that crashed much like the given one, most alike first */
+static int act_similar(const char *dir, int argc, char *argv[])
+{
+	if (argc < 2 || argc > 3) {
+		pr_err("similar requires a dump & optionally a minimum similarity (%%)\n");
+		return EXIT_FAILURE;
+	}
+	unsigned min_sim = argc > 2 ? parse_unum(argv[2], "similarity") : SKETCH_MIN_SIM;
+
+	struct sketches k;
+	int e = EXIT_FAILURE;
+	if (sketches_open(&k, dir) < 0)
+		goto out;
+
+	/* the latest sketch of it */
+	const struct sketch_rec *q = NULL;
+	size_t i, id;
+	for (id = 0; id < k.names_ct; id++)
+		if (!strcmp(k.names[id], argv[1]))
+			break;
+	for (i = k.ct; id < k.names_ct && i-- > 0; ) {
+		if (k.recs[i].id == id) {
+			q = &k.recs[i];
+			break;
+		}
+	}
+	if (!q) {
+		pr_err("'%s' has not been triaged\n", argv[1]);
+		goto out;
+	}
+
+	/*
+	 * The dumps in its buckets, from the band index, and any sketches added
+	 * since it was last brought up to date. Found in a few buckets, a dump
+	 * is listed once each, which printing skips.
+	 */
+	struct sim_hit *hits = NULL;
+	size_t hit_ct = 0, b;
+	const struct band_link *links = k.bh ? (const struct band_link *)(k.bh + 1) : NULL;
+	uint32_t indexed = k.bh ? k.bh->recs : 0;
+	for (b = 0; b < SKETCH_BANDS; b++) {
+		uint64_t hash = sketch_band(q, b);
+		uint32_t l = links ? k.bh->head[hash % SKETCH_BUCKETS] : 0;
+		/* the band of each sketch not indexed, once */
+		i = b ? k.ct : indexed;
+		for (;;) {
+			const struct sketch_rec *r;
+			if (l) {
+				/* links only ever point back */
+				if (l > k.bh->links || links[l - 1].next >= l)
+					break;
+				const struct band_link *bl = &links[l - 1];
+				l = bl->next;
+				if (bl->hash != hash || bl->rec >= k.ct)
+					continue;
+				r = &k.recs[bl->rec];
+				if (!sketch_band_eq(q, r, b))
+					continue;
+			} else if (i < k.ct) {
+				r = &k.recs[i++];
+				size_t rb;
+				for (rb = 0; rb < SKETCH_BANDS; rb++)
+					if (sketch_band_eq(q, r, rb))
+						break;
+				if (rb == SKETCH_BANDS)
+					continue;
+			} else {
+				break;
+			}
+			if (r->id == q->id)
+				continue;
+			unsigned sim = sketch_sim(q, r);
+			if (sim < min_sim)
+				continue;
+			struct sim_hit *n = realloc(hits, (hit_ct + 1) * sizeof(*n));
+			if (!n)
+				break;
+			hits = n;
+			hits[hit_ct++] = (struct sim_hit) { sim, r->id };
+		}
+	}
+
+	if (hit_ct)
+		qsort(hits, hit_ct, sizeof(*hits), sim_hit_cmp);
+	for (i = 0; i < hit_ct; i++)
+		if (!i || hits[i].id != hits[i - 1].id)
+			printf("%3u%% %s\n", hits[i].sim, sketches_name(&k, hits[i].id));
+	free(hits);
+	e = EXIT_SUCCESS;
+out:
+	sketches_close(&k);
+	return e;
+}
+
+struct band_ent {
+	uint64_t hash;
+	uint32_t band;
+	uint32_t rec;
+};
+
+static int band_ent_cmp(const void *a_, const void *b_)
+{
+	const struct band_ent *a = a_, *b = b_;
+	if (a->band != b->band)
+		return a->band < b->band ? -1 : 1;
+	if (a->hash != b->hash)
+		return a->hash < b->hash ? -1 : 1;
+	return a->rec < b->rec ? -1 : a->rec > b->rec;
+}
+
+static uint32_t uf_find(uint32_t *parent, uint32_t x)
+{
+	while (parent[x] != x) {
+		parent[x] = parent[parent[x]];
+		x = parent[x];
+	}
+	return x;
+}
+
+struct cluster {
+	uint32_t root;
+	uint32_t size;
+};
+
+static int cluster_cmp(const void *a_, const void *b_)
+{
+	const struct cluster *a = a_, *b = b_;
+	if (a->size != b->size)
+		return a->size > b->size ? -1 : 1;
+	return a->root < b->root ? -1 : a->root > b->root;
+}
+
+/*
+ * Group all triaged dumps into clusters of similar crashes, biggest first,
+ * each shown with one of its dumps and that dump's top frames.
+ */
+static int act_cluster(const char *dir, int argc, char *argv[])
+{
+	if (argc > 2) {
+		pr_err("cluster takes an optional minimum similarity (%%)\n");
+		return EXIT_FAILURE;
+	}
+	unsigned min_sim = argc > 1 ? parse_unum(argv[1], "similarity") : SKETCH_MIN_SIM;
+
+	struct sketches k;
+	int e = EXIT_FAILURE;
+	struct band_ent *bands = NULL;
+	uint32_t *parent = NULL, *size = NULL;
+	struct cluster *cl = NULL;
+	if (sketches_open(&k, dir) < 0)
+		goto out;
+
+	bands = malloc(k.ct * SKETCH_BANDS * sizeof(*bands));
+	parent = malloc(k.ct * sizeof(*parent));
+	size = calloc(k.ct, sizeof(*size));
+	cl = malloc(k.ct * sizeof(*cl));
+	if (!bands || !parent || !size || !cl)
+		goto out;
+
+	size_t i, b, n = 0;
+	for (i = 0; i < k.ct; i++) {
+		parent[i] = i;
+		for (b = 0; b < SKETCH_BANDS; b++)
+			bands[n++] = (struct band_ent) { sketch_band(&k.recs[i], b), b, i };
+	}
+	qsort(bands, n, sizeof(*bands), band_ent_cmp);
+
+	/* dumps in the same bucket join the first one's cluster, if alike enough */
+	size_t start = 0;
+	for (i = 1; i <= n; i++) {
+		if (i < n && bands[i].band == bands[start].band && bands[i].hash == bands[start].hash)
+			continue;
+		const struct sketch_rec *first = &k.recs[bands[start].rec];
+		size_t j;
+		for (j = start + 1; j < i; j++) {
+			const struct sketch_rec *r = &k.recs[bands[j].rec];
+			if (!sketch_band_eq(first, r, bands[start].band) || sketch_sim(first, r) < min_sim)
+				continue;
+			uint32_t x = uf_find(parent, bands[start].rec), y = uf_find(parent, bands[j].rec);
+			if (x != y)
+				parent[y] = x;
+		}
+		start = i;
+	}
+
+	for (i = 0; i < k.ct; i++)
+		size[uf_find(parent, i)]++;
+	size_t ct = 0;
+	for (i = 0; i < k.ct; i++)
+		if (size[i])
+			cl[ct++] = (struct cluster) { i, size[i] };
+	qsort(cl, ct, sizeof(*cl), cluster_cmp);
+
+	int dir_fd = open(dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	printf("%8s %-40s %s\n", "DUMPS", "EXAMPLE", "FRAMES");
+	for (i = 0; i < ct; i++) {
+		const char *name = sketches_name(&k, k.recs[cl[i].root].id);
+		char info[4096], frames[512] = "";
+		int dump_fd = dir_fd == -1 ? -1 : openat(dir_fd, name, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+		if (dump_fd != -1) {
+			int core_fd = dump_core_open(dump_fd, NULL);
+			if (dump_info_read(dump_fd, core_fd, info, sizeof(info)) >= 0)
+				info_get(info, "crash-frames", frames, sizeof(frames));
+			if (core_fd != -1)
+				close(core_fd);
+			close(dump_fd);
+		}
+		printf("%8u %-40s %s\n", cl[i].size, name, frames);
+	}
+	if (dir_fd != -1)
+		close(dir_fd);
+	e = EXIT_SUCCESS;
+
+out:
+	free(bands);
+	free(parent);
+	free(size);
+	free(cl);
+	sketches_close(&k);
+	return e;
+}
+
+/* Get & record the backtrace of one dump, run in a child of triage */
+static int triage_one(const char *dir, int dir_fd, const char *name)
+{
+	int dump_fd = openat(dir_fd, name, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (dump_fd == -1)
+		return EXIT_FAILURE;
+
+	struct gdb_args g;
+	if (gdb_prepare(dir, name, dump_fd, &g) < 0)
+		return EXIT_FAILURE;
+
+	int out = openat(dump_fd, ".backtrace.txt", O_CREAT|O_TRUNC|O_RDWR|O_CLOEXEC, 0644);
+	if (out == -1) {
+		pr_err("%s: could not create backtrace.txt: %s\n", name, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	pid_t p = fork();
+	if (p == 0) {
+		int null_fd = open("/dev/null", O_RDWR);
+		if (null_fd != -1) {
+			dup2(null_fd, STDIN_FILENO);
+			dup2(null_fd, STDERR_FILENO);
+		}
+		dup2(out, STDOUT_FILENO);
+		/* a stuck gdb is killed, the alarm survives exec */
+		alarm(TRIAGE_TIMEOUT_SEC);
+		static const char *const extra[] = {
+			"-batch", "-nx",
+			"-ex", "bt",
+			"-ex", "thread apply all bt",
+			NULL
+		};
+		gdb_exec(&g, extra);
+		_exit(127);
+	}
+
+	int status = 0;
+	if (p == -1 || waitpid(p, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+		pr_err("%s: gdb failed\n", name);
+		unlinkat(dump_fd, ".backtrace.txt", 0);
+		return EXIT_FAILURE;
+	}
+
+	char frames[512], sig[32], terms[8192] = "";
+	struct sketch_rec sk;
+	int sk_r = -1;
+	lseek(out, 0, SEEK_SET);
+	FILE *bt = fdopen(out, "r");
+	int r = bt ? triage_signature(bt, frames, sizeof(frames), sig, sizeof(sig)) : -1;
+	if (bt) {
+		if (r == 0) {
+			triage_terms(bt, terms, sizeof(terms));
+			sk_r = sketch_make(bt, &sk);
+		}
+		fclose(bt);
+	} else {
+		close(out);
+	}
+	if (r < 0) {
+		pr_err("%s: no backtrace in gdb's output\n", name);
+		renameat(dump_fd, ".backtrace.txt", dump_fd, "backtrace.txt");
+		return EXIT_FAILURE;
+	}
+
+	/* the signature marks the result as complete, so it goes last */
+	if (renameat(dump_fd, ".backtrace.txt", dump_fd, "backtrace.txt") == -1
+			|| dump_meta_add(dump_fd, "crash-frames", frames) < 0
+			|| dump_meta_add(dump_fd, "signature", sig) < 0) {
+		pr_err("%s: could not record backtrace: %s\n", name, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	char frames_f[512];
+	index_field(frames_f, sizeof(frames_f), frames);
+	index_append(dir_fd, "S\t%s\t%s\t%s\n", name, sig, frames_f);
+	if (search_add(dir_fd, name, terms) < 0)
+		pr_warn("%s: could not add to the search index\n", name);
+	if (sk_r == 0 && sketch_add(dir_fd, name, &sk) < 0)
+		pr_warn("%s: could not add its sketch\n", name);
+	dprintf(STDOUT_FILENO, "%s\t%s\t%s\n", name, sig, frames);
+	return EXIT_SUCCESS;
+}
+
+/* Triage a dump just stored, detached & at low priority (auto-triage) */
+static void triage_spawn(const char *dir, const char *name)
+{
+	pid_t p = fork();
+	if (p == -1) {
+		pr_warn("could not start triage: %s\n", strerror(errno));
+		return;
+	}
+
+	if (p) {
+		waitpid(p, NULL, 0);
+		return;
+	}
+
+	setsid();
+	if (fork() != 0)
+		_exit(EXIT_SUCCESS);
+
+	ioprio_set_self(IOPRIO_CLASS_IDLE, 0);
+	setpriority(PRIO_PROCESS, 0, 19);
+	int null_fd = open("/dev/null", O_RDWR);
+	if (null_fd != -1) {
+		dup2(null_fd, STDIN_FILENO);
+		dup2(null_fd, STDOUT_FILENO);
+	}
+	int dir_fd = open(dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	_exit(dir_fd == -1 ? EXIT_FAILURE : triage_one(dir, dir_fd, name));
+}
+
+struct triage_ctx {
+	char **sel;
+	int sel_ct;
+
+	struct triage_dump {
+		char *name;
+		/* what a job for it is expected to need, in bytes */
+		uint64_t mem;
+	} *todo;
+	size_t todo_ct;
+};
+
+/*
+ * Selectors: 'all', 'comm=<comm>', 'sig=<signal>', 'since=<unix-timestamp>',
+ * 'group=<dump>' (all of which must match) or dump names (any of which may).
+ */
+static bool dump_match(char **sel, int sel_ct, const char *name, const char *info)
+{
+	bool named = false, name_hit = false;
+	int i;
+	for (i = 0; i < sel_ct; i++) {
+		const char *s = sel[i];
+		char v[64];
+		if (!strcmp(s, "all"))
+			continue;
+		if (!strncmp(s, "comm=", 5)) {
+			if (!info_get(info, "comm", v, sizeof(v)) || strcmp(v, s + 5))
+				return false;
+		} else if (!strncmp(s, "sig=", 4)) {
+			if (info_get_unum(info, "signal") != strtoumax(s + 4, NULL, 10))
+				return false;
+		} else if (!strncmp(s, "group=", 6)) {
+			if (!info_get(info, "group", v, sizeof(v)) || strcmp(v, s + 6))
+				return false;
+		} else if (!strncmp(s, "since=", 6)) {
+			if (info_get_unum(info, "timestamp") < strtoumax(s + 6, NULL, 10))
+				return false;
+		} else {
+			named = true;
+			name_hit |= !strcmp(s, name);
+		}
+	}
+	return !named || name_hit;
+}
+
+static int triage_select(int dump_fd, const char *name, void *ctx_)
+{
+	struct triage_ctx *t = ctx_;
+	char info[4096];
+	int core_fd = dump_core_open(dump_fd, NULL);
+	ssize_t il = dump_info_read(dump_fd, core_fd, info, sizeof(info));
+	if (core_fd != -1)
+		close(core_fd);
+	if (il < 0 || !dump_match(t->sel, t->sel_ct, name, info))
+		return 0;
+
+	/* done before: just show it */
+	char sig[32], frames[512];
+	if (info_get(info, "signature", sig, sizeof(sig))) {
+		if (!info_get(info, "crash-frames", frames, sizeof(frames)))
+			frames[0] = '\0';
+		printf("%s\t%s\t%s\n", name, sig, frames);
+		return 0;
+	}
+
+	/* gdb itself, plus the core if it has to be decoded into memory */
+	uint64_t size = info_get_unum(info, "size");
+	uint64_t mem = 256 * 1024 * 1024 + size / 4;
+	if (info_get(info, "compress", sig, sizeof(sig)) || info_get(info, "encrypt", sig, sizeof(sig)))
+		mem += size;
+
+	struct triage_dump *n = realloc(t->todo, (t->todo_ct + 1) * sizeof(*n));
+	if (!n)
+		return -1;
+	t->todo = n;
+	n[t->todo_ct].name = strdup(name);
+	n[t->todo_ct].mem = mem;
+	if (!n[t->todo_ct].name)
+		return -1;
+	t->todo_ct++;
+	return 0;
+}
+
+/*
+ * grep: searching the memory in cores for strings or values. Each core is
+ * split into GREP_CHUNK sized pieces, searched by up to a process per CPU;
+ * within each, candidates come from pair_scan() over its PT_LOAD segments and
+ * matches are reported by the address they were at in the process.
+ */
+#define GREP_CHUNK (256ULL * 1024 * 1024)
+/* bytes after a match shown, while printable */
+#define GREP_CONTEXT 48
+
+struct grep_pat {
+	const char *arg;
+	uint8_t *b;
+	size_t len;
+};
+
+struct grep {
+	struct grep_pat *pats;
+	size_t ct;
+	size_t max_len;
+	struct pair_set ps;
+
+	/* while scanning: the dump, & the address of buf[0] */
+	const char *name;
+	uint64_t vaddr;
+	uint64_t matches;
+};
+
+/*
+ * 'hex:<bytes>' and 'u32:<n>' / 'u64:<n>' (in host byte order, as a value
+ * would be in memory), or text to find as it is.
+ */
+static int grep_pat_parse(struct grep_pat *p, const char *arg)
+{
+	p->arg = arg;
+	if (!strncmp(arg, "hex:", 4)) {
+		const char *h = arg + 4;
+		size_t hl = strlen(h);
+		if (hl % 2 || !(p->b = malloc(hl / 2)))
+			return -1;
+		for (p->len = 0; p->len < hl / 2; p->len++) {
+			unsigned v;
+			if (!isxdigit((unsigned char)h[p->len * 2]) || !isxdigit((unsigned char)h[p->len * 2 + 1])
+					|| sscanf(h + p->len * 2, "%2x", &v) != 1)
+				return -1;
+			p->b[p->len] = v;
+		}
+	} else if (!strncmp(arg, "u32:", 4) || !strncmp(arg, "u64:", 4)) {
+		char *end;
+		errno = 0;
+		uintmax_t v = strtoumax(arg + 4, &end, 0);
+		if (errno || *end || end == arg + 4)
+			return -1;
+		p->len = arg[1] == '3' ? 4 : 8;
+		if (p->len == 4 && v > UINT32_MAX)
+			return -1;
+		if (!(p->b = malloc(8)))
+			return -1;
+		uint32_t v32 = v;
+		uint64_t v64 = v;
+		memcpy(p->b, p->len == 4 ? (void *)&v32 : (void *)&v64, p->len);
+	} else {
+		p->len = strlen(arg);
+		if (!(p->b = malloc(p->len + 1)))
+			return -1;
+		memcpy(p->b, arg, p->len);
+	}
+	return p->len >= 2 ? 0 : -1;
+}
+
+static size_t grep_at(void *ctx, uint8_t *buf, size_t len, size_t at)
+{
+	struct grep *g = ctx;
+	size_t i;
+	for (i = 0; i < g->ct; i++) {
+		const struct grep_pat *p = &g->pats[i];
+		if (len - at < p->len || memcmp(buf + at, p->b, p->len))
+			continue;
+
+		char text[GREP_CONTEXT + 1];
+		size_t n = 0;
+		while (n < GREP_CONTEXT && at + n < len && isprint(buf[at + n])) {
+			text[n] = buf[at + n];
+			n++;
+		}
+		text[n] = '\0';
+		/* one write per line, so concurrent jobs' lines don't mix */
+		dprintf(STDOUT_FILENO, "%s\t0x%016" PRIx64 "\t%s\t%s\n", g->name, g->vaddr + at, p->arg, text);
+		g->matches++;
+	}
+	return at + 1;
+}
+
+/* Search the core of dump 'name' from offset start to end, run in a child */
+static int grep_chunk(struct grep *g, int dir_fd, const char *name, uint64_t start, uint64_t end)
+{
+	int dump_fd = openat(dir_fd, name, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (dump_fd == -1)
+		return 2;
+	struct core_reader cr;
+	int r = core_reader_open(&cr, dump_fd);
+	close(dump_fd);
+	if (r < 0)
+		return 2;
+
+	struct core_seg *segs;
+	size_t ct, i;
+	uint8_t *buf = malloc(CFG_FRAME_SIZE + g->max_len);
+	if (!buf || core_segments(&cr, &segs, &ct, NULL) < 0) {
+		free(buf);
+		core_reader_close(&cr);
+		return 2;
+	}
+
+	g->name = name;
+	int ret = 0;
+	for (i = 0; i < ct && !ret; i++) {
+		uint64_t s_end = segs[i].off + segs[i].filesz;
+		uint64_t off = segs[i].off > start ? segs[i].off : start;
+		/* matches that start in this chunk, which may run past its end */
+		while (off < s_end && off < end) {
+			size_t scan = CFG_FRAME_SIZE - off % CFG_FRAME_SIZE;
+			if (scan > end - off)
+				scan = end - off;
+			if (scan > s_end - off)
+				scan = s_end - off;
+			size_t want = scan + g->max_len - 1;
+			if (want > s_end - off)
+				want = s_end - off;
+
+			ssize_t rl = core_reader_read(&cr, buf, want, off);
+			if (rl < 0) {
+				ret = 2;
+				break;
+			}
+			if ((size_t)rl < want)
+				want = rl;
+			if (want < scan)
+				scan = want;
+			g->vaddr = segs[i].vaddr + (off - segs[i].off);
+			pair_scan(&g->ps, buf, want, scan, grep_at, g);
+			if (!scan)
+				break;
+			off += scan;
+		}
+	}
+
+	free(segs);
+	free(buf);
+	core_reader_close(&cr);
+	if (ret)
+		pr_err("%s: could not read core\n", name);
+	return ret ? ret : g->matches ? 0 : 1;
+}
+
+struct grep_job {
+	char *name;
+	uint64_t start, end;
+};
+
+struct grep_ctx {
+	char **sel;
+	int sel_ct;
+	struct grep_job *jobs;
+	size_t ct;
+};
+
+/* Split the cores of the dumps selected into chunks */
+static int grep_select(int dump_fd, const char *name, void *ctx_)
+{
+	struct grep_ctx *g = ctx_;
+	char info[4096];
+	int core_fd = dump_core_open(dump_fd, NULL);
+	ssize_t il = dump_info_read(dump_fd, core_fd, info, sizeof(info));
+	if (core_fd != -1)
+		close(core_fd);
+	if (il < 0 || !dump_match(g->sel, g->sel_ct, name, info))
+		return 0;
+
+	struct core_reader cr;
+	if (core_reader_open(&cr, dump_fd) < 0)
+		return 0;
+	uint64_t size = cr.size, off;
+	core_reader_close(&cr);
+
+	for (off = 0; off < size; off += GREP_CHUNK) {
+		struct grep_job *n = realloc(g->jobs, (g->ct + 1) * sizeof(*n));
+		if (!n)
+			return -1;
+		g->jobs = n;
+		n[g->ct].name = strdup(name);
+		n[g->ct].start = off;
+		n[g->ct].end = size - off > GREP_CHUNK ? off + GREP_CHUNK : size;
+		if (!n[g->ct].name)
+			return -1;
+		g->ct++;
+	}
+	return 0;
+}
+
+/*
+ * Exits like grep(1): 0 if anything was found, 1 if not, 2 on errors (where
+ * nothing was found).
+ */
+static int act_grep(const char *dir, int argc, char *argv[])
+{
+	int in;
+	for (in = 1; in < argc && strcmp(argv[in], "in"); in++)
+		;
+	if (in == 1 || in >= argc - 1) {
+		pr_err("grep requires patterns, then 'in' and a selector ('all', a dump, comm=, sig= or since=)\n");
+		return 2;
+	}
+
+	struct grep g = { .ct = in - 1 };
+	g.pats = calloc(g.ct, sizeof(*g.pats));
+	if (!g.pats)
+		return 2;
+	size_t i;
+	int e = 2;
+	for (i = 0; i < g.ct; i++) {
+		if (grep_pat_parse(&g.pats[i], argv[i + 1]) < 0) {
+			pr_err("bad pattern '%s' (at least 2 bytes of text, hex:<bytes>, u32:<n> or u64:<n>)\n", argv[i + 1]);
+			goto out;
+		}
+		if (pair_set_add(&g.ps, g.pats[i].b[0], g.pats[i].b[1]) < 0) {
+			pr_err("too many patterns\n");
+			goto out;
+		}
+		if (g.pats[i].len > g.max_len)
+			g.max_len = g.pats[i].len;
+	}
+
+	int dir_fd = open(dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (dir_fd == -1) {
+		pr_err("could not open storage dir '%s': %s\n", dir, strerror(errno));
+		goto out;
+	}
+	struct grep_ctx gc = { .sel = argv + in + 1, .sel_ct = argc - in - 1 };
+	if (for_each_dump(dir_fd, grep_select, &gc) < 0) {
+		pr_err("could not list dumps\n");
+		close(dir_fd);
+		goto out;
+	}
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t max_jobs = cpus > 0 ? cpus : 1, running = 0, next = 0;
+	bool found = false, failed = false;
+	while (next < gc.ct || running) {
+		while (next < gc.ct && running < max_jobs) {
+			pid_t p = fork();
+			if (p == 0)
+				_exit(grep_chunk(&g, dir_fd, gc.jobs[next].name, gc.jobs[next].start, gc.jobs[next].end));
+			if (p == -1) {
+				pr_err("could not start grep job: %s\n", strerror(errno));
+				failed = true;
+			} else {
+				running++;
+			}
+			next++;
+		}
+
+		int status;
+		if (wait(&status) == -1)
+			break;
+		running--;
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+			found = true;
+		else if (!WIFEXITED(status) || WEXITSTATUS(status) != 1)
+			failed = true;
+	}
+	e = found ? 0 : failed ? 2 : 1;
+
+	for (i = 0; i < gc.ct; i++)
+		free(gc.jobs[i].name);
+	free(gc.jobs);
+	close(dir_fd);
+out:
+	for (i = 0; i < g.ct; i++)
+		free(g.pats[i].b);
+	free(g.pats);
+	return e;
+}
+
+/*
+ * diff: comparing the memory of two cores, page by page, by address. The
+ * address space is cut where either core's segments start or end or stop
+ * having data, and each piece is compared (both have its memory), or noted as
+ * mapped in only one, or as not comparable (mapped in both, but missing from
+ * a core). Pieces go to up to a process per CPU in runs of about equal size,
+ * each reading DIFF_BUF at a time from both cores, so memory use is bounded
+ * whatever their size. Changes less than DIFF_JOIN apart are reported as one
+ * region, and jobs write their regions to unlinked files in the storage dir,
+ * which are read back in order.
+ */
+#define DIFF_PAGE 4096
+#define DIFF_BUF CFG_FRAME_SIZE
+#define DIFF_JOIN (64 * 1024)
+/* the most of a piece a job gets, for even shares */
+#define DIFF_PIECE (256ULL * 1024 * 1024)
+
+enum diff_kind {
+	DIFF_SAME,
+	DIFF_CHANGED,
+	DIFF_ONLY_A,
+	DIFF_ONLY_B,
+	DIFF_MISSING,
+};
+
+static const char *const diff_kind_names[] = {
+	[DIFF_SAME] = "same",
+	[DIFF_CHANGED] = "changed",
+	[DIFF_ONLY_A] = "only-a",
+	[DIFF_ONLY_B] = "only-b",
+	[DIFF_MISSING] = "missing",
+};
+
+struct diff_piece {
+	uint64_t lo, hi;
+	/* where the piece's memory is in each core, if compared */
+	uint64_t a_off, b_off;
+	enum diff_kind kind;
+};
+
+/*
+ * A region of one kind, as jobs report them; bytes is how many differ, same
+ * how much unchanged memory between changes was joined into it
+ */
+struct diff_rec {
+	uint64_t lo, hi;
+	uint64_t bytes, same;
+	uint32_t kind;
+};
+
+/* The region being added to, and unchanged memory after it that may yet be joined */
+struct diff_join {
+	struct diff_rec last, gap;
+};
+
+/* Bytes that differ between a & b */
+static size_t page_diff(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t n = 0, i = 0;
+#ifdef __SSE2__
+	for (; i + 64 <= len; i += 64) {
+		__m128i eq[4];
+		size_t k;
+		for (k = 0; k < 4; k++)
+			eq[k] = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + k * 16)),
+					_mm_loadu_si128((const __m128i *)(b + i + k * 16)));
+		/* nearly always: all 64 the same */
+		__m128i all = _mm_and_si128(_mm_and_si128(eq[0], eq[1]), _mm_and_si128(eq[2], eq[3]));
+		if (_mm_movemask_epi8(all) == 0xffff)
+			continue;
+		for (k = 0; k < 4; k++)
+			n += 16 - __builtin_popcount(_mm_movemask_epi8(eq[k]));
+	}
+#endif
+	for (; i < len; i++)
+		n += a[i] != b[i];
+	return n;
+}
+
+/* What's at addr in segs (sorted by address): 0 nothing, 1 memory not in the core, 2 in the core at *off */
+static int diff_state(const struct core_seg *segs, size_t ct, size_t *i, uint64_t addr, uint64_t *off)
+{
+	while (*i < ct && segs[*i].vaddr + segs[*i].memsz <= addr)
+		(*i)++;
+	if (*i == ct || segs[*i].vaddr > addr)
+		return 0;
+	if (addr - segs[*i].vaddr >= segs[*i].filesz)
+		return 1;
+	*off = segs[*i].off + (addr - segs[*i].vaddr);
+	return 2;
+}
+
+static int u64_cmp(const void *a_, const void *b_)
+{
+	uint64_t a = *(const uint64_t *)a_, b = *(const uint64_t *)b_;
+	return a < b ? -1 : a > b;
+}
+
+static int core_seg_cmp(const void *a_, const void *b_)
+{
+	const struct core_seg *a = a_, *b = b_;
+	return a->vaddr < b->vaddr ? -1 : a->vaddr > b->vaddr;
+}
+
+/* Cut the address spaces of both cores into pieces, see above */
+static int diff_pieces(struct core_seg *a, size_t a_ct, struct core_seg *b, size_t b_ct,
+		struct diff_piece **pieces, size_t *ct)
+{
+	qsort(a, a_ct, sizeof(*a), core_seg_cmp);
+	qsort(b, b_ct, sizeof(*b), core_seg_cmp);
+
+	size_t n = 0, i;
+	uint64_t *cuts = malloc((a_ct + b_ct) * 3 * sizeof(*cuts) + 1);
+	if (!cuts)
+		return -1;
+	for (i = 0; i < a_ct; i++) {
+		cuts[n++] = a[i].vaddr;
+		cuts[n++] = a[i].vaddr + (a[i].filesz < a[i].memsz ? a[i].filesz : a[i].memsz);
+		cuts[n++] = a[i].vaddr + a[i].memsz;
+	}
+	for (i = 0; i < b_ct; i++) {
+		cuts[n++] = b[i].vaddr;
+		cuts[n++] = b[i].vaddr + (b[i].filesz < b[i].memsz ? b[i].filesz : b[i].memsz);
+		cuts[n++] = b[i].vaddr + b[i].memsz;
+	}
+	qsort(cuts, n, sizeof(*cuts), u64_cmp);
+
+	*pieces = NULL;
+	*ct = 0;
+	size_t ai = 0, bi = 0, alloc = 0;
+	for (i = 0; i + 1 < n; i++) {
+		uint64_t lo = cuts[i], hi = cuts[i + 1];
+		if (lo == hi)
+			continue;
+		struct diff_piece p = { .lo = lo, .hi = hi };
+		int as = diff_state(a, a_ct, &ai, lo, &p.a_off);
+		int bs = diff_state(b, b_ct, &bi, lo, &p.b_off);
+		if (!as && !bs)
+			continue;
+		p.kind = !bs ? DIFF_ONLY_A : !as ? DIFF_ONLY_B : as == 2 && bs == 2 ? DIFF_SAME : DIFF_MISSING;
+
+		/* big pieces are compared in parts, so they can be shared out */
+		do {
+			if (*ct == alloc) {
+				alloc = alloc ? alloc * 2 : 256;
+				struct diff_piece *np = realloc(*pieces, alloc * sizeof(*np));
+				if (!np) {
+					free(cuts);
+					return -1;
+				}
+				*pieces = np;
+			}
+			struct diff_piece *d = &(*pieces)[(*ct)++];
+			*d = p;
+			if (p.kind == DIFF_SAME && p.hi - p.lo > DIFF_PIECE) {
+				d->hi = p.lo + DIFF_PIECE;
+				p.a_off += DIFF_PIECE;
+				p.b_off += DIFF_PIECE;
+			}
+			p.lo = d->hi;
+		} while (p.lo < p.hi);
+	}
+	free(cuts);
+	return 0;
+}
+
+/*
+ * Add a region to the ones being reported, joining it to the last if it can,
+ * and putting the (up to 2) regions it finishes in out
+ */
+static size_t diff_join(struct diff_join *dj, const struct diff_rec *r, struct diff_rec out[2])
+{
+	struct diff_rec *l = &dj->last, *g = &dj->gap;
+	size_t n = 0;
+
+	/* a little unchanged memory, then maybe another change */
+	if (l->hi != l->lo && l->kind == DIFF_CHANGED && (g->hi != g->lo ? g->hi : l->hi) == r->lo) {
+		if (r->kind == DIFF_SAME && (g->hi - g->lo) + (r->hi - r->lo) <= DIFF_JOIN) {
+			if (g->hi == g->lo)
+				*g = *r;
+			else
+				g->hi = r->hi;
+			return 0;
+		}
+		if (r->kind == DIFF_CHANGED) {
+			l->same += (g->hi - g->lo) + r->same;
+			l->hi = r->hi;
+			l->bytes += r->bytes;
+			g->lo = g->hi = 0;
+			return 0;
+		}
+	}
+	if (g->hi != g->lo) {
+		out[n++] = *l;
+		*l = *g;
+		g->lo = g->hi = 0;
+	}
+	if (l->hi == r->lo && l->kind == r->kind && l->hi != l->lo) {
+		l->hi = r->hi;
+		l->bytes += r->bytes;
+		l->same += r->same;
+		return n;
+	}
+	if (l->hi != l->lo)
+		out[n++] = *l;
+	*l = *r;
+	return n;
+}
+
+/* The regions still held back, at the end */
+static size_t diff_join_end(struct diff_join *dj, struct diff_rec out[2])
+{
+	size_t n = 0;
+	if (dj->last.hi != dj->last.lo)
+		out[n++] = dj->last;
+	if (dj->gap.hi != dj->gap.lo)
+		out[n++] = dj->gap;
+	memset(dj, 0, sizeof(*dj));
+	return n;
+}
+
+static int diff_emit(int out_fd, struct diff_join *dj, const struct diff_rec *r)
+{
+	struct diff_rec out[2];
+	size_t n = diff_join(dj, r, out);
+	return n ? write_all(out_fd, out, n * sizeof(*out)) : 0;
+}
+
+struct diff_job {
+	/* its pieces */
+	size_t first, ct;
+	/* the diff_recs it writes */
+	int fd;
+	pid_t pid;
+};
+
+/* Compare pieces[0, ct), writing diff_recs to out_fd. Runs in a child */
+static int diff_compare(const char *dir, const char *a, const char *b,
+		const struct diff_piece *pieces, size_t ct, int out_fd)
+{
+	struct core_reader ra, rb;
+	int ad = dump_open(dir, a), bd = dump_open(dir, b);
+	if (ad == -1 || bd == -1 || core_reader_open(&ra, ad) < 0)
+		return EXIT_FAILURE;
+	if (core_reader_open(&rb, bd) < 0)
+		return EXIT_FAILURE;
+	close(ad);
+	close(bd);
+
+	uint8_t *ba = malloc(DIFF_BUF), *bb = malloc(DIFF_BUF);
+	if (!ba || !bb)
+		return EXIT_FAILURE;
+
+	struct diff_join dj = { 0 };
+	struct diff_rec out[2];
+	size_t i, n;
+	for (i = 0; i < ct; i++) {
+		const struct diff_piece *p = &pieces[i];
+		if (p->kind != DIFF_SAME) {
+			struct diff_rec r = { p->lo, p->hi, 0, 0, p->kind };
+			if (diff_emit(out_fd, &dj, &r) < 0)
+				return EXIT_FAILURE;
+			continue;
+		}
+
+		uint64_t at;
+		for (at = p->lo; at < p->hi; ) {
+			size_t len = p->hi - at > DIFF_BUF ? DIFF_BUF : p->hi - at;
+			ssize_t la = core_reader_read(&ra, ba, len, p->a_off + (at - p->lo));
+			ssize_t lb = core_reader_read(&rb, bb, len, p->b_off + (at - p->lo));
+			if (la < 0 || lb < 0)
+				return EXIT_FAILURE;
+			/* a truncated core */
+			if ((size_t)la < len || (size_t)lb < len) {
+				struct diff_rec r = { at, p->hi, 0, 0, DIFF_MISSING };
+				if (diff_emit(out_fd, &dj, &r) < 0)
+					return EXIT_FAILURE;
+				break;
+			}
+
+			size_t off;
+			for (off = 0; off < len; off += DIFF_PAGE) {
+				size_t pl = len - off < DIFF_PAGE ? len - off : DIFF_PAGE;
+				size_t d = page_diff(ba + off, bb + off, pl);
+				struct diff_rec r = { at + off, at + off + pl, d, 0, d ? DIFF_CHANGED : DIFF_SAME };
+				if (diff_emit(out_fd, &dj, &r) < 0)
+					return EXIT_FAILURE;
+			}
+			at += len;
+		}
+	}
+	n = diff_join_end(&dj, out);
+	if (n && write_all(out_fd, out, n * sizeof(*out)) < 0)
+		return EXIT_FAILURE;
+
+	free(ba);
+	free(bb);
+	core_reader_close(&ra);
+	core_reader_close(&rb);
+	return EXIT_SUCCESS;
+}
+
+/* Print the regions that changed or weren't compared, counting all of them */
+static void diff_print(const struct diff_rec *r, size_t n, uint64_t *sum, uint64_t *changed_bytes)
+{
+	size_t i;
+	for (i = 0; i < n; i++) {
+		sum[r[i].kind] += r[i].hi - r[i].lo - r[i].same;
+		sum[DIFF_SAME] += r[i].same;
+		*changed_bytes += r[i].bytes;
+		if (r[i].kind != DIFF_SAME)
+			printf("%-8s 0x%016" PRIx64 "-0x%016" PRIx64 " %12" PRIu64 " %12" PRIu64 "\n",
+					diff_kind_names[r[i].kind], r[i].lo, r[i].hi, r[i].hi - r[i].lo, r[i].bytes);
+	}
+}
+
+static int diff_segments(const char *dir, const char *dump, struct core_seg **segs, size_t *ct)
+{
+	int fd = dump_open(dir, dump);
+	if (fd == -1)
+		return -1;
+	struct core_reader cr;
+	int r = core_reader_open(&cr, fd);
+	close(fd);
+	if (r < 0)
+		return -1;
+	r = core_segments(&cr, segs, ct, NULL);
+	core_reader_close(&cr);
+	return r;
+}
+
+/*
+ * Print the regions that differ between the memory of two dumps, in address
+ * order, then how much of each kind there was. Unchanged memory is only
+ * counted.
+ */
+static int act_diff(const char *dir, int argc, char *argv[])
+{
+	if (argc != 3) {
+		pr_err("diff requires 2 dumps\n");
+		return EXIT_FAILURE;
+	}
+
+	struct core_seg *sa = NULL, *sb = NULL;
+	size_t sa_ct, sb_ct, ct = 0, i;
+	struct diff_piece *pieces = NULL;
+	struct diff_job *job = NULL;
+	int e = EXIT_FAILURE;
+	if (diff_segments(dir, argv[1], &sa, &sa_ct) < 0 || diff_segments(dir, argv[2], &sb, &sb_ct) < 0)
+		goto out;
+	if (diff_pieces(sa, sa_ct, sb, sb_ct, &pieces, &ct) < 0)
+		goto out;
+
+	uint64_t total = 0;
+	for (i = 0; i < ct; i++)
+		if (pieces[i].kind == DIFF_SAME)
+			total += pieces[i].hi - pieces[i].lo;
+
+	/* runs of pieces with about equal amounts to compare, each to a job */
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t jobs = cpus > 0 ? cpus : 1;
+	job = calloc(jobs, sizeof(*job));
+	if (!job)
+		goto out;
+	size_t j = 0, at = 0;
+	uint64_t done = 0;
+	for (j = 0; j < jobs; j++) {
+		uint64_t share = total * (j + 1) / jobs;
+		job[j].first = at;
+		while (at < ct && (j + 1 == jobs || done < share || pieces[at].kind != DIFF_SAME)) {
+			if (pieces[at].kind == DIFF_SAME)
+				done += pieces[at].hi - pieces[at].lo;
+			at++;
+		}
+		job[j].ct = at - job[j].first;
+		job[j].fd = -1;
+		job[j].pid = -1;
+		if (!job[j].ct)
+			continue;
+
+		job[j].fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+		if (job[j].fd == -1)
+			break;
+		job[j].pid = fork();
+		if (job[j].pid == 0)
+			_exit(diff_compare(dir, argv[1], argv[2], pieces + job[j].first, job[j].ct, job[j].fd));
+		if (job[j].pid == -1)
+			break;
+	}
+	if (j < jobs) {
+		pr_err("could not start diff job: %s\n", strerror(errno));
+		jobs = j + 1;
+	}
+
+	/* in order, joining regions across jobs */
+	printf("%-8s %-37s %12s %12s\n", "KIND", "ADDRESSES", "SIZE", "DIFFERING");
+	uint64_t sum[ARRAY_SIZE(diff_kind_names)] = { 0 }, changed_bytes = 0;
+	struct diff_join dj = { 0 };
+	struct diff_rec out[2];
+	size_t n;
+	bool ok = j == jobs;
+	for (j = 0; j < jobs; j++) {
+		int status;
+		if (job[j].pid > 0 && (waitpid(job[j].pid, &status, 0) == -1
+					|| !WIFEXITED(status) || WEXITSTATUS(status))) {
+			pr_err("diff job failed\n");
+			ok = false;
+		}
+		if (job[j].fd == -1)
+			continue;
+
+		/* buffered, as there may be a lot of them */
+		FILE *f = ok ? fdopen(job[j].fd, "r") : NULL;
+		struct diff_rec r;
+		if (!f) {
+			close(job[j].fd);
+			continue;
+		}
+		rewind(f);
+		while (fread(&r, sizeof(r), 1, f) == 1 && r.kind < ARRAY_SIZE(diff_kind_names)) {
+			n = diff_join(&dj, &r, out);
+			diff_print(out, n, sum, &changed_bytes);
+		}
+		fclose(f);
+	}
+	if (!ok)
+		goto out;
+	n = diff_join_end(&dj, out);
+	diff_print(out, n, sum, &changed_bytes);
+
+	uint64_t a_map = 0, b_map = 0;
+	for (i = 0; i < sa_ct; i++)
+		a_map += sa[i].memsz;
+	for (i = 0; i < sb_ct; i++)
+		b_map += sb[i].memsz;
+	printf("mapped: %" PRIu64 " in a (%zu segments), %" PRIu64 " in b (%zu segments)\n",
+			a_map, sa_ct, b_map, sb_ct);
+	printf("compared: %" PRIu64 ", changed: %" PRIu64 " (%" PRIu64 " bytes differ), only in a: %" PRIu64
+			", only in b: %" PRIu64 ", missing from a core: %" PRIu64 "\n",
+			sum[DIFF_SAME] + sum[DIFF_CHANGED], sum[DIFF_CHANGED], changed_bytes,
+			sum[DIFF_ONLY_A], sum[DIFF_ONLY_B], sum[DIFF_MISSING]);
+	e = EXIT_SUCCESS;
+
+out:
+	free(sa);
+	free(sb);
+	free(pieces);
+	free(job);
+	return e;
+}
+
+/*
+ * analyze-storage: what the stored cores would take with zero & same-filled
+ * pages left out, duplicate pages stored once (within each core, & across
+ * all of them), and deflate at a few levels. Cores are read in pieces, by up
+ * to a process per CPU, each sending back its counts and the hashes of its
+ * pages, for finding duplicates.
+ *
+ * With more than ANALYZE_MAX_HASHES pages, only 1 in so many of them are
+ * hashed, picked by hash so that copies of a page are all picked or not; with
+ * more than ANALYZE_MAX_Z bytes, only some frames (picked at random) are
+ * deflated. Either way the results are scaled up.
+ */
+#define ANALYZE_PAGE 4096
+#define ANALYZE_CHUNK (256ULL * 1024 * 1024)
+#define ANALYZE_MAX_HASHES (16ULL * 1024 * 1024)
+#define ANALYZE_MAX_Z (1ULL * 1024 * 1024 * 1024)
+
+static const int analyze_levels[] = { 1, 6, 9 };
+
+struct analyze_counts {
+	uint64_t bytes;
+	uint64_t pages;
+	uint64_t zero;
+	uint64_t same;
+	/* of the frames deflated: their size, & deflated at each level */
+	uint64_t z_in;
+	uint64_t z_out[ARRAY_SIZE(analyze_levels)];
+	/* analyze_page records that follow */
+	uint64_t hashes;
+};
+
+struct analyze_page {
+	uint64_t hash;
+	uint32_t core;
+};
+
+static uint64_t page_hash(const uint8_t *p, size_t len)
+{
+	uint64_t h = len, w;
+	size_t i;
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, p + i, 8);
+		h = (h ^ mix64(w + i)) * 0x9e3779b97f4a7c15ULL;
+	}
+	for (; i < len; i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	return mix64(h);
+}
+
+/* Whether the page is all one 8 byte value, as zram & ksm see fill */
+static bool page_same_filled(const uint8_t *p, size_t len, uint64_t *fill)
+{
+	if (len % 8)
+		return false;
+	memcpy(fill, p, 8);
+	size_t i;
+	for (i = 8; i < len; i += 8)
+		if (memcmp(p, p + i, 8))
+			return false;
+	return true;
+}
+
+/* Analyze the core of dump 'name' from start to end, run in a child */
+static int analyze_chunk(int dir_fd, const char *name, uint32_t core, uint64_t start, uint64_t end,
+		uint64_t hash_rate, uint64_t z_rate, int out_fd)
+{
+	int dump_fd = openat(dir_fd, name, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (dump_fd == -1)
+		return EXIT_FAILURE;
+	struct core_reader cr;
+	int r = core_reader_open(&cr, dump_fd);
+	close(dump_fd);
+	if (r < 0)
+		return EXIT_FAILURE;
+
+	struct analyze_counts c = { 0 };
+	uint8_t *buf = malloc(CFG_FRAME_SIZE);
+	uLong zb_len = compressBound(CFG_FRAME_SIZE);
+	uint8_t *zb = malloc(zb_len);
+	FILE *out = fdopen(dup(out_fd), "w");
+	if (!buf || !zb || !out)
+		return EXIT_FAILURE;
+	/* the counts go first, once known */
+	if (fwrite(&c, sizeof(c), 1, out) != 1)
+		return EXIT_FAILURE;
+
+	uint64_t off;
+	for (off = start; off < end; ) {
+		ssize_t rl = core_reader_read(&cr, buf, end - off < CFG_FRAME_SIZE ? end - off : CFG_FRAME_SIZE, off);
+		if (rl <= 0)
+			return EXIT_FAILURE;
+
+		size_t i;
+		for (i = 0; i < (size_t)rl; i += ANALYZE_PAGE) {
+			size_t pl = rl - i < ANALYZE_PAGE ? rl - i : ANALYZE_PAGE;
+			uint64_t fill;
+			c.pages++;
+			if (page_same_filled(buf + i, pl, &fill)) {
+				if (fill)
+					c.same++;
+				else
+					c.zero++;
+				continue;
+			}
+			struct analyze_page ap = { page_hash(buf + i, pl), core };
+			if (ap.hash % hash_rate)
+				continue;
+			if (fwrite(&ap, sizeof(ap), 1, out) != 1)
+				return EXIT_FAILURE;
+			c.hashes++;
+		}
+
+		if (mix64((uint64_t)core << 40 ^ off / CFG_FRAME_SIZE) % z_rate == 0) {
+			c.z_in += rl;
+			for (i = 0; i < ARRAY_SIZE(analyze_levels); i++) {
+				uLongf zl = zb_len;
+				if (compress2(zb, &zl, buf, rl, analyze_levels[i]) != Z_OK)
+					zl = rl;
+				c.z_out[i] += zl;
+			}
+		}
+		c.bytes += rl;
+		off += rl;
+	}
+
+	if (fflush(out) || pwrite(out_fd, &c, sizeof(c), 0) != sizeof(c))
+		return EXIT_FAILURE;
+	fclose(out);
+	free(buf);
+	free(zb);
+	core_reader_close(&cr);
+	return EXIT_SUCCESS;
+}
+
+struct analyze_ctx {
+	char **sel;
+	int sel_ct;
+	/* pieces of cores, as for grep */
+	struct grep_job *jobs;
+	uint32_t *job_core;
+	size_t ct;
+	uint32_t cores;
+	/* what each core takes now, on disk */
+	uint64_t *stored;
+};
+
+static int analyze_select(int dump_fd, const char *name, void *ctx_)
+{
+	struct analyze_ctx *a = ctx_;
+	char info[4096];
+	int core_fd = dump_core_open(dump_fd, NULL);
+	ssize_t il = dump_info_read(dump_fd, core_fd, info, sizeof(info));
+	struct stat st;
+	uint64_t blocks = core_fd != -1 && fstat(core_fd, &st) == 0 ? (uint64_t)st.st_blocks * 512 : 0;
+	if (core_fd != -1)
+		close(core_fd);
+	if (il < 0 || !dump_match(a->sel, a->sel_ct, name, info))
+		return 0;
+
+	struct core_reader cr;
+	if (core_reader_open(&cr, dump_fd) < 0)
+		return 0;
+	uint64_t size = cr.size, off;
+	core_reader_close(&cr);
+
+	for (off = 0; off < size; off += ANALYZE_CHUNK) {
+		struct grep_job *n = realloc(a->jobs, (a->ct + 1) * sizeof(*n));
+		if (!n)
+			return -1;
+		a->jobs = n;
+		uint32_t *nc = realloc(a->job_core, (a->ct + 1) * sizeof(*nc));
+		if (!nc)
+			return -1;
+		a->job_core = nc;
+		n[a->ct].name = strdup(name);
+		n[a->ct].start = off;
+		n[a->ct].end = size - off > ANALYZE_CHUNK ? off + ANALYZE_CHUNK : size;
+		nc[a->ct] = a->cores;
+		if (!n[a->ct].name)
+			return -1;
+		a->ct++;
+	}
+	uint64_t *ns = realloc(a->stored, (a->cores + 1) * sizeof(*ns));
+	if (!ns)
+		return -1;
+	a->stored = ns;
+	a->stored[a->cores++] = blocks;
+	return 0;
+}
+
+static int analyze_page_cmp(const void *a_, const void *b_)
+{
+	const struct analyze_page *a = a_, *b = b_;
+	if (a->hash != b->hash)
+		return a->hash < b->hash ? -1 : 1;
+	return a->core < b->core ? -1 : a->core > b->core;
+}
+
+/* Fold in the results of a job */
+static int analyze_merge(int fd, struct analyze_counts *sum, struct analyze_page **pages,
+		size_t *pages_ct)
+{
+	struct analyze_counts c;
+	if (pread(fd, &c, sizeof(c), 0) != sizeof(c) || c.hashes > SIZE_MAX / sizeof(**pages) / 2)
+		return -1;
+	struct analyze_page *n = realloc(*pages, (*pages_ct + c.hashes + 1) * sizeof(*n));
+	if (!n)
+		return -1;
+	*pages = n;
+	size_t want = c.hashes * sizeof(*n);
+	if (pread(fd, n + *pages_ct, want, sizeof(c)) != (ssize_t)want)
+		return -1;
+	*pages_ct += c.hashes;
+
+	sum->bytes += c.bytes;
+	sum->pages += c.pages;
+	sum->zero += c.zero;
+	sum->same += c.same;
+	sum->z_in += c.z_in;
+	size_t i;
+	for (i = 0; i < ARRAY_SIZE(analyze_levels); i++)
+		sum->z_out[i] += c.z_out[i];
+	return 0;
+}
+
+static void analyze_line(const char *what, uint64_t pages, uint64_t total)
+{
+	printf("%-28s %12" PRIu64 " %14" PRIu64 " %6.1f%%\n", what, pages, pages * ANALYZE_PAGE,
+			total ? 100.0 * pages / total : 0.0);
+}
+
+/*
+ * 'sample=<n>' looks at n of the selected dumps (spread out evenly), instead
+ * of all of them.
+ */
+static int act_analyze_storage(const char *dir, int argc, char *argv[])
+{
+	size_t sample = 0;
+	char **sel = argv + 1;
+	int sel_ct = argc - 1;
+	if (sel_ct && !strncmp(sel[0], "sample=", 7)) {
+		sample = parse_unum(sel[0] + 7, "sample");
+		sel++;
+		sel_ct--;
+	}
+	static char all_sel[] = "all", *all[] = { all_sel };
+	if (!sel_ct) {
+		sel = all;
+		sel_ct = 1;
+	}
+
+	int dir_fd = open(dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (dir_fd == -1) {
+		pr_err("could not open storage dir '%s': %s\n", dir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	struct analyze_ctx a = { .sel = sel, .sel_ct = sel_ct };
+	struct analyze_counts sum = { 0 };
+	struct analyze_page *pages = NULL;
+	size_t pages_ct = 0, i;
+	int e = EXIT_FAILURE;
+	if (for_each_dump(dir_fd, analyze_select, &a) < 0) {
+		pr_err("could not list dumps\n");
+		goto out;
+	}
+	uint32_t cores = a.cores;
+	if (sample && sample < cores)
+		cores = sample;
+	uint64_t stored = 0, total = 0;
+	for (i = 0; i < a.cores; i++)
+		if ((uint64_t)i * cores % a.cores < cores)
+			stored += a.stored[i];
+	for (i = 0; i < a.ct; i++)
+		if ((uint64_t)a.job_core[i] * cores % a.cores < cores)
+			total += a.jobs[i].end - a.jobs[i].start;
+	uint64_t hash_rate = total / ANALYZE_PAGE / ANALYZE_MAX_HASHES + 1;
+	uint64_t z_rate = total / ANALYZE_MAX_Z + 1;
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t max_jobs = cpus > 0 ? cpus : 1, running = 0;
+	struct { pid_t pid; int fd; } *run = calloc(max_jobs, sizeof(*run));
+	bool failed = !run;
+	size_t next = 0;
+	while (run && (next < a.ct || running)) {
+		while (next < a.ct && running < max_jobs) {
+			uint32_t core = a.job_core[next];
+			/* every (cores / sample)'th core, renumbered */
+			if (cores < a.cores) {
+				if ((uint64_t)core * cores % a.cores >= cores) {
+					next++;
+					continue;
+				}
+				core = (uint64_t)core * cores / a.cores;
+			}
+
+			size_t j;
+			for (j = 0; run[j].pid; j++)
+				;
+			run[j].fd = memfd_create("analyze", MFD_CLOEXEC);
+			run[j].pid = run[j].fd == -1 ? -1 : fork();
+			if (run[j].pid == 0)
+				_exit(analyze_chunk(dir_fd, a.jobs[next].name, core, a.jobs[next].start,
+						a.jobs[next].end, hash_rate, z_rate, run[j].fd));
+			next++;
+			if (run[j].pid == -1) {
+				pr_err("could not start analyze job: %s\n", strerror(errno));
+				if (run[j].fd != -1)
+					close(run[j].fd);
+				run[j].pid = 0;
+				failed = true;
+				continue;
+			}
+			running++;
+		}
+		if (!running)
+			break;
+
+		int status;
+		pid_t p = wait(&status);
+		if (p == -1)
+			break;
+		size_t j;
+		for (j = 0; j < max_jobs && run[j].pid != p; j++)
+			;
+		if (j == max_jobs)
+			continue;
+		if (!WIFEXITED(status) || WEXITSTATUS(status)
+				|| analyze_merge(run[j].fd, &sum, &pages, &pages_ct) < 0)
+			failed = true;
+		close(run[j].fd);
+		run[j].pid = 0;
+		running--;
+	}
+	free(run);
+	if (failed) {
+		pr_err("could not analyze all dumps\n");
+		goto out;
+	}
+
+	/* copies of a page in the same core, & in other cores */
+	uint64_t dup_in = 0, dup_across = 0;
+	if (pages_ct)
+		qsort(pages, pages_ct, sizeof(*pages), analyze_page_cmp);
+	for (i = 0; i < pages_ct; ) {
+		size_t j = i + 1;
+		for (; j < pages_ct && pages[j].hash == pages[i].hash; j++) {
+			if (pages[j].core == pages[j - 1].core)
+				dup_in++;
+			else
+				dup_across++;
+		}
+		i = j;
+	}
+	dup_in *= hash_rate;
+	dup_across *= hash_rate;
+
+	printf("%u of %u dumps, %" PRIu64 " bytes, stored in %" PRIu64 " on disk now\n\n",
+			cores, a.cores, sum.bytes, stored);
+	printf("%-28s %12s %14s %7s\n", "SAVED BY", "PAGES", "BYTES", "");
+	analyze_line("zero pages", sum.zero, sum.pages);
+	analyze_line("same-filled pages", sum.same, sum.pages);
+	analyze_line("duplicates within a core", dup_in, sum.pages);
+	analyze_line("duplicates across cores", dup_across, sum.pages);
+	uint64_t left = sum.pages - sum.zero - sum.same - dup_in - dup_across;
+	analyze_line("left after all of these", left, sum.pages);
+
+	printf("\n%-28s %14s %7s\n", "DEFLATE", "BYTES", "RATIO");
+	for (i = 0; i < ARRAY_SIZE(analyze_levels) && sum.z_in; i++) {
+		char what[32];
+		double ratio = (double)sum.z_out[i] / sum.z_in;
+		snprintf(what, sizeof(what), "level %d", analyze_levels[i]);
+		printf("%-28s %14.0f %7.3f\n", what, sum.bytes * ratio, ratio);
+	}
+	e = EXIT_SUCCESS;
+
+out:
+	for (i = 0; i < a.ct; i++)
+		free(a.jobs[i].name);
+	free(a.jobs);
+	free(a.job_core);
+	free(a.stored);
+	free(pages);
+	close(dir_fd);
+	return e;
+}
+
+/*
+ * info --segments: how much of the cores of each executable is of each kind
+ * of memory, as far as coredump_filter goes, to see what leaving some out
+ * would save. The core's NT_FILE note gives the file (if any) behind each
+ * segment; what isn't file backed is anonymous private memory.
+ */
+enum seg_kind {
+	SEG_ANON_PRIVATE,
+	SEG_FILE_WRITTEN,
+	SEG_ANON_SHARED,
+	SEG_FILE,
+	SEG_ELF_HEADER,
+	SEG_HUGE,
+	SEG_KINDS,
+};
+
+static const struct {
+	const char *name;
+	/* the coredump_filter bits that include it */
+	const char *bits;
+} seg_kinds[SEG_KINDS] = {
+	[SEG_ANON_PRIVATE] = { "anonymous private", "0" },
+	/* private file mappings that were written to are dumped with anon private */
+	[SEG_FILE_WRITTEN] = { "file private, written", "0" },
+	[SEG_ANON_SHARED] = { "anonymous shared", "1" },
+	[SEG_FILE] = { "file backed", "2,3" },
+	[SEG_ELF_HEADER] = { "ELF headers", "4" },
+	[SEG_HUGE] = { "huge pages", "5,6" },
+};
+
+struct nt_file_ent {
+	uint64_t start, end;
+	/* in bytes */
+	uint64_t off;
+	const char *path;
+};
+
+static int nt_file_ent_cmp(const void *a_, const void *b_)
+{
+	const struct nt_file_ent *a = a_, *b = b_;
+	return a->start < b->start ? -1 : a->start > b->start;
+}
+
+/*
+ * The file mappings listed in the core's NT_FILE note, sorted by address.
+ * The paths point into *notes, which the caller frees.
+ */
+static int core_nt_file(struct core_reader *cr, const struct core_seg *note, bool is64,
+		struct nt_file_ent **ents, size_t *ct, uint8_t **notes)
+{
+	*ents = NULL;
+	*ct = 0;
+	*notes = NULL;
+	if (!note->filesz || note->filesz > 64 * 1024 * 1024)
+		return 0;
+	uint8_t *n = *notes = malloc(note->filesz + 1);
+	if (!n || core_reader_read(cr, n, note->filesz, note->off) != (ssize_t)note->filesz)
+		return -1;
+	n[note->filesz] = '\0';
+
+	size_t w = is64 ? 8 : 4, off = 0;
+	while (off + sizeof(Elf64_Nhdr) <= note->filesz) {
+		Elf64_Nhdr h;
+		memcpy(&h, n + off, sizeof(h));
+		size_t desc = off + sizeof(h) + ((h.n_namesz + 3) & ~3u);
+		off = desc + ((h.n_descsz + 3) & ~3u);
+		if (off > note->filesz || desc + h.n_descsz > note->filesz)
+			break;
+		if (h.n_type != NT_FILE || h.n_descsz < 2 * w)
+			continue;
+
+		/* count, page size, count * (start, end, page offset), count paths */
+		uint64_t v[3], count = 0, page = 0;
+		memcpy(&count, n + desc, w);
+		memcpy(&page, n + desc + w, w);
+		if (count > (h.n_descsz - 2 * w) / (3 * w))
+			break;
+		*ents = calloc(count ? count : 1, sizeof(**ents));
+		if (!*ents)
+			return -1;
+		const char *path = (const char *)n + desc + 2 * w + count * 3 * w;
+		const char *end = (const char *)n + desc + h.n_descsz;
+		uint64_t i;
+		for (i = 0; i < count && path < end; i++) {
+			v[0] = v[1] = v[2] = 0;
+			memcpy(&v[0], n + desc + 2 * w + i * 3 * w, w);
+			memcpy(&v[1], n + desc + 2 * w + i * 3 * w + w, w);
+			memcpy(&v[2], n + desc + 2 * w + i * 3 * w + 2 * w, w);
+			(*ents)[i] = (struct nt_file_ent) { v[0], v[1], v[2] * page, path };
+			path += strnlen(path, end - path) + 1;
+		}
+		*ct = i;
+		qsort(*ents, *ct, sizeof(**ents), nt_file_ent_cmp);
+		return 0;
+	}
+	return 0;
+}
+
+static enum seg_kind seg_classify(const struct core_seg *s, const struct nt_file_ent *ents, size_t ct)
+{
+	/* the mapping the segment starts in */
+	size_t lo = 0, hi = ct;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (ents[mid].start <= s->vaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo || s->vaddr >= ents[lo - 1].end)
+		return SEG_ANON_PRIVATE;
+
+	const struct nt_file_ent *f = &ents[lo - 1];
+	if (strstr(f->path, "/anon_hugepage") || strstr(f->path, "hugepages/"))
+		return SEG_HUGE;
+	if (!strncmp(f->path, "/dev/zero", 9) || !strncmp(f->path, "/SYSV", 5)
+			|| !strncmp(f->path, "/memfd:", 7) || !strncmp(f->path, "/dev/shm/", 9))
+		return SEG_ANON_SHARED;
+	/* just the first page, of a mapping from the start of the file */
+	if (s->filesz && s->filesz <= 4096 && s->filesz < s->memsz && !f->off && f->start == s->vaddr)
+		return SEG_ELF_HEADER;
+	if ((s->flags & PF_W) && s->filesz)
+		return SEG_FILE_WRITTEN;
+	return SEG_FILE;
+}
+
+struct seg_group {
+	char exe[PATH_MAX];
+	unsigned dumps;
+	uint64_t core_bytes;
+	uint64_t maps[SEG_KINDS];
+	uint64_t in_core[SEG_KINDS];
+	uint64_t mapped[SEG_KINDS];
+};
+
+struct seg_ctx {
+	char **sel;
+	int sel_ct;
+	struct seg_group *groups;
+	size_t ct;
+	unsigned failed;
+};
+
+static int segments_one(int dump_fd, const char *name, void *ctx_)
+{
+	struct seg_ctx *sc = ctx_;
+	char info[4096];
+	int core_fd = dump_core_open(dump_fd, NULL);
+	ssize_t il = dump_info_read(dump_fd, core_fd, info, sizeof(info));
+	if (core_fd != -1)
+		close(core_fd);
+	if (il < 0 || !dump_match(sc->sel, sc->sel_ct, name, info))
+		return 0;
+
+	struct core_reader cr;
+	if (core_reader_open(&cr, dump_fd) < 0) {
+		sc->failed++;
+		return 0;
+	}
+
+	struct core_seg *segs = NULL, note;
+	struct nt_file_ent *ents = NULL;
+	uint8_t *notes = NULL;
+	size_t seg_ct, ent_ct, i;
+	unsigned char ident[EI_NIDENT];
+	if (core_reader_read(&cr, ident, sizeof(ident), 0) != sizeof(ident)
+			|| core_segments(&cr, &segs, &seg_ct, &note) < 0
+			|| core_nt_file(&cr, &note, ident[EI_CLASS] == ELFCLASS64, &ents, &ent_ct, &notes) < 0) {
+		pr_err("%s: could not read segments\n", name);
+		sc->failed++;
+		goto out;
+	}
+
+	/* by executable, or comm if the path isn't known */
+	char exe[PATH_MAX];
+	if (!info_get(info, "path", exe, sizeof(exe)) && !info_get(info, "comm", exe, sizeof(exe)))
+		strcpy(exe, "?");
+	struct seg_group *g;
+	for (i = 0; i < sc->ct && strcmp(sc->groups[i].exe, exe); i++)
+		;
+	if (i == sc->ct) {
+		g = realloc(sc->groups, (sc->ct + 1) * sizeof(*g));
+		if (!g)
+			goto out;
+		sc->groups = g;
+		memset(&g[sc->ct], 0, sizeof(*g));
+		strcpy(g[sc->ct].exe, exe);
+		sc->ct++;
+	}
+	g = &sc->groups[i];
+
+	g->dumps++;
+	g->core_bytes += cr.size;
+	for (i = 0; i < seg_ct; i++) {
+		enum seg_kind k = seg_classify(&segs[i], ents, ent_ct);
+		g->maps[k]++;
+		g->in_core[k] += segs[i].filesz;
+		g->mapped[k] += segs[i].memsz;
+	}
+
+out:
+	free(segs);
+	free(ents);
+	free(notes);
+	core_reader_close(&cr);
+	return 0;
+}
+
+static int seg_group_cmp(const void *a_, const void *b_)
+{
+	const struct seg_group *a = a_, *b = b_;
+	if (a->core_bytes != b->core_bytes)
+		return a->core_bytes > b->core_bytes ? -1 : 1;
+	return strcmp(a->exe, b->exe);
+}
+
+/* Per executable, biggest in total first */
+static int info_segments(const char *dir, char **sel, int sel_ct)
+{
+	int dir_fd = open(dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (dir_fd == -1) {
+		pr_err("could not open storage dir '%s': %s\n", dir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	struct seg_ctx sc = { .sel = sel, .sel_ct = sel_ct };
+	int r = for_each_dump(dir_fd, segments_one, &sc);
+	close(dir_fd);
+	if (r < 0) {
+		pr_err("could not list dumps\n");
+		free(sc.groups);
+		return EXIT_FAILURE;
+	}
+
+	if (sc.ct)
+		qsort(sc.groups, sc.ct, sizeof(*sc.groups), seg_group_cmp);
+	size_t i, k;
+	for (i = 0; i < sc.ct; i++) {
+		const struct seg_group *g = &sc.groups[i];
+		uint64_t segs_in_core = 0;
+		printf("%s%s: %u dumps, %" PRIu64 " bytes\n", i ? "\n" : "", g->exe, g->dumps, g->core_bytes);
+		printf("  %-22s %-6s %10s %14s %14s %6s\n", "KIND", "FILTER", "MAPPINGS", "IN CORE", "MAPPED", "CORE%");
+		for (k = 0; k < SEG_KINDS; k++) {
+			segs_in_core += g->in_core[k];
+			if (!g->maps[k])
+				continue;
+			printf("  %-22s %-6s %10" PRIu64 " %14" PRIu64 " %14" PRIu64 " %5.1f%%\n",
+					seg_kinds[k].name, seg_kinds[k].bits, g->maps[k], g->in_core[k],
+					g->mapped[k], 100.0 * g->in_core[k] / g->core_bytes);
+		}
+		uint64_t rest = g->core_bytes > segs_in_core ? g->core_bytes - segs_in_core : 0;
+		printf("  %-22s %-6s %10s %14" PRIu64 " %14s %5.1f%%\n", "headers & notes", "", "",
+				rest, "", 100.0 * rest / g->core_bytes);
+	}
+
+	free(sc.groups);
+	if (sc.failed)
+		pr_err("%u dumps could not be read\n", sc.failed);
+	return sc.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * A dump's metadata, or with '--segments' what the cores of the dumps
+ * selected are made of.
+ */
+static int act_info(const char *dir, int argc, char *argv[])
+{
+	if (argc > 1 && !strcmp(argv[1], "--segments")) {
+		if (argc < 3) {
+			pr_err("info --segments requires a selector ('all', a dump, comm=, sig= or since=)\n");
+			return EXIT_FAILURE;
+		}
+		return info_segments(dir, argv + 2, argc - 2);
+	}
+	if (argc != 2) {
+		pr_err("info requires a dump\n");
+		return EXIT_FAILURE;
+	}
+
+	int dump_fd = dump_open(dir, argv[1]);
+	if (dump_fd == -1)
+		return EXIT_FAILURE;
+	char info[4096];
+	int core_fd = dump_core_open(dump_fd, NULL);
+	ssize_t il = dump_info_read(dump_fd, core_fd, info, sizeof(info));
+	if (core_fd != -1)
+		close(core_fd);
+	close(dump_fd);
+	if (il < 0) {
+		pr_err("could not read metadata of '%s'\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	fputs(info, stdout);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Get backtraces for the selected dumps, running gdb on as many at once as
+ * there are CPUs, and as memory allows. Results are kept with each dump, so
+ * dumps already triaged are only shown again.
+ */
+static int act_triage(const char *dir, int argc, char *argv[])
+{
+	if (argc < 2) {
+		pr_err("triage requires a selector ('all', a dump, comm=, sig= or since=)\n");
+		return EXIT_FAILURE;
+	}
+
+	int dir_fd = open(dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (dir_fd == -1) {
+		pr_err("could not open storage dir '%s': %s\n", dir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	struct triage_ctx t = { .sel = argv + 1, .sel_ct = argc - 1 };
+	if (for_each_dump(dir_fd, triage_select, &t) < 0) {
+		pr_err("could not list dumps\n");
+		return EXIT_FAILURE;
+	}
+	fflush(stdout);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t avail_kb = 0;
+	read_keyed_u64(AT_FDCWD, "/proc/meminfo", "MemAvailable:", &avail_kb);
+	/* leave half of what's free for everyone else */
+	uint64_t budget = avail_kb * 1024 / 2;
+
+	struct { pid_t pid; uint64_t mem; } *jobs = calloc(cpus > 0 ? cpus : 1, sizeof(*jobs));
+	size_t max_jobs = cpus > 0 ? cpus : 1, running = 0, next = 0;
+	uint64_t used = 0;
+	unsigned failed = 0;
+	while (jobs && (next < t.todo_ct || running)) {
+		/* always run at least one, however big */
+		while (next < t.todo_ct && running < max_jobs
+				&& (!running || used + t.todo[next].mem <= budget)) {
+			pid_t p = fork();
+			if (p == 0)
+				_exit(triage_one(dir, dir_fd, t.todo[next].name));
+			if (p == -1) {
+				pr_err("could not start triage job: %s\n", strerror(errno));
+				failed++;
+			} else {
+				size_t j;
+				for (j = 0; jobs[j].pid; j++)
+					;
+				jobs[j].pid = p;
+				jobs[j].mem = t.todo[next].mem;
+				used += jobs[j].mem;
+				running++;
+			}
+			next++;
+		}
+
+		int status;
+		pid_t p = wait(&status);
+		if (p == -1)
+			break;
+		size_t j;
+		for (j = 0; j < max_jobs; j++) {
+			if (jobs[j].pid == p) {
+				used -= jobs[j].mem;
+				jobs[j].pid = 0;
+				running--;
+				if (!WIFEXITED(status) || WEXITSTATUS(status))
+					failed++;
+			}
+		}
+	}
+
+	free(jobs);
+	size_t i;
+	for (i = 0; i < t.todo_ct; i++)
+		free(t.todo[i].name);
+	free(t.todo);
+	close(dir_fd);
+	if (failed)
+		pr_err("%u dumps could not be triaged\n", failed);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Remove '<dir_fd>/<name>' and everything below it. Staged cores are left to
+ * the migrator, which drops those of dumps that are gone.
+ */
+static int rm_tree(int dir_fd, const char *name)
+{
+	int fd = openat(dir_fd, name, O_DIRECTORY|O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	DIR *d = fd == -1 ? NULL : fdopendir(fd);
+	if (!d) {
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (unlinkat(fd, de->d_name, 0) == -1 && (errno == EISDIR || errno == EPERM))
+			rm_tree(fd, de->d_name);
+	}
+	closedir(d);
+	return unlinkat(dir_fd, name, AT_REMOVEDIR);
+}
+
+/*
+ * Retention: once the dumps' stored size is over max-use, remove dumps until
+ * it isn't, duplicates of the most common crashes first. Crashes are told
+ * apart by their triage signature, or by comm & signal until triaged; the
+ * first & the keep-per-signature latest dumps of each are removed only after
+ * all duplicates, oldest first. Everything comes from one pass over the
+ * index, where removed dumps get an 'R' record.
+ */
+struct retain_ent {
+	char *name;
+	uint64_t ts;
+	uint64_t stored;
+	/* what crashed, see above */
+	uint64_t key;
+	/* how many dumps share the key */
+	uint32_t dups;
+	bool keep;
+	bool gone;
+};
+
+struct retain_mark {
+	char *name;
+	/* a signature's key, or 0 for a removal */
+	uint64_t key;
+};
+
+struct retain {
+	struct retain_ent *ents;
+	size_t ct;
+	struct retain_mark *marks;
+	size_t marks_ct;
+};
+
+static int retain_push(void **arr, size_t *ct, size_t sz)
+{
+	/* double whenever a power of 2 (from 64 on) fills up */
+	if (!*ct || (*ct >= 64 && !(*ct & (*ct - 1)))) {
+		void *n = realloc(*arr, (*ct ? *ct * 2 : 64) * sz);
+		if (!n)
+			return -1;
+		*arr = n;
+	}
+	(*ct)++;
+	return 0;
+}
+
+static int retain_line(struct retain *rt, char *line)
+{
+	char *f[10], *save, *t;
+	size_t n = 0;
+	line[strcspn(line, "\n")] = '\0';
+	for (t = strtok_r(line, "\t", &save); t && n < ARRAY_SIZE(f); t = strtok_r(NULL, "\t", &save))
+		f[n++] = t;
+
+	if (n == 10 && !strcmp(f[0], "D")) {
+		if (retain_push((void **)&rt->ents, &rt->ct, sizeof(*rt->ents)) < 0)
+			return -1;
+		struct retain_ent *e = &rt->ents[rt->ct - 1];
+		char key[64];
+		snprintf(key, sizeof(key), "%s\t%s", f[7], f[6]);
+		*e = (struct retain_ent) {
+			.name = strdup(f[1]),
+			.ts = strtoull(f[2], NULL, 10),
+			.stored = strtoull(f[9], NULL, 10),
+			.key = fnv1a(key, strlen(key), FNV1A_INIT + 1),
+		};
+		return e->name ? 0 : -1;
+	}
+
+	if ((n >= 3 && !strcmp(f[0], "S")) || (n == 2 && !strcmp(f[0], "R"))) {
+		if (retain_push((void **)&rt->marks, &rt->marks_ct, sizeof(*rt->marks)) < 0)
+			return -1;
+		struct retain_mark *m = &rt->marks[rt->marks_ct - 1];
+		m->name = strdup(f[1]);
+		m->key = f[0][0] == 'S' ? fnv1a(f[2], strlen(f[2]), FNV1A_INIT) | 1 : 0;
+		return m->name ? 0 : -1;
+	}
+	return 0;
+}
+
+static int retain_ent_name_cmp(const void *a_, const void *b_)
+{
+	const struct retain_ent *a = a_, *b = b_;
+	return strcmp(a->name, b->name);
+}
+
+static int retain_ent_key_cmp(const void *a_, const void *b_)
+{
+	const struct retain_ent *a = *(struct retain_ent *const *)a_, *b = *(struct retain_ent *const *)b_;
+	if (a->key != b->key)
+		return a->key < b->key ? -1 : 1;
+	if (a->ts != b->ts)
+		return a->ts < b->ts ? -1 : 1;
+	return strcmp(a->name, b->name);
+}
+
+/* duplicates before kept dumps, the most duplicated first, then oldest first */
+static int retain_ent_evict_cmp(const void *a_, const void *b_)
+{
+	const struct retain_ent *a = *(struct retain_ent *const *)a_, *b = *(struct retain_ent *const *)b_;
+	if (a->keep != b->keep)
+		return a->keep ? 1 : -1;
+	if (!a->keep && a->dups != b->dups)
+		return a->dups > b->dups ? -1 : 1;
+	if (a->ts != b->ts)
+		return a->ts < b->ts ? -1 : 1;
+	return strcmp(a->name, b->name);
+}
+
+/*
+ * Bring the dumps in 'dir_fd' under 'max_use' bytes. Only one retention runs
+ * at a time: if another one is, there's nothing to do. 'verbose' prints what
+ * was removed.
+ */
+static int retain_run(int dir_fd, uint64_t max_use, bool verbose)
+{
+	int fd = openat(dir_fd, "index", O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return errno == ENOENT ? 0 : -1;
+	if (flock(fd, LOCK_EX|LOCK_NB) == -1) {
+		close(fd);
+		return errno == EWOULDBLOCK ? 0 : -1;
+	}
+	FILE *f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return -1;
+	}
+
+	struct retain rt = { 0 };
+	struct retain_ent **live = NULL;
+	int ret = -1;
+	char line[1024];
+	while (fgets(line, sizeof(line), f))
+		if (retain_line(&rt, line) < 0)
+			goto out;
+
+	/* what's triaged & what's gone, in the order it happened */
+	size_t i;
+	if (rt.ct)
+		qsort(rt.ents, rt.ct, sizeof(*rt.ents), retain_ent_name_cmp);
+	for (i = 0; i < rt.marks_ct; i++) {
+		struct retain_ent k = { .name = rt.marks[i].name };
+		struct retain_ent *e = rt.ct ? bsearch(&k, rt.ents, rt.ct, sizeof(*rt.ents), retain_ent_name_cmp) : NULL;
+		if (!e)
+			continue;
+		if (rt.marks[i].key)
+			e->key = rt.marks[i].key;
+		else
+			e->gone = true;
+	}
+
+	uint64_t used = 0;
+	size_t live_ct = 0;
+	live = malloc((rt.ct ? rt.ct : 1) * sizeof(*live));
+	if (!live)
+		goto out;
+	for (i = 0; i < rt.ct; i++) {
+		if (rt.ents[i].gone)
+			continue;
+		used += rt.ents[i].stored;
+		live[live_ct++] = &rt.ents[i];
+	}
+	ret = 0;
+	if (used <= max_use)
+		goto out;
+
+	qsort(live, live_ct, sizeof(*live), retain_ent_key_cmp);
+	size_t start = 0;
+	for (i = 1; i <= live_ct; i++) {
+		if (i < live_ct && live[i]->key == live[start]->key)
+			continue;
+		size_t j, n = i - start;
+		for (j = start; j < i; j++) {
+			live[j]->dups = n;
+			live[j]->keep = j == start || i - j <= cfg.keep_latest;
+		}
+		start = i;
+	}
+	qsort(live, live_ct, sizeof(*live), retain_ent_evict_cmp);
+
+	int gd = openat(dir_fd, GDB_INDEX_DIR "/root", O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	size_t removed = 0;
+	/* never the last dump left */
+	for (i = 0; used > max_use && i + 1 < live_ct; i++) {
+		struct retain_ent *e = live[i];
+		if (rm_tree(dir_fd, e->name) == -1 && errno != ENOENT) {
+			pr_warn("could not remove dump '%s': %s\n", e->name, strerror(errno));
+			continue;
+		}
+		if (gd != -1)
+			rm_tree(gd, e->name);
+		index_append(dir_fd, "R\t%s\n", e->name);
+		used -= e->stored;
+		removed++;
+		if (verbose)
+			printf("removed %s (%ju bytes, 1 of %u like it)\n", e->name, (uintmax_t)e->stored, e->dups);
+	}
+	if (gd != -1)
+		close(gd);
+	if (used > max_use)
+		pr_warn("dumps still use %ju bytes after removing %zu\n", (uintmax_t)used, removed);
+
+out:
+	for (i = 0; i < rt.ct; i++)
+		free(rt.ents[i].name);
+	for (i = 0; i < rt.marks_ct; i++)
+		free(rt.marks[i].name);
+	free(rt.ents);
+	free(rt.marks);
+	free(live);
+	fclose(f);
+	return ret;
+}
+
+static int act_vacuum(const char *dir, int argc, char *argv[])
+{
+	uint64_t max_use = cfg.max_use;
+	if (argc > 2 || (argc == 2 && parse_size(argv[1], &max_use) < 0)) {
+		pr_err("vacuum takes an optional size to bring the dumps under\n");
+		return EXIT_FAILURE;
+	}
+	if (argc < 2 && !max_use) {
+		pr_err("vacuum needs a size, given or as max-use in the config\n");
+		return EXIT_FAILURE;
+	}
+
+	int dir_fd = open(dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (dir_fd == -1) {
+		pr_err("could not open storage dir '%s': %s\n", dir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	int r = retain_run(dir_fd, max_use, true);
+	close(dir_fd);
+	if (r < 0) {
+		pr_err("could not read the index: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Run synthetic cores through the store path in each mode, to see what
+ * compressing & encrypting cost in throughput over a plain store.
+ */
+static int act_bench(int argc, char *argv[])
+{
+	size_t mib = argc > 1 ? parse_unum(argv[1], "MiB") : 256;
+	size_t len = mib * 1024 * 1024;
+	__attribute__((cleanup(freep)))
+	uint8_t *buf = malloc(len);
+	if (!buf) {
+		pr_err("could not allocate %zu MiB\n", mib);
+		return EXIT_FAILURE;
+	}
+
+	/* roughly what cores look like: lots of zero pages, some text-ish
+	 * data that compresses well, some that doesn't compress at all */
+	size_t i;
+	for (i = 0; i < len; i += 4096) {
+		uint8_t *pg = buf + i;
+		size_t j, n = len - i < 4096 ? len - i : 4096;
+		switch ((i / 4096) % 4) {
+		case 0:
+		case 1:
+			memset(pg, 0, n);
+			break;
+		case 2:
+			for (j = 0; j < n; j++)
+				pg[j] = "dumpctl bench 0123456789 "[(i + j * 7) % 25];
+			break;
+		case 3:
+			if (getrandom(pg, n, 0) != (ssize_t)n)
+				memset(pg, 0xa5, n);
+			break;
+		}
+	}
+
+	/* a throwaway key, if none is configured */
+	char key_path[64] = "";
+	if (!cfg.encrypt_key) {
+		uint8_t key[32];
+		int kfd = memfd_create("key", 0);
+		if (kfd != -1 && fchmod(kfd, 0600) == 0
+				&& getrandom(key, sizeof(key), 0) == sizeof(key)
+				&& write(kfd, key, sizeof(key)) == sizeof(key))
+			snprintf(key_path, sizeof(key_path), "/proc/self/fd/%d", kfd);
+	}
+
+	static const struct {
+		const char *name;
+		enum compress_mode compress;
+		int level;
+		bool encrypt;
+		bool redact;
+	} modes[] = {
+		{ "plain", COMPRESS_NONE, 0, false, false },
+		{ "redact", COMPRESS_NONE, 0, false, true },
+		{ "encrypt", COMPRESS_NONE, 0, true, false },
+		{ "gzip-1", COMPRESS_FIXED, 1, false, false },
+		{ "gzip-1+encrypt", COMPRESS_FIXED, 1, true, false },
+		{ "gzip-auto", COMPRESS_AUTO, 1, false, false },
+		{ "gzip-auto+encrypt", COMPRESS_AUTO, 1, true, false },
+	};
+
+	/* the built in patterns, if none are configured */
+	if (!cfg.redact_ct && cfg_redact("builtin") < 0)
+		return EXIT_FAILURE;
+	size_t redact_ct = cfg.redact_ct;
+
+	const char *key = cfg.encrypt_key ? cfg.encrypt_key : key_path;
+	int null_fd = open("/dev/null", O_WRONLY|O_CLOEXEC);
+	printf("%-20s %10s %8s\n", "MODE", "MiB/s", "RATIO");
+	for (i = 0; i < ARRAY_SIZE(modes); i++) {
+		cfg.compress = modes[i].compress;
+		cfg.compress_level = modes[i].level;
+		cfg.encrypt_key = modes[i].encrypt ? key : NULL;
+		cfg.redact_ct = modes[i].redact ? redact_ct : 0;
+		if (modes[i].encrypt && !key[0])
+			continue;
+
+		FILE *in = fmemopen(buf, len, "r");
+		struct store_out o;
+		if (!in || store_out_init(&o) < 0) {
+			if (in)
+				fclose(in);
+			return EXIT_FAILURE;
+		}
+		o.fd = null_fd;
+
+		uint64_t t0 = now_ns();
+		ssize_t r = copy_file_to_fd(&o, in, CFG_CORE_LIMIT);
+		uint64_t t = now_ns() - t0;
+		fclose(in);
+		if (r < 0) {
+			store_out_destroy(&o);
+			return EXIT_FAILURE;
+		}
+
+		printf("%-20s %10.1f %8.3f\n", modes[i].name,
+				(double)len / (1024 * 1024) / ((double)t / 1e9),
+				(double)o.stored_bytes / len);
+		store_out_destroy(&o);
+	}
+
+	close(null_fd);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * What the build-id store holds, kept sorted in memory so serve can answer
+ * without touching the disk for misses. Executables are 'xx/yyyy...' and
+ * separate debug files (which may be dropped in by hand) 'xx/yyyy....debug'.
+ */
+struct bid_ent {
+	char id[BUILD_ID_MAX * 2 + 1];
+	bool exe;
+	bool debug;
+};
+
+struct bid_table {
+	struct bid_ent *ents;
+	size_t ct;
+	uint64_t loaded_ns;
+};
+
+static int bid_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct bid_ent *)a)->id, ((const struct bid_ent *)b)->id);
+}
+
+static int bid_table_load(struct bid_table *t, int bd)
+{
+	struct bid_ent *ents = NULL;
+	size_t ct = 0, alloc = 0;
+
+	int fd = dup(bd);
+	DIR *d = fd == -1 ? NULL : fdopendir(fd);
+	if (!d) {
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	rewinddir(d);
+
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		if (strlen(de->d_name) != 2 || !isxdigit((unsigned char)de->d_name[0]))
+			continue;
+		int sfd = openat(bd, de->d_name, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+		DIR *sd = sfd == -1 ? NULL : fdopendir(sfd);
+		if (!sd) {
+			if (sfd != -1)
+				close(sfd);
+			continue;
+		}
+
+		struct dirent *fe;
+		while ((fe = readdir(sd))) {
+			/* including copies still in progress */
+			if (fe->d_name[0] == '.')
+				continue;
+			size_t nl = strlen(fe->d_name);
+			bool debug = nl > 6 && !strcmp(fe->d_name + nl - 6, ".debug");
+			if (debug)
+				nl -= 6;
+			if (nl + 2 >= sizeof(ents->id))
+				continue;
+
+			if (ct == alloc) {
+				alloc = alloc ? alloc * 2 : 256;
+				struct bid_ent *n = realloc(ents, alloc * sizeof(*n));
+				if (!n)
+					break;
+				ents = n;
+			}
+			struct bid_ent *e = &ents[ct++];
+			memcpy(e->id, de->d_name, 2);
+			memcpy(e->id + 2, fe->d_name, nl);
+			e->id[nl + 2] = '\0';
+			e->exe = !debug;
+			e->debug = debug;
+		}
+		closedir(sd);
+	}
+	closedir(d);
+
+	/* an executable & its debug file become one entry */
+	qsort(ents, ct, sizeof(*ents), bid_cmp);
+	size_t i, o = 0;
+	for (i = 0; i < ct; i++) {
+		if (o && !strcmp(ents[o - 1].id, ents[i].id)) {
+			ents[o - 1].exe |= ents[i].exe;
+			ents[o - 1].debug |= ents[i].debug;
+		} else {
+			ents[o++] = ents[i];
+		}
+	}
+
+	free(t->ents);
+	t->ents = ents;
+	t->ct = o;
+	t->loaded_ns = now_ns();
+	return 0;
+}
+
+static struct bid_ent *bid_table_find(struct bid_table *t, int bd, const char *id)
+{
+	struct bid_ent key;
+	snprintf(key.id, sizeof(key.id), "%s", id);
+	struct bid_ent *e = bsearch(&key, t->ents, t->ct, sizeof(*t->ents), bid_cmp);
+
+	/* new crashes add to the store, look again (but not for every miss) */
+	if (!e && now_ns() - t->loaded_ns > 1000000000 && bid_table_load(t, bd) == 0)
+		e = bsearch(&key, t->ents, t->ct, sizeof(*t->ents), bid_cmp);
+	return e;
+}
+
+/* Does the ELF file in 'fd' carry its own DWARF? */
+static bool elf_has_debuginfo(int fd)
+{
+	Elf64_Ehdr eh;
+	if (pread(fd, &eh, sizeof(eh), 0) != sizeof(eh) || memcmp(eh.e_ident, ELFMAG, SELFMAG))
+		return false;
+
+	/* only ELF64 here: its header is laid out differently */
+	if (eh.e_ident[EI_CLASS] != ELFCLASS64 || eh.e_shentsize < sizeof(Elf64_Shdr)
+			|| eh.e_shstrndx >= eh.e_shnum)
+		return false;
+
+	Elf64_Shdr strs;
+	if (pread(fd, &strs, sizeof(strs), eh.e_shoff + (uint64_t)eh.e_shstrndx * eh.e_shentsize) != sizeof(strs))
+		return false;
+
+	size_t i;
+	for (i = 0; i < eh.e_shnum; i++) {
+		Elf64_Shdr sh;
+		char name[16];
+		if (pread(fd, &sh, sizeof(sh), eh.e_shoff + i * eh.e_shentsize) != sizeof(sh))
+			return false;
+		if (sh.sh_type == SHT_NOBITS)
+			continue;
+		ssize_t nl = pread(fd, name, sizeof(name), strs.sh_offset + sh.sh_name);
+		if (nl > 11 && !memcmp(name, ".debug_info", 12))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * A 'Range: bytes=...' header, for a single range (as debuginfod clients
+ * send). Returns false if the range can't be satisfied.
+ */
+static bool http_range(const char *v, uint64_t size, uint64_t *start, uint64_t *len)
+{
+	if (strncmp(v, "bytes=", 6))
+		return false;
+	v += 6;
+
+	char *end;
+	uint64_t a, b = size - 1;
+	if (*v == '-') {
+		uint64_t n = strtoull(v + 1, &end, 10);
+		if (end == v + 1 || n == 0)
+			return false;
+		a = n > size ? 0 : size - n;
+	} else {
+		a = strtoull(v, &end, 10);
+		if (end == v || *end != '-')
+			return false;
+		v = end + 1;
+		if (isdigit((unsigned char)*v)) {
+			b = strtoull(v, &end, 10);
+			if (b >= size)
+				b = size - 1;
+		}
+	}
+
+	if (a >= size || b < a)
+		return false;
+	*start = a;
+	*len = b - a + 1;
+	return true;
+}
+
+#define CFG_SERVE_CONNS 256
+/* connections decoding a framed core each hold a few frames of buffers */
+#define SERVE_DECODERS 16
+#define SERVE_IDLE_NS (30ULL * 1000000000)
+/* in the storage dir, where the dumps are served */
+#define SERVE_SOCK "serve.sock"
+#define SERVE_CHUNK (64 * 1024)
+
+/*
+ * A client of serve: a request being read, then a response being written. The
+ * response is headers (and any small body) in 'out', followed by 'left' bytes
+ * from either a file (by sendfile()) or a core being decoded.
+ */
+struct conn {
+	int fd;
+	size_t slot;
+	uint64_t active_ns;
+	/* came in on SERVE_SOCK, from root or us: may see the dumps */
+	bool local;
+
+	char req[8192];
+	size_t req_len;
+	bool head;
+
+	bool responding;
+	char *out;
+	size_t out_len, out_off;
+
+	uint64_t left;
+	int file_fd;
+	off_t file_off;
+	struct core_reader *cr;
+	uint8_t *buf;
+	size_t buf_len, buf_off;
+};
+
+struct serve {
+	const char *dir;
+	int dir_fd;
+	/* -1 until something has been kept in the build-id store */
+	int bd;
+	struct bid_table bids;
+	int ep;
+	struct conn *conns[CFG_SERVE_CONNS];
+	unsigned decoders;
+};
+
+static void conn_close(struct serve *s, struct conn *c)
+{
+	epoll_ctl(s->ep, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	if (c->file_fd != -1)
+		close(c->file_fd);
+	if (c->cr) {
+		core_reader_close(c->cr);
+		free(c->cr);
+		s->decoders--;
+	}
+	free(c->buf);
+	free(c->out);
+	s->conns[c->slot] = NULL;
+	free(c);
+}
+
+/* A complete response with a (small) body */
+static void conn_reply(struct conn *c, const char *status, const char *type,
+		const char *body, size_t len)
+{
+	FILE *m = open_memstream(&c->out, &c->out_len);
+	if (!m)
+		return;
+	fprintf(m, "HTTP/1.1 %s\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n"
+			"\r\n", status, type, len);
+	if (!c->head)
+		fwrite(body, 1, len, m);
+	fclose(m);
+}
+
+static void conn_error(struct conn *c, const char *status)
+{
+	conn_reply(c, status, "text/plain", status, strlen(status));
+}
+
+/*
+ * Headers for sending (the requested range of) a 'size' byte body. Returns
+ * false if it's not to be sent, having replied already.
+ */
+static bool conn_body(struct conn *c, uint64_t size, const char *extra)
+{
+	uint64_t off = 0, len = size;
+	const char *status = "200 OK";
+	char *range = strcasestr(c->req, "\r\nRange:");
+	if (range) {
+		range += 8;
+		while (*range == ' ')
+			range++;
+		range[strcspn(range, "\r")] = '\0';
+		if (!http_range(range, size, &off, &len)) {
+			FILE *m = open_memstream(&c->out, &c->out_len);
+			if (m) {
+				fprintf(m, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+						"Content-Range: bytes */%ju\r\n"
+						"Content-Length: 0\r\n"
+						"Connection: close\r\n"
+						"\r\n", (uintmax_t)size);
+				fclose(m);
+			}
+			return false;
+		}
+		status = "206 Partial Content";
+	}
+
+	FILE *m = open_memstream(&c->out, &c->out_len);
+	if (!m)
+		return false;
+	fprintf(m, "HTTP/1.1 %s\r\n"
+			"Content-Type: application/octet-stream\r\n"
+			"Content-Length: %ju\r\n"
+			"Accept-Ranges: bytes\r\n"
+			"%s",
+			status, (uintmax_t)len, extra);
+	if (range)
+		fprintf(m, "Content-Range: bytes %ju-%ju/%ju\r\n",
+				(uintmax_t)off, (uintmax_t)(off + len - 1), (uintmax_t)size);
+	fprintf(m, "Connection: close\r\n\r\n");
+	fclose(m);
+
+	if (c->head)
+		return false;
+	c->file_off = off;
+	c->left = len;
+	return true;
+}
+
+/* Send (part of) the file in 'fd', which the conn now owns */
+static void conn_file(struct conn *c, int fd, const char *extra)
+{
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		conn_error(c, "500 Internal Server Error");
+		return;
+	}
+	if (conn_body(c, st.st_size, extra))
+		c->file_fd = fd;
+	else
+		close(fd);
+}
+
+/* '/buildid/<hex>/executable' & '/debuginfo', what debuginfod clients ask for */
+static void serve_buildid(struct serve *s, struct conn *c, const char *target)
+{
+	char id[BUILD_ID_MAX * 2 + 1], kind[16];
+	int kl = 0;
+	if (s->bd == -1) {
+		char bp[PATH_MAX];
+		snprintf(bp, sizeof(bp), "%s/" BUILD_ID_DIR, s->dir);
+		s->bd = open(bp, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	}
+	if (s->bd == -1 || sscanf(target, "/buildid/%128[0-9a-f]/%15[a-z]%n", id, kind, &kl) != 2
+			|| target[kl] || strlen(id) < 3) {
+		conn_error(c, "404 Not Found");
+		return;
+	}
+
+	struct bid_ent *e = bid_table_find(&s->bids, s->bd, id);
+	bool debug = !strcmp(kind, "debuginfo");
+	if (!e || (!debug && strcmp(kind, "executable"))) {
+		conn_error(c, "404 Not Found");
+		return;
+	}
+
+	char name[sizeof(id) + 8];
+	snprintf(name, sizeof(name), "%.2s/%s%s", id, id + 2, debug && e->debug ? ".debug" : "");
+	int fd = openat(s->bd, name, O_RDONLY|O_CLOEXEC);
+	if (fd == -1 || (debug && !e->debug && !elf_has_debuginfo(fd)) || (!debug && !e->exe)) {
+		if (fd != -1)
+			close(fd);
+		conn_error(c, "404 Not Found");
+		return;
+	}
+
+	/* kept as they were: what only some could read is for the unix socket */
+	struct stat st;
+	if (!c->local && (fstat(fd, &st) == -1 || !(st.st_mode & S_IROTH))) {
+		close(fd);
+		conn_error(c, "403 Forbidden");
+		return;
+	}
+
+	char extra[sizeof(name) + 64];
+	snprintf(extra, sizeof(extra), "X-DEBUGINFOD-FILE: %s\r\n", name);
+	conn_file(c, fd, extra);
+}
+
+static void html_escape(FILE *m, const char *t)
+{
+	for (; *t; t++) {
+		switch (*t) {
+		case '<': fputs("&lt;", m); break;
+		case '>': fputs("&gt;", m); break;
+		case '&': fputs("&amp;", m); break;
+		case '"': fputs("&quot;", m); break;
+		default: fputc(*t, m);
+		}
+	}
+}
+
+/* The dumps in the index, newest first */
+static void serve_list(struct serve *s, struct conn *c)
+{
+	char *body = NULL;
+	size_t body_len = 0;
+	FILE *m = open_memstream(&body, &body_len);
+	if (!m) {
+		conn_error(c, "500 Internal Server Error");
+		return;
+	}
+
+	fprintf(m, "<!DOCTYPE html>\n<html><head><title>dumpctl</title></head><body>\n"
+			"<table>\n<tr><th>dump</th><th>time</th><th>pid</th><th>uid</th>"
+			"<th>signal</th><th>comm</th><th>size</th><th>stored</th><th></th></tr>\n");
+
+	int fd = openat(s->dir_fd, "index", O_RDONLY|O_CLOEXEC);
+	struct stat st;
+	char *ix = MAP_FAILED;
+	if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0)
+		ix = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (fd != -1)
+		close(fd);
+
+	if (ix != MAP_FAILED) {
+		char *end = ix + st.st_size;
+		while (end > ix) {
+			char *l = end - 1;
+			while (l > ix && l[-1] != '\n')
+				l--;
+			size_t ll = end - l;
+			end = l;
+
+			char rec[1024];
+			if (ll >= sizeof(rec) || l[0] != 'D' || l[1] != '\t')
+				continue;
+			memcpy(rec, l, ll);
+			rec[ll] = '\0';
+			rec[strcspn(rec, "\n")] = '\0';
+
+			char *f[10], *save;
+			size_t n = 0;
+			char *t;
+			for (t = strtok_r(rec, "\t", &save); t && n < ARRAY_SIZE(f); t = strtok_r(NULL, "\t", &save))
+				f[n++] = t;
+			/* removed by retention */
+			if (n < 10 || faccessat(s->dir_fd, f[1], F_OK, 0) == -1)
+				continue;
+
+			fprintf(m, "<tr><td><a href=\"/dumps/");
+			html_escape(m, f[1]);
+			fprintf(m, "/core\">");
+			html_escape(m, f[1]);
+			fprintf(m, "</a></td><td>%s</td><td>%s</td><td>%s</td><td>%s</td><td>",
+					f[2], f[3], f[4], f[6]);
+			html_escape(m, f[7]);
+			fprintf(m, "</td><td>%s</td><td>%s</td><td><a href=\"/dumps/", f[8], f[9]);
+			html_escape(m, f[1]);
+			fprintf(m, "/info\">info</a></td></tr>\n");
+		}
+		munmap(ix, st.st_size);
+	}
+
+	fprintf(m, "</table>\n</body></html>\n");
+	fclose(m);
+	conn_reply(c, "200 OK", "text/html; charset=utf-8", body, body_len);
+	free(body);
+}
+
+/*
+ * '/dumps/<name>/info' (the metadata, however it's stored), '/dumps/<name>/core'
+ * (decoded when stored compressed or encrypted, a frame at a time, so ranges
+ * are cheap) or one of the text files triage & store leave next to it.
+ */
+static void serve_dump(struct serve *s, struct conn *c, const char *target)
+{
+	char name[NAME_MAX + 1], file[NAME_MAX + 1];
+	int nl = 0;
+	if (sscanf(target, "/dumps/%255[^/]/%255[^/?]%n", name, file, &nl) != 2
+			|| target[nl] || name[0] == '.' || file[0] == '.') {
+		conn_error(c, "404 Not Found");
+		return;
+	}
+
+	int dump_fd = openat(s->dir_fd, name, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (dump_fd == -1) {
+		conn_error(c, "404 Not Found");
+		return;
+	}
+
+	const char *core_name;
+	if (!strcmp(file, "info")) {
+		char info[4096];
+		int core_fd = dump_core_open(dump_fd, NULL);
+		ssize_t il = dump_info_read(dump_fd, core_fd, info, sizeof(info));
+		if (core_fd != -1)
+			close(core_fd);
+		if (il < 0)
+			conn_error(c, "404 Not Found");
+		else
+			conn_reply(c, "200 OK", "text/plain; charset=utf-8", info, il);
+	} else if (!strcmp(file, "core")) {
+		int core_fd = dump_core_open(dump_fd, &core_name);
+		if (core_fd != -1 && !strcmp(core_name, "core")) {
+			conn_file(c, core_fd, "");
+		} else if (s->decoders >= SERVE_DECODERS) {
+			if (core_fd != -1)
+				close(core_fd);
+			conn_error(c, "503 Service Unavailable");
+		} else {
+			if (core_fd != -1)
+				close(core_fd);
+			c->cr = malloc(sizeof(*c->cr));
+			c->buf = malloc(SERVE_CHUNK);
+			if (!c->cr || !c->buf || core_reader_open(c->cr, dump_fd) < 0) {
+				free(c->cr);
+				c->cr = NULL;
+				conn_error(c, "404 Not Found");
+			} else {
+				s->decoders++;
+				conn_body(c, c->cr->size, "");
+			}
+		}
+	} else {
+		static const char *const files[] = { "info.txt", "build-ids", "backtrace.txt" };
+		size_t i;
+		for (i = 0; i < ARRAY_SIZE(files); i++)
+			if (!strcmp(file, files[i]))
+				break;
+		int fd = i < ARRAY_SIZE(files) ? openat(dump_fd, file, O_RDONLY|O_CLOEXEC) : -1;
+		if (fd == -1)
+			conn_error(c, "404 Not Found");
+		else
+			conn_file(c, fd, "");
+	}
+
+	close(dump_fd);
+}
+
+static void serve_request(struct serve *s, struct conn *c)
+{
+	char method[8], target[512];
+	if (sscanf(c->req, "%7s %511s HTTP/1.%*c", method, target) != 2) {
+		conn_error(c, "400 Bad Request");
+		return;
+	}
+	c->head = !strcmp(method, "HEAD");
+	if (!c->head && strcmp(method, "GET")) {
+		conn_error(c, "405 Method Not Allowed");
+		return;
+	}
+
+	if (!strncmp(target, "/buildid/", 9))
+		serve_buildid(s, c, target);
+	else if ((!strcmp(target, "/") || !strncmp(target, "/dumps/", 7)) && !c->local)
+		conn_error(c, "403 Forbidden");
+	else if (!strcmp(target, "/"))
+		serve_list(s, c);
+	else if (!strncmp(target, "/dumps/", 7))
+		serve_dump(s, c, target);
+	else
+		conn_error(c, "404 Not Found");
+}
+
+/* Returns 1 when the response is done, 0 when the socket is full, -1 on error */
+static int conn_write(struct conn *c)
+{
+	while (c->out_off < c->out_len) {
+		ssize_t r = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+		if (r < 0)
+			return errno == EAGAIN ? 0 : -1;
+		c->out_off += r;
+	}
+
+	while (c->left) {
+		ssize_t r;
+		if (c->file_fd != -1) {
+			r = sendfile(c->fd, c->file_fd, &c->file_off,
+					c->left < CFG_FRAME_SIZE ? c->left : CFG_FRAME_SIZE);
+			if (r <= 0)
+				return r < 0 && errno == EAGAIN ? 0 : -1;
+			c->left -= r;
+			continue;
+		}
+
+		if (c->buf_off == c->buf_len) {
+			r = core_reader_pread(c->cr, c->buf,
+					c->left < SERVE_CHUNK ? c->left : SERVE_CHUNK, c->file_off);
+			if (r <= 0)
+				return -1;
+			c->buf_len = r;
+			c->buf_off = 0;
+			c->file_off += r;
+		}
+		r = write(c->fd, c->buf + c->buf_off, c->buf_len - c->buf_off);
+		if (r < 0)
+			return errno == EAGAIN ? 0 : -1;
+		c->buf_off += r;
+		c->left -= r;
+	}
+
+	return 1;
+}
+
+static void serve_accept(struct serve *s, int ls, bool local)
+{
+	for (;;) {
+		int fd = accept4(ls, NULL, NULL, SOCK_CLOEXEC|SOCK_NONBLOCK);
+		if (fd == -1)
+			return;
+
+		/* the socket is 0600 already, this is in case it's been chmod'ed */
+		struct ucred cred;
+		socklen_t cl = sizeof(cred);
+		if (local && (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cl) == -1
+				|| (cred.uid != 0 && cred.uid != geteuid()))) {
+			close(fd);
+			continue;
+		}
+
+		size_t i;
+		for (i = 0; i < ARRAY_SIZE(s->conns); i++)
+			if (!s->conns[i])
+				break;
+		struct conn *c = i < ARRAY_SIZE(s->conns) ? calloc(1, sizeof(*c)) : NULL;
+		if (!c) {
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->slot = i;
+		c->local = local;
+		c->file_fd = -1;
+		c->active_ns = now_ns();
+
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+		if (epoll_ctl(s->ep, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			close(fd);
+			free(c);
+			continue;
+		}
+		s->conns[i] = c;
+	}
+}
+
+static void serve_event(struct serve *s, struct conn *c)
+{
+	c->active_ns = now_ns();
+	if (!c->responding) {
+		ssize_t r = read(c->fd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len);
+		if (r <= 0) {
+			if (r == 0 || errno != EAGAIN)
+				conn_close(s, c);
+			return;
+		}
+		c->req_len += r;
+		c->req[c->req_len] = '\0';
+		if (!strstr(c->req, "\r\n\r\n")) {
+			if (c->req_len == sizeof(c->req) - 1)
+				conn_close(s, c);
+			return;
+		}
+
+		serve_request(s, c);
+		c->responding = true;
+		struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+		epoll_ctl(s->ep, EPOLL_CTL_MOD, c->fd, &ev);
+	}
+
+	if (conn_write(c))
+		conn_close(s, c);
+}
+
+/*
+ * serve: a debuginfod server for the build-id store on localhost, and a
+ * browser for the dumps on a unix socket in the storage dir that only root
+ * (and whoever runs serve) can use, as cores are decoded with the root-only
+ * key. All clients are handled by one epoll loop. Point gdb at it with
+ * DEBUGINFOD_URLS=http://localhost:8002.
+ */
+static int act_serve(const char *dir, int argc, char *argv[])
+{
+	uintmax_t port = argc > 1 ? parse_unum(argv[1], "port") : CFG_SERVE_PORT;
+	if (argc > 2 || port == 0 || port > 65535) {
+		pr_err("serve takes an optional port\n");
+		return EXIT_FAILURE;
+	}
+
+	struct serve s = { .dir = dir, .bd = -1 };
+	s.dir_fd = open(dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (s.dir_fd == -1) {
+		pr_err("could not open storage dir '%s': %s\n", dir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	char bp[PATH_MAX];
+	snprintf(bp, sizeof(bp), "%s/" BUILD_ID_DIR, dir);
+	s.bd = open(bp, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (s.bd != -1)
+		bid_table_load(&s.bids, s.bd);
+
+	int one = 1;
+	struct sockaddr_in sa = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	int ls = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+	if (ls == -1 || setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1
+			|| bind(ls, (struct sockaddr *)&sa, sizeof(sa)) == -1 || listen(ls, 128) == -1) {
+		pr_err("could not listen on port %ju: %s\n", port, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	struct sockaddr_un su = { .sun_family = AF_UNIX };
+	if (snprintf(su.sun_path, sizeof(su.sun_path), "%s/" SERVE_SOCK, dir)
+			>= (int)sizeof(su.sun_path)) {
+		pr_err("storage dir path too long for %s\n", SERVE_SOCK);
+		return EXIT_FAILURE;
+	}
+	unlinkat(s.dir_fd, SERVE_SOCK, 0);
+	mode_t um = umask(0177);
+	int us = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+	if (us == -1 || bind(us, (struct sockaddr *)&su, sizeof(su)) == -1 || listen(us, 128) == -1) {
+		pr_err("could not listen on %s: %s\n", su.sun_path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	umask(um);
+
+	s.ep = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event lev = { .events = EPOLLIN, .data.ptr = &ls };
+	struct epoll_event uev = { .events = EPOLLIN, .data.ptr = &us };
+	if (s.ep == -1 || epoll_ctl(s.ep, EPOLL_CTL_ADD, ls, &lev) == -1
+			|| epoll_ctl(s.ep, EPOLL_CTL_ADD, us, &uev) == -1) {
+		pr_err("could not set up epoll: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* a client going away mid-response is not our problem */
+	signal(SIGPIPE, SIG_IGN);
+	pr_info("serving %zu build-ids on http://localhost:%ju & the dumps in '%s' on %s\n",
+			s.bids.ct, port, dir, su.sun_path);
+
+	for (;;) {
+		struct epoll_event evs[64];
+		int n = epoll_wait(s.ep, evs, ARRAY_SIZE(evs), 1000);
+		if (n == -1 && errno != EINTR) {
+			pr_err("epoll_wait failed: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+
+		int i;
+		for (i = 0; i < n; i++) {
+			if (evs[i].data.ptr == &ls)
+				serve_accept(&s, ls, false);
+			else if (evs[i].data.ptr == &us)
+				serve_accept(&s, us, true);
+			else
+				serve_event(&s, evs[i].data.ptr);
+		}
+
+		/* drop clients that have stopped talking (or reading) */
+		uint64_t now = now_ns();
+		size_t j;
+		for (j = 0; j < ARRAY_SIZE(s.conns); j++)
+			if (s.conns[j] && now - s.conns[j]->active_ns > SERVE_IDLE_NS)
+				conn_close(&s, s.conns[j]);
+	}
+}
+
+/*
+ * The name of a dump's directory (or ring entry):
+ * 'YYYY-MM-DD_HH:MM:SS.pid=PID.uid=UID'
+ */
+static int dump_name(char *buf, size_t len, const struct dump_meta *m)
+{
+	struct tm tm;
+	/* FIXME: check overflow */
+	time_t ts_time = m->ts;
+	gmtime_r(&ts_time, &tm);
+
+	size_t b = strftime(buf, len, "%F_%H:%M:%S", &tm);
+	if (b == 0) {
+		pr_err("strftime failed\n");
+		return -1;
+	}
+
+	int r = snprintf(buf + b, len - b, ".pid=%ju.uid=%ju", m->pid, m->uid);
+	if (r < 0) {
+		pr_err("could not format storage path\n");
+		return -1;
+	}
+
+	if ((size_t)r > (len - b - 1)) {
+		pr_err("formatted storage path too long (needed %u bytes)\n", r);
+		return -1;
+	}
+	return 0;
+}
+
+/* Store the core on stdin as the dump described by 'm' */
+static int store_dump(char *dir, struct dump_meta *m)
+{
+	int e = EXIT_FAILURE;
+	bool triage = false;
+	struct isolate iso;
+	isolate_self(&iso);
+
+	/* create our storage area if it does not exist */
+	/* for each component in path, mkdir() */
+	char *p = dir + 1;
+	for (;;) {
+		p = strchr(p, '/');
+		if (p)
+			*p = '\0';
+
+		int r = mkdir(dir, 0777);
+		if (r == -1) {
+			if (errno != EEXIST) {
+				pr_err("could not create path '%s', mkdir failed: %s\n",
+						dir, strerror(errno));
+				goto e_opendir;
+			}
+		}
+
+		if (!p)
+			break;
+		*p = '/';
+		p = p + 1;
+	}
+
+	DIR *d = opendir(dir);
+	if (!d) {
+		pr_err("failed to open storage dir '%s', opendir failed: %s\n",
+				dir, strerror(errno));
+		goto e_opendir;
+	}
+
+	/* the process is still around while we read its core, but not after */
+	struct build_ids bids = { 0 };
+	if (cfg.keep_binaries) {
+		build_ids_capture(&bids, m->pid);
+		m->bids = &bids;
+	}
+
+	char path_buf[PATH_MAX];
+	if (dump_name(path_buf, sizeof(path_buf), m) < 0)
+		goto e_storefd;
+
+	struct sink sinks[SINK_MAX];
+	size_t sinks_ct;
+	if (cfg.backend == BACKEND_RING) {
+		sinks_ct = sinks_open(sinks, path_buf, m);
+		e = store_ring(dirfd(d), path_buf, m, &iso, sinks, sinks_ct);
+		goto e_storefd;
+	}
+
+	/* XXX: consider making this a temp dir before we fill in the data */
+	int r = mkdirat(dirfd(d), path_buf, 0755);
+	/* the same second, pid & uid: vmcores (which have neither) stored together, say */
+	size_t pl = strlen(path_buf);
+	unsigned dup;
+	for (dup = 2; r < 0 && errno == EEXIST && dup < 1000; dup++) {
+		snprintf(path_buf + pl, sizeof(path_buf) - pl, ".%u", dup);
+		r = mkdirat(dirfd(d), path_buf, 0755);
+	}
+	if (r < 0) {
+		pr_err("failed to create dump directory: %s\n", strerror(errno));
+		goto e_storefd;
+	}
+
+	int store_fd = openat(dirfd(d), path_buf, O_DIRECTORY, 0755);
+	if (store_fd == -1) {
+		pr_err("could not open storage dir '%s', %s\n", path_buf, strerror(errno));
+		goto e_storefd;
+	}
+	sinks_ct = sinks_open(sinks, path_buf, m);
+
+	/* store some data! */
+	struct store_out o;
+	if (store_out_init(&o) < 0) {
+		sinks_close(sinks, sinks_ct);
+		/* the dump is still recorded, to say it has no core */
+		int info_fd = openat(store_fd, "info.txt", O_CREAT|O_WRONLY|O_CLOEXEC, 0644);
+		if (info_fd != -1) {
+			store_info(info_fd, m, NULL, &iso);
+			close(info_fd);
+		} else {
+			pr_err("could not open info.txt file: %s\n", strerror(errno));
+		}
+		store_index(dirfd(d), path_buf, m, 0, 0);
+		goto e_infofd;
+	}
+	store_out_sinks(&o, sinks, sinks_ct);
+	const char *core_name = store_out_name(&o);
+
+	/* put the core on the staging dir if we can, with a symlink to it
+	 * where it'll end up once migrated */
+	uint64_t room;
+	int core_fd = -1;
+	int stage_fd = staging_open(path_buf, &room);
+	if (stage_fd != -1) {
+		char target[PATH_MAX];
+		flock(stage_fd, LOCK_EX);
+		int tl = snprintf(target, sizeof(target), "%s/%s/%s", cfg.staging_dir, path_buf, core_name);
+		if (tl > 0 && (size_t)tl < sizeof(target))
+			core_fd = openat(stage_fd, core_name, O_CREAT|O_RDWR, 0644);
+		if (core_fd != -1 && symlinkat(target, store_fd, core_name) == -1) {
+			pr_warn("could not link to staged core: %s\n", strerror(errno));
+			close(core_fd);
+			unlinkat(stage_fd, core_name, 0);
+			core_fd = -1;
+		}
+
+		if (core_fd == -1) {
+			close(stage_fd);
+			stage_fd = -1;
+		} else {
+			o.limit = room;
+			o.stage_fd = stage_fd;
+			o.spill_fd = store_fd;
+			o.name = core_name;
+		}
+	}
+
+	if (core_fd == -1)
+		core_fd = openat(store_fd, core_name, O_CREAT|O_WRONLY, 0644);
+	if (core_fd == -1) {
+		pr_err("could not open core file: %s\n", strerror(errno));
+		goto e_corefd;
+	}
+	o.fd = core_fd;
+	bw_open(&o.bw, dirfd(d), m->uid, m->comm);
+
+	/* let the kernel get a whole frame ahead of us while we compress/write */
+	(void) fcntl(STDIN_FILENO, F_SETPIPE_SZ, CFG_FRAME_SIZE);
+
+	ssize_t cr = copy_file_to_fd(&o, stdin, m->limit ? m->limit : CFG_CORE_LIMIT);
+	if (cr >= 0)
+		cr = store_out_finish(&o, store_fd);
+	if (cr >= 0)
+		store_out_sinks_end(&o);
+	if (cr < 0) {
+		/* error printing already handled, just avoid storage */
+		unlinkat(store_fd, core_name, 0);
+		unlinkat(store_fd, "frames", 0);
+		if (stage_fd != -1)
+			unlinkat(stage_fd, core_name, 0);
+	}
+
+	if (m->bids) {
+		build_ids_save(m->bids, dirfd(d));
+		build_ids_list(m->bids, store_fd);
+	}
+
+	/* metadata goes on the core itself if we can, before the migrator
+	 * gets a chance to copy it */
+	int meta = -1;
+	if (cr >= 0 && cfg.metadata == METADATA_XATTR)
+		meta = store_xattrs(o.fd, m, &o, &iso);
+
+	close(o.fd);
+	if (stage_fd != -1) {
+		/* done writing, the migrator may have it (and cleans up after a spill) */
+		close(stage_fd);
+		migrate_spawn(dir);
+	}
+
+	int info_fd = -1;
+	if (meta < 0) {
+		info_fd = openat(store_fd, "info.txt", O_CREAT|O_WRONLY, 0644);
+		if (info_fd == -1) {
+			pr_err("could not open info.txt file: %s\n", strerror(errno));
+			goto e_infofd;
+		}
+		store_info(info_fd, m, cr >= 0 ? &o : NULL, &iso);
+	}
+
+	store_index(dirfd(d), path_buf, m,
+			cr >= 0 ? o.raw_bytes : 0, cr >= 0 ? o.stored_bytes : 0);
+	if (cfg.max_use && retain_run(dirfd(d), cfg.max_use, false) < 0)
+		pr_warn("could not run retention: %s\n", strerror(errno));
+
+	e = EXIT_SUCCESS;
+	triage = cfg.auto_triage;
+
+	if (info_fd != -1)
+		close(info_fd);
+e_infofd:
+	store_out_destroy(&o);
+e_corefd:
+	close(store_fd);
+e_storefd:
+	build_ids_destroy(&bids);
+	closedir(d);
+e_opendir:
+	isolate_destroy(&iso);
+	/* with everything of ours closed, so it holds on to none of it */
+	if (triage)
+		triage_spawn(dir, path_buf);
+	return e;
+}
+
+/*
+ * snapshot: a core of a live process, much like gcore makes, stored as if it
+ * had crashed (signal 0). Its threads are stopped with ptrace only while
+ * their registers are read; memory is read afterwards, with the process
+ * running again, by process_vm_readv() from a process per CPU a window at a
+ * time, into a pipe that store_dump() reads as it would a core from the
+ * kernel. What to include follows the process's coredump_filter, as the
+ * kernel does.
+ */
+#define SNAP_WINDOW (64ULL * 1024 * 1024)
+#define SNAP_THREADS_MAX 4096
+
+struct snap_map {
+	uint64_t start, end;
+	/* in bytes */
+	uint64_t off;
+	/* how much of it goes in the core, from the start */
+	uint64_t dump;
+	uint32_t flags;
+	char *path;
+};
+
+struct snap_thread {
+	pid_t tid;
+	prstatus_t st;
+	elf_fpregset_t fp;
+	bool fp_ok;
+};
+
+struct snap {
+	pid_t pid;
+	struct snap_map *maps;
+	size_t maps_ct;
+	struct snap_thread *threads;
+	size_t threads_ct;
+	/* there were more than SNAP_THREADS_MAX */
+	bool threads_cut;
+	prpsinfo_t ps;
+	uint8_t auxv[4096];
+	size_t auxv_len;
+	uint16_t machine;
+};
+
+static void snap_destroy(struct snap *s)
+{
+	size_t i;
+	for (i = 0; i < s->maps_ct; i++)
+		free(s->maps[i].path);
+	free(s->maps);
+	free(s->threads);
+}
+
+/*
+ * Stop every thread, read all their registers, then let them all go, so the
+ * registers are from one moment and the process is stopped only that long.
+ * Threads may be started while we stop the others, so the process's tasks
+ * are gone through again until there are no new ones, as gcore does.
+ */
+static int snap_threads(struct snap *s)
+{
+	char p[64];
+	snprintf(p, sizeof(p), "/proc/%d/task", s->pid);
+	s->threads = calloc(SNAP_THREADS_MAX, sizeof(*s->threads));
+	if (!s->threads)
+		return -1;
+
+	size_t seized = 0, found, i;
+	do {
+		DIR *d = opendir(p);
+		if (!d)
+			break;
+		struct dirent *de;
+		found = 0;
+		while ((de = readdir(d))) {
+			if (de->d_name[0] == '.')
+				continue;
+			pid_t tid = atoi(de->d_name);
+			for (i = 0; i < seized && s->threads[i].tid != tid; i++)
+				;
+			if (i < seized)
+				continue;
+			if (seized == SNAP_THREADS_MAX) {
+				s->threads_cut = true;
+				break;
+			}
+			if (ptrace(PTRACE_SEIZE, tid, NULL, NULL) == -1)
+				continue;
+			if (ptrace(PTRACE_INTERRUPT, tid, NULL, NULL) == -1) {
+				ptrace(PTRACE_DETACH, tid, NULL, NULL);
+				continue;
+			}
+			s->threads[seized++].tid = tid;
+			found++;
+		}
+		closedir(d);
+	} while (found && !s->threads_cut);
+	if (s->threads_cut)
+		pr_warn("%d has more than %d threads, the rest are left out\n", s->pid, SNAP_THREADS_MAX);
+
+	for (i = 0; i < seized; i++) {
+		struct snap_thread *t = &s->threads[i];
+		int status;
+		if (waitpid(t->tid, &status, __WALL) == -1)
+			continue;
+		struct iovec iov = { &t->st.pr_reg, sizeof(t->st.pr_reg) };
+		if (ptrace(PTRACE_GETREGSET, t->tid, (void *)NT_PRSTATUS, &iov) == -1)
+			continue;
+		iov = (struct iovec) { &t->fp, sizeof(t->fp) };
+		t->fp_ok = ptrace(PTRACE_GETREGSET, t->tid, (void *)NT_PRFPREG, &iov) == 0;
+		/* got its registers */
+		t->st.pr_pid = t->tid;
+	}
+	for (i = 0; i < seized; i++)
+		ptrace(PTRACE_DETACH, s->threads[i].tid, NULL, NULL);
+
+	for (i = 0; i < seized; i++) {
+		struct snap_thread *t = &s->threads[s->threads_ct];
+		if (!s->threads[i].st.pr_pid)
+			continue;
+		*t = s->threads[i];
+		t->st.pr_ppid = s->ps.pr_ppid;
+		t->st.pr_pgrp = s->ps.pr_pgrp;
+		t->st.pr_sid = s->ps.pr_sid;
+		t->st.pr_fpvalid = t->fp_ok;
+		/* the main thread first, as gdb takes the first one to be current */
+		if (t->tid == s->pid && s->threads_ct) {
+			struct snap_thread tmp = s->threads[0];
+			s->threads[0] = *t;
+			*t = tmp;
+		}
+		s->threads_ct++;
+	}
+	return s->threads_ct ? 0 : -1;
+}
+
+/*
+ * How much of a mapping the kernel would dump, going by coredump_filter:
+ * bit 0 anonymous private, 1 anonymous shared, 2 file private, 3 file shared,
+ * 4 ELF headers, 5 & 6 huge pages.
+ */
+static uint64_t snap_dump_size(const struct snap *s, const struct snap_map *m,
+		const char *perms, unsigned filter)
+{
+	uint64_t len = m->end - m->start;
+	bool shared = perms[3] == 's';
+	if (perms[0] != 'r')
+		return 0;
+	if (!m->path || m->path[0] == '[') {
+		/* not [vvar] & co, which can't be read */
+		if (m->path && strcmp(m->path, "[heap]") && strcmp(m->path, "[stack]")
+				&& strcmp(m->path, "[vdso]") && strncmp(m->path, "[anon:", 6))
+			return 0;
+		return filter & (shared ? 2 : 1) ? len : 0;
+	}
+	if (strstr(m->path, "/anon_hugepage") || strstr(m->path, "hugepages/"))
+		return filter & (shared ? 0x40 : 0x20) ? len : 0;
+	if (!strncmp(m->path, "/dev/zero", 9) || !strncmp(m->path, "/SYSV", 5)
+			|| !strncmp(m->path, "/memfd:", 7) || !strncmp(m->path, "/dev/shm/", 9))
+		return filter & (shared ? 2 : 1) ? len : 0;
+	/* private & written to: there's anonymous memory in it */
+	if (!shared && perms[1] == 'w' && (filter & 1))
+		return len;
+	if (filter & (shared ? 8 : 4))
+		return len;
+
+	/* the first page of ELF files, so gdb can find their build-ids */
+	uint8_t magic[SELFMAG];
+	struct iovec local = { magic, sizeof(magic) }, remote = { (void *)(uintptr_t)m->start, sizeof(magic) };
+	if ((filter & 0x10) && !m->off
+			&& process_vm_readv(s->pid, &local, 1, &remote, 1, 0) == sizeof(magic)
+			&& !memcmp(magic, ELFMAG, SELFMAG))
+		return len < 4096 ? len : 4096;
+	return 0;
+}
+
+static int snap_maps(struct snap *s)
+{
+	char p[64];
+	uint64_t filter = 0x33;
+	snprintf(p, sizeof(p), "/proc/%d/coredump_filter", s->pid);
+	__attribute__((cleanup(fclosep)))
+	FILE *f = fopen(p, "r");
+	if (f && fscanf(f, "%" SCNx64, &filter) != 1)
+		filter = 0x33;
+
+	snprintf(p, sizeof(p), "/proc/%d/maps", s->pid);
+	__attribute__((cleanup(fclosep)))
+	FILE *maps = fopen(p, "r");
+	if (!maps)
+		return -1;
+
+	char line[PATH_MAX + 128];
+	size_t alloc = 0;
+	while (fgets(line, sizeof(line), maps)) {
+		uint64_t start, end, off;
+		char perms[8];
+		int path_at = 0;
+		if (sscanf(line, "%" SCNx64 "-%" SCNx64 " %7s %" SCNx64 " %*x:%*x %*u %n",
+				&start, &end, perms, &off, &path_at) != 4 || strlen(perms) < 4)
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+
+		if (s->maps_ct == alloc) {
+			alloc = alloc ? alloc * 2 : 256;
+			struct snap_map *n = realloc(s->maps, alloc * sizeof(*n));
+			if (!n)
+				return -1;
+			s->maps = n;
+		}
+		struct snap_map *m = &s->maps[s->maps_ct];
+		*m = (struct snap_map) { .start = start, .end = end, .off = off };
+		m->flags = (perms[0] == 'r' ? PF_R : 0) | (perms[1] == 'w' ? PF_W : 0) | (perms[2] == 'x' ? PF_X : 0);
+		if (path_at && line[path_at] && !(m->path = strdup(line + path_at)))
+			return -1;
+		/* never dumped, not even as an empty segment */
+		if (m->path && !strcmp(m->path, "[vsyscall]")) {
+			free(m->path);
+			continue;
+		}
+		m->dump = snap_dump_size(s, m, perms, filter);
+		s->maps_ct++;
+	}
+	return s->maps_ct ? 0 : -1;
+}
+
+static int snap_info(struct snap *s)
+{
+	char p[64], buf[4096];
+	snprintf(p, sizeof(p), "/proc/%d/stat", s->pid);
+	int fd = open(p, O_RDONLY|O_CLOEXEC);
+	ssize_t l = fd == -1 ? -1 : read(fd, buf, sizeof(buf) - 1);
+	if (fd != -1)
+		close(fd);
+	if (l <= 0)
+		return -1;
+	buf[l] = '\0';
+
+	/* pid (comm) state ppid pgrp sid ... */
+	prpsinfo_t *ps = &s->ps;
+	char *c = strrchr(buf, ')');
+	int ppid, pgrp, sid;
+	if (!c || sscanf(c + 2, "%c %d %d %d", &ps->pr_sname, &ppid, &pgrp, &sid) != 4)
+		return -1;
+	ps->pr_ppid = ppid;
+	ps->pr_pgrp = pgrp;
+	ps->pr_sid = sid;
+	ps->pr_pid = s->pid;
+	ps->pr_state = ps->pr_sname == 'R' ? 0 : ps->pr_sname == 'S' ? 1 : 2;
+	char *open_paren = strchr(buf, '(');
+	if (open_paren)
+		snprintf(ps->pr_fname, sizeof(ps->pr_fname), "%.*s", (int)(c - open_paren - 1), open_paren + 1);
+
+	struct stat st;
+	snprintf(p, sizeof(p), "/proc/%d", s->pid);
+	if (stat(p, &st) == 0) {
+		ps->pr_uid = st.st_uid;
+		ps->pr_gid = st.st_gid;
+	}
+
+	snprintf(p, sizeof(p), "/proc/%d/cmdline", s->pid);
+	fd = open(p, O_RDONLY|O_CLOEXEC);
+	l = fd == -1 ? -1 : read(fd, ps->pr_psargs, sizeof(ps->pr_psargs) - 1);
+	if (fd != -1)
+		close(fd);
+	for (; l > 0; l--)
+		if (!ps->pr_psargs[l - 1])
+			ps->pr_psargs[l - 1] = ' ';
+
+	snprintf(p, sizeof(p), "/proc/%d/auxv", s->pid);
+	fd = open(p, O_RDONLY|O_CLOEXEC);
+	l = fd == -1 ? -1 : read(fd, s->auxv, sizeof(s->auxv));
+	if (fd != -1)
+		close(fd);
+	s->auxv_len = l > 0 ? l : 0;
+
+	/* we can only write cores for our own kind of process */
+	uint8_t eh[sizeof(Elf64_Ehdr)], self[sizeof(Elf64_Ehdr)];
+	snprintf(p, sizeof(p), "/proc/%d/exe", s->pid);
+	fd = open(p, O_RDONLY|O_CLOEXEC);
+	l = fd == -1 ? -1 : pread(fd, eh, sizeof(eh), 0);
+	if (fd != -1)
+		close(fd);
+	fd = open("/proc/self/exe", O_RDONLY|O_CLOEXEC);
+	ssize_t sl = fd == -1 ? -1 : pread(fd, self, sizeof(self), 0);
+	if (fd != -1)
+		close(fd);
+	if (l != sizeof(eh) || sl != sizeof(self) || eh[EI_CLASS] != ELFCLASS64
+			|| self[EI_CLASS] != ELFCLASS64
+			|| memcmp(eh + offsetof(Elf64_Ehdr, e_machine), self + offsetof(Elf64_Ehdr, e_machine), 2)) {
+		pr_err("can only snapshot 64-bit processes of this machine\n");
+		return -1;
+	}
+	memcpy(&s->machine, self + offsetof(Elf64_Ehdr, e_machine), 2);
+	return 0;
+}
+
+static void snap_note(FILE *f, uint32_t type, const void *desc, size_t len)
+{
+	static const char name[8] = "CORE";
+	Elf64_Nhdr n = { .n_namesz = 5, .n_descsz = len, .n_type = type };
+	static const uint8_t pad[4];
+	fwrite(&n, sizeof(n), 1, f);
+	fwrite(name, 8, 1, f);
+	fwrite(desc, len, 1, f);
+	fwrite(pad, (4 - len % 4) % 4, 1, f);
+}
+
+/* All the notes, in the order the kernel writes them */
+static int snap_notes(const struct snap *s, char **buf, size_t *len)
+{
+	FILE *f = open_memstream(buf, len);
+	if (!f)
+		return -1;
+
+	size_t i;
+	for (i = 0; i < s->threads_ct; i++) {
+		const struct snap_thread *t = &s->threads[i];
+		snap_note(f, NT_PRSTATUS, &t->st, sizeof(t->st));
+		if (i == 0) {
+			snap_note(f, NT_PRPSINFO, &s->ps, sizeof(s->ps));
+			if (s->auxv_len)
+				snap_note(f, NT_AUXV, s->auxv, s->auxv_len);
+
+			/* count, page size, (start, end, page offset)..., paths */
+			char *fb;
+			size_t fl, ct = 0, j;
+			FILE *nf = open_memstream(&fb, &fl);
+			if (!nf)
+				break;
+			for (j = 0; j < s->maps_ct; j++)
+				ct += s->maps[j].path && s->maps[j].path[0] == '/';
+			uint64_t hdr[2] = { ct, 4096 };
+			fwrite(hdr, sizeof(hdr), 1, nf);
+			for (j = 0; j < s->maps_ct; j++) {
+				const struct snap_map *m = &s->maps[j];
+				uint64_t e[3] = { m->start, m->end, m->off / 4096 };
+				if (m->path && m->path[0] == '/')
+					fwrite(e, sizeof(e), 1, nf);
+			}
+			for (j = 0; j < s->maps_ct; j++)
+				if (s->maps[j].path && s->maps[j].path[0] == '/')
+					fwrite(s->maps[j].path, strlen(s->maps[j].path) + 1, 1, nf);
+			fclose(nf);
+			snap_note(f, NT_FILE, fb, fl);
+			free(fb);
+		}
+		if (t->fp_ok)
+			snap_note(f, NT_FPREGSET, &t->fp, sizeof(t->fp));
+	}
+	return fclose(f) ? -1 : 0;
+}
+
+/* Read [vaddr, vaddr + len) into buf, leaving zeros where it can't be read */
+static void snap_read(pid_t pid, uint8_t *buf, uint64_t vaddr, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		struct iovec local = { buf + done, len - done }, remote = { (void *)(uintptr_t)(vaddr + done), len - done };
+		ssize_t r = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+		if (r > 0) {
+			done += r;
+			continue;
+		}
+		/* skip the page we couldn't read */
+		size_t skip = 4096 - (vaddr + done) % 4096;
+		if (skip > len - done)
+			skip = len - done;
+		memset(buf + done, 0, skip);
+		done += skip;
+	}
+}
+
+/*
+ * Write the core to out_fd: headers, notes, then the memory of each mapping,
+ * a window at a time, with each window's share read by a process per CPU.
+ * Runs in a child of snapshot.
+ */
+static int snap_write(const struct snap *s, int out_fd)
+{
+	char *notes = NULL;
+	size_t notes_len, i;
+	if (snap_notes(s, &notes, &notes_len) < 0)
+		return EXIT_FAILURE;
+
+	size_t phnum = s->maps_ct + 1;
+	bool xnum = phnum >= PN_XNUM;
+	uint64_t off = sizeof(Elf64_Ehdr) + (xnum ? sizeof(Elf64_Shdr) : 0) + phnum * sizeof(Elf64_Phdr);
+	Elf64_Ehdr eh = {
+		.e_type = ET_CORE,
+		.e_machine = s->machine,
+		.e_version = EV_CURRENT,
+		.e_phoff = sizeof(Elf64_Ehdr) + (xnum ? sizeof(Elf64_Shdr) : 0),
+		.e_shoff = xnum ? sizeof(Elf64_Ehdr) : 0,
+		.e_ehsize = sizeof(Elf64_Ehdr),
+		.e_phentsize = sizeof(Elf64_Phdr),
+		.e_phnum = xnum ? PN_XNUM : phnum,
+		.e_shentsize = xnum ? sizeof(Elf64_Shdr) : 0,
+		.e_shnum = xnum ? 1 : 0,
+	};
+	memcpy(eh.e_ident, ELFMAG, SELFMAG);
+	eh.e_ident[EI_CLASS] = ELFCLASS64;
+	eh.e_ident[EI_DATA] = ELFDATA2LSB;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	eh.e_ident[EI_DATA] = ELFDATA2MSB;
+#endif
+	eh.e_ident[EI_VERSION] = EV_CURRENT;
+
+	FILE *f = fdopen(dup(out_fd), "w");
+	if (!f)
+		return EXIT_FAILURE;
+	fwrite(&eh, sizeof(eh), 1, f);
+	if (xnum) {
+		Elf64_Shdr sh = { .sh_info = phnum };
+		fwrite(&sh, sizeof(sh), 1, f);
+	}
+	Elf64_Phdr ph = { .p_type = PT_NOTE, .p_offset = off, .p_filesz = notes_len };
+	fwrite(&ph, sizeof(ph), 1, f);
+	off = (off + notes_len + 4095) & ~4095ULL;
+	for (i = 0; i < s->maps_ct; i++) {
+		const struct snap_map *m = &s->maps[i];
+		ph = (Elf64_Phdr) {
+			.p_type = PT_LOAD, .p_flags = m->flags, .p_offset = off, .p_vaddr = m->start,
+			.p_filesz = m->dump, .p_memsz = m->end - m->start, .p_align = 4096,
+		};
+		fwrite(&ph, sizeof(ph), 1, f);
+		off += m->dump;
+	}
+	fwrite(notes, notes_len, 1, f);
+	free(notes);
+	long pos = ftell(f);
+	for (; pos > 0 && pos % 4096; pos++)
+		fputc(0, f);
+	if (fclose(f))
+		return EXIT_FAILURE;
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t workers = cpus > 0 ? cpus : 1;
+	uint8_t *win = mmap(NULL, SNAP_WINDOW, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (win == MAP_FAILED)
+		return EXIT_FAILURE;
+
+	/* windows over the mappings' dumped memory, laid end to end */
+	size_t mi = 0;
+	uint64_t m_done = 0;
+	for (;;) {
+		size_t first = mi;
+		uint64_t first_done = m_done, len = 0;
+		while (mi < s->maps_ct && len < SNAP_WINDOW) {
+			uint64_t take = s->maps[mi].dump - m_done;
+			if (take > SNAP_WINDOW - len)
+				take = SNAP_WINDOW - len;
+			len += take;
+			m_done += take;
+			if (m_done == s->maps[mi].dump) {
+				mi++;
+				m_done = 0;
+			}
+		}
+		if (!len)
+			break;
+
+		/* worker w reads window bytes [len * w / n, len * (w + 1) / n) */
+		size_t n = len >= 4 * 1024 * 1024 ? workers : 1, w;
+		for (w = 0; w < n; w++) {
+			pid_t p = n > 1 ? fork() : 0;
+			if (p > 0)
+				continue;
+			if (p == -1)
+				return EXIT_FAILURE;
+			uint64_t lo = len * w / n, hi = len * (w + 1) / n, at = 0;
+			size_t j = first;
+			uint64_t jd = first_done;
+			while (at < hi) {
+				uint64_t take = s->maps[j].dump - jd;
+				if (take > hi - at)
+					take = hi - at;
+				if (at + take > lo) {
+					uint64_t skip = lo > at ? lo - at : 0;
+					snap_read(s->pid, win + at + skip, s->maps[j].start + jd + skip, take - skip);
+				}
+				at += take;
+				jd += take;
+				if (jd == s->maps[j].dump) {
+					j++;
+					jd = 0;
+				}
+			}
+			if (n > 1)
+				_exit(EXIT_SUCCESS);
+		}
+		for (w = 0; n > 1 && w < n; w++) {
+			int status;
+			if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+				return EXIT_FAILURE;
+		}
+
+		if (write_all(out_fd, win, len) < 0)
+			return EXIT_FAILURE;
+	}
+	munmap(win, SNAP_WINDOW);
+	return EXIT_SUCCESS;
+}
+
+/* Snapshot 'pid' into 'dir' (absolute), as a member of 'group' if set */
+static int snapshot_store(char *dir, pid_t pid, const char *group)
+{
+	struct snap s = { .pid = pid };
+	int e = EXIT_FAILURE;
+	if (snap_info(&s) < 0) {
+		pr_err("could not read process %d: %s\n", s.pid, strerror(errno));
+		goto out;
+	}
+	if (snap_threads(&s) < 0) {
+		pr_err("could not stop any thread of %d: %s\n", s.pid, strerror(errno));
+		goto out;
+	}
+	if (snap_maps(&s) < 0) {
+		pr_err("could not read the mappings of %d\n", s.pid);
+		goto out;
+	}
+
+	/* what store gets from the kernel's core_pattern, %E mangling included */
+	char exe[PATH_MAX], comm[32], p[64];
+	snprintf(comm, sizeof(comm), "%s", s.ps.pr_fname);
+	snprintf(p, sizeof(p), "/proc/%d/exe", s.pid);
+	ssize_t el = readlink(p, exe, sizeof(exe) - 1);
+	exe[el > 0 ? el : 0] = '\0';
+	char *c;
+	for (c = exe; *c; c++)
+		if (*c == '/')
+			*c = '!';
+
+	struct dump_meta m = {
+		.pid = s.pid,
+		.uid = s.ps.pr_uid,
+		.gid = s.ps.pr_gid,
+		.ts = time(NULL),
+		.comm = comm,
+		.path = exe,
+		.group = group,
+		.truncated = s.threads_cut ? "threads" : NULL,
+	};
+	pr_info("snapshot of '%s' (pid = %ju, uid = %ju, path = %s)\n",
+			m.comm, m.pid, m.uid, m.path);
+
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) == -1)
+		goto out;
+	pid_t w = fork();
+	if (w == 0) {
+		close(fds[0]);
+		_exit(snap_write(&s, fds[1]));
+	}
+	close(fds[1]);
+	if (w == -1 || dup2(fds[0], STDIN_FILENO) == -1) {
+		close(fds[0]);
+		goto out;
+	}
+	close(fds[0]);
+
+	e = store_dump(dir, &m);
+
+	int status;
+	if (waitpid(w, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		pr_err("could not read all of %d's memory, the snapshot is incomplete\n", s.pid);
+		e = EXIT_FAILURE;
+	}
+out:
+	snap_destroy(&s);
+	return e;
+}
+
+static int act_snapshot(const char *dir, int argc, char *argv[])
+{
+	if (argc != 2) {
+		pr_err("snapshot requires a pid\n");
+		return EXIT_FAILURE;
+	}
+
+	/* store needs an absolute path */
+	char abs_dir[PATH_MAX], cwd[PATH_MAX];
+	if (dir[0] == '/')
+		snprintf(abs_dir, sizeof(abs_dir), "%s", dir);
+	else if (!getcwd(cwd, sizeof(cwd))
+			|| snprintf(abs_dir, sizeof(abs_dir), "%s/%s", cwd, dir) >= (int)sizeof(abs_dir))
+		return EXIT_FAILURE;
+
+	return snapshot_store(abs_dir, parse_unum(argv[1], "pid"), NULL);
+}
+
+/*
+ * Group capture: when a process matching a 'group-capture' rule crashes, the
+ * other processes of its process group or cgroup (the rest of a service: its
+ * master & other workers) are snapshotted while its core is stored, by a
+ * pool of at most GROUP_JOBS processes. Each member's info.txt has 'group:
+ * <name of the crash's dump>' (as does the crash's own), and the index gets
+ * 'G' records for the group, written once the snapshots are done: the pids of
+ * those that were stored, as many records as it takes, with up to
+ * GROUP_MEMBERS_LEN of pids each, to stay within what index_append() takes.
+ */
+#define GROUP_JOBS 4
+#define GROUP_MEMBERS_LEN 512
+
+static const struct group_rule *group_rule_find(const struct dump_meta *m)
+{
+	size_t i;
+	for (i = 0; i < cfg.group_rules_ct; i++) {
+		const struct group_rule *r = &cfg.group_rules[i];
+		if (!r->comm[0] || !strcmp(r->comm, m->comm))
+			return r;
+	}
+	return NULL;
+}
+
+/* What groups 'pid' with others: its process group or its (v2) cgroup */
+static bool group_key(pid_t pid, enum group_by by, char *buf, size_t len)
+{
+	char p[64], b[PATH_MAX + 16];
+	snprintf(p, sizeof(p), by == GROUP_PGRP ? "/proc/%d/stat" : "/proc/%d/cgroup", pid);
+	int fd = open(p, O_RDONLY|O_CLOEXEC);
+	ssize_t l = fd == -1 ? -1 : read(fd, b, sizeof(b) - 1);
+	if (fd != -1)
+		close(fd);
+	if (l <= 0)
+		return false;
+	b[l] = '\0';
+
+	if (by == GROUP_PGRP) {
+		/* pid (comm) state ppid pgrp */
+		char *c = strrchr(b, ')');
+		int pgrp;
+		if (!c || sscanf(c + 2, "%*c %*d %d", &pgrp) != 1)
+			return false;
+		snprintf(buf, len, "pgrp=%d", pgrp);
+		return true;
+	}
+
+	char *c = strstr(b, "0::");
+	if (!c || (c != b && c[-1] != '\n'))
+		return false;
+	c += 3;
+	c[strcspn(c, "\n")] = '\0';
+	snprintf(buf, len, "cgroup=%s", c);
+	return true;
+}
+
+/* A snapshot being taken, and of which member */
+struct group_job {
+	pid_t child, pid;
+};
+
+/* Wait for one snapshot, keeping its member if it got stored */
+static void group_reap(struct group_job *run, unsigned *running, pid_t *members, size_t *ct)
+{
+	int status;
+	pid_t c = wait(&status);
+	unsigned i;
+	for (i = 0; c > 0 && i < *running; i++) {
+		if (run[i].child != c)
+			continue;
+		if (WIFEXITED(status) && !WEXITSTATUS(status))
+			members[(*ct)++] = run[i].pid;
+		run[i] = run[--*running];
+		return;
+	}
+	if (c == -1 && errno != EINTR)
+		*running = 0;
+}
+
+static pid_t group_capture_start(char *dir, const struct dump_meta *m,
+		const char *group)
+{
+	const struct group_rule *r = group_rule_find(m);
+	char key[PATH_MAX + 16];
+	if (!r || !group_key(m->pid, r->by, key, sizeof(key)))
+		return -1;
+	/* not the whole system */
+	if (!strcmp(key, "pgrp=0") || !strcmp(key, "pgrp=1") || !strcmp(key, "cgroup=/")) {
+		pr_warn("not capturing %s: it is everything\n", key);
+		return -1;
+	}
+
+	pid_t p = fork();
+	if (p == -1)
+		pr_warn("could not start group capture: %s\n", strerror(errno));
+	if (p)
+		return p;
+
+	/* the crashing process's core is the parent's to read */
+	int null_fd = open("/dev/null", O_RDONLY);
+	if (null_fd != -1)
+		dup2(null_fd, STDIN_FILENO);
+
+	DIR *d = opendir("/proc");
+	if (!d)
+		_exit(EXIT_FAILURE);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned jobs = cpus > 0 && cpus < GROUP_JOBS ? cpus : GROUP_JOBS, running = 0;
+	pid_t members[GROUP_MAX];
+	struct group_job run[GROUP_JOBS];
+	size_t ct = 0, started = 0, i;
+	struct dirent *de;
+	while ((de = readdir(d)) && started < cfg.group_max) {
+		char *end, k[sizeof(key)], exe[64], link[8];
+		pid_t pid = strtol(de->d_name, &end, 10);
+		if (*end || pid <= 0 || (uintmax_t)pid == m->pid || pid == getpid() || pid == getppid())
+			continue;
+		/* kernel threads have no executable */
+		snprintf(exe, sizeof(exe), "/proc/%d/exe", pid);
+		if (readlink(exe, link, sizeof(link)) <= 0
+				|| !group_key(pid, r->by, k, sizeof(k)) || strcmp(k, key))
+			continue;
+
+		if (running == jobs)
+			group_reap(run, &running, members, &ct);
+		pid_t c = fork();
+		if (c == 0)
+			_exit(snapshot_store(dir, pid, group));
+		if (c == -1)
+			continue;
+		run[running++] = (struct group_job) { c, pid };
+		started++;
+	}
+	closedir(d);
+	while (running)
+		group_reap(run, &running, members, &ct);
+
+	char key_f[256];
+	index_field(key_f, sizeof(key_f), key);
+	int dir_fd = ct ? open(dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC) : -1;
+	if (dir_fd != -1) {
+		i = 0;
+		do {
+			char list[GROUP_MEMBERS_LEN] = "";
+			size_t ll = 0;
+			for (; i < ct; i++) {
+				int l = snprintf(list + ll, sizeof(list) - ll, "%s%d", ll ? "," : "", members[i]);
+				if (ll + l >= sizeof(list)) {
+					list[ll] = '\0';
+					break;
+				}
+				ll += l;
+			}
+			if (index_append(dir_fd, "G\t%s\t%s\t%s\n", group, key_f, list) < 0)
+				break;
+		} while (i < ct);
+		close(dir_fd);
+	}
+	pr_info("captured %zu processes of %s with '%s'\n", ct, key, m->comm);
+	_exit(EXIT_SUCCESS);
+}
+
+/*
+ * store --vmcore: a kdump vmcore (the ELF /proc/vmcore of a crashed kernel)
+ * stored like any process's core, compressed, encrypted & indexed as
+ * configured. Pages the kernel had free (in the buddy allocator) or holding
+ * clean page cache are left out, as makedumpfile does: the VMCOREINFO note
+ * says where the struct pages are & how to read them, and the PT_LOADs are
+ * split around the pages left out. Only x86-64 vmcores are filtered so (it
+ * takes a page table walk). Zero pages, found by reading the rest through
+ * once before it's written, become PT_LOADs with no data in the file, which
+ * read as zeroes, for any vmcore.
+ */
+#define VMCORE_KERNEL_MAP 0xffffffff80000000ULL
+#define VMCORE_PTE_ADDR 0x000ffffffffff000ULL
+/* the flag bits in mem_section.section_mem_map */
+#define VMCORE_SECTION_MAP_MASK (~0x3fULL)
+/* struct pages read at once */
+#define VMCORE_PAGES_BLOCK 512
+
+struct vmcore {
+	int fd;
+	Elf64_Ehdr eh;
+	Elf64_Phdr *ph;
+	size_t phnum;
+	/* the VMCOREINFO note, 'KEY=value' lines */
+	char *info;
+	uint64_t page_size;
+	uint64_t max_pfn;
+
+	/* for the page table walk */
+	uint64_t phys_base, top_pgt, sme_mask;
+	bool l5;
+	uint64_t tlb_va, tlb_pa;
+
+	/* pfns left out, & those kept with no data */
+	uint64_t *skip, *zero;
+	uint64_t free_pages, cache_pages, zero_pages;
+};
+
+static void vmcore_close(struct vmcore *vc)
+{
+	if (vc->fd != -1)
+		close(vc->fd);
+	free(vc->ph);
+	free(vc->info);
+	free(vc->skip);
+	free(vc->zero);
+}
+
+/* 'KEY' from VMCOREINFO: SYMBOL()s are hex, everything else decimal */
+static bool vmcore_key(const struct vmcore *vc, const char *key, int64_t *v)
+{
+	size_t kl = strlen(key);
+	const char *l = vc->info;
+	while (l && *l) {
+		if (!strncmp(l, key, kl) && l[kl] == '=') {
+			if (!strncmp(key, "SYMBOL(", 7))
+				*v = strtoull(l + kl + 1, NULL, 16);
+			else
+				*v = strtoll(l + kl + 1, NULL, 10);
+			return true;
+		}
+		l = strchr(l, '\n');
+		if (l)
+			l++;
+	}
+	return false;
+}
+
+static int vmcore_pread_phys(struct vmcore *vc, uint64_t pa, void *buf, size_t len)
+{
+	size_t i;
+	for (i = 0; i < vc->phnum; i++) {
+		const Elf64_Phdr *p = &vc->ph[i];
+		if (p->p_type != PT_LOAD || pa < p->p_paddr || pa + len > p->p_paddr + p->p_filesz)
+			continue;
+		return pread(vc->fd, buf, len, p->p_offset + pa - p->p_paddr) == (ssize_t)len ? 0 : -1;
+	}
+	return -1;
+}
+
+/* x86-64 only: the kernel's own mapping, or a walk of init_top_pgt */
+static int vmcore_v2p(struct vmcore *vc, uint64_t va, uint64_t *pa)
+{
+	if (va >= VMCORE_KERNEL_MAP) {
+		*pa = va - VMCORE_KERNEL_MAP + vc->phys_base;
+		return 0;
+	}
+	if ((va & ~4095ULL) == vc->tlb_va) {
+		*pa = vc->tlb_pa + (va & 4095);
+		return 0;
+	}
+
+	uint64_t table = vc->top_pgt;
+	int level;
+	for (level = vc->l5 ? 5 : 4; level; level--) {
+		unsigned shift = 12 + 9 * (level - 1);
+		uint64_t e;
+		if (vmcore_pread_phys(vc, table + ((va >> shift) & 511) * 8, &e, sizeof(e)) < 0
+				|| !(e & 1))
+			return -1;
+		table = e & VMCORE_PTE_ADDR & ~vc->sme_mask;
+		/* 1 GiB & 2 MiB pages */
+		if (level == 1 || ((level == 2 || level == 3) && (e & 0x80))) {
+			uint64_t in = (1ULL << shift) - 1;
+			*pa = (table & ~in) + (va & in);
+			vc->tlb_va = va & ~4095ULL;
+			vc->tlb_pa = *pa & ~4095ULL;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int vmcore_pread_virt(struct vmcore *vc, uint64_t va, void *buf, size_t len)
+{
+	uint8_t *b = buf;
+	while (len) {
+		uint64_t pa;
+		size_t l = 4096 - (va & 4095);
+		if (l > len)
+			l = len;
+		if (vmcore_v2p(vc, va, &pa) < 0 || vmcore_pread_phys(vc, pa, b, l) < 0)
+			return -1;
+		va += l;
+		b += l;
+		len -= l;
+	}
+	return 0;
+}
+
+static int vmcore_open(struct vmcore *vc, const char *path)
+{
+	*vc = (struct vmcore) { .fd = -1, .page_size = 4096 };
+	vc->fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (vc->fd == -1) {
+		pr_err("could not open '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	char magic[8];
+	if (pread(vc->fd, magic, sizeof(magic), 0) == sizeof(magic)
+			&& (!memcmp(magic, "KDUMP   ", 8) || !memcmp(magic, "makedump", 8))) {
+		pr_err("'%s' is already filtered (by makedumpfile), store the ELF vmcore\n", path);
+		return -1;
+	}
+	if (pread(vc->fd, &vc->eh, sizeof(vc->eh), 0) != sizeof(vc->eh)
+			|| memcmp(vc->eh.e_ident, ELFMAG, SELFMAG) || vc->eh.e_type != ET_CORE
+			|| vc->eh.e_ident[EI_CLASS] != ELFCLASS64) {
+		pr_err("'%s' is not a 64-bit ELF vmcore\n", path);
+		return -1;
+	}
+
+	vc->phnum = vc->eh.e_phnum;
+	if (vc->phnum == PN_XNUM) {
+		Elf64_Shdr sh;
+		if (pread(vc->fd, &sh, sizeof(sh), vc->eh.e_shoff) != sizeof(sh))
+			return -1;
+		vc->phnum = sh.sh_info;
+	}
+	vc->ph = calloc(vc->phnum, sizeof(*vc->ph));
+	if (!vc->ph || pread(vc->fd, vc->ph, vc->phnum * sizeof(*vc->ph), vc->eh.e_phoff)
+			!= (ssize_t)(vc->phnum * sizeof(*vc->ph)))
+		return -1;
+
+	size_t i;
+	for (i = 0; i < vc->phnum && !vc->info; i++) {
+		const Elf64_Phdr *p = &vc->ph[i];
+		if (p->p_type != PT_NOTE || p->p_filesz > 1024 * 1024)
+			continue;
+		uint8_t *n = malloc(p->p_filesz + 1);
+		if (!n || pread(vc->fd, n, p->p_filesz, p->p_offset) != (ssize_t)p->p_filesz) {
+			free(n);
+			return -1;
+		}
+		size_t at = 0;
+		while (at + sizeof(Elf64_Nhdr) <= p->p_filesz) {
+			Elf64_Nhdr nh;
+			memcpy(&nh, n + at, sizeof(nh));
+			size_t name_at = at + sizeof(nh), desc_at = name_at + ((nh.n_namesz + 3) & ~3U);
+			if (desc_at + nh.n_descsz > p->p_filesz)
+				break;
+			if (nh.n_namesz == 11 && !memcmp(n + name_at, "VMCOREINFO", 11)) {
+				vc->info = strndup((char *)n + desc_at, nh.n_descsz);
+				break;
+			}
+			at = desc_at + ((nh.n_descsz + 3) & ~3U);
+		}
+		free(n);
+	}
+	for (i = 0; i < vc->phnum; i++) {
+		uint64_t end = vc->ph[i].p_paddr + vc->ph[i].p_memsz;
+		if (vc->ph[i].p_type == PT_LOAD && end / vc->page_size > vc->max_pfn)
+			vc->max_pfn = end / vc->page_size;
+	}
+
+	int64_t v;
+	if (vc->info && vmcore_key(vc, "PAGESIZE", &v) && v >= 4096 && !(v & (v - 1)))
+		vc->page_size = v;
+	return 0;
+}
+
+static void vmcore_skip(struct vmcore *vc, uint64_t pfn, uint64_t ct)
+{
+	for (; ct && pfn < vc->max_pfn; pfn++, ct--)
+		vc->skip[pfn / 64] |= 1ULL << (pfn % 64);
+}
+
+static bool vmcore_skipped(const struct vmcore *vc, uint64_t pfn)
+{
+	return vc->skip && pfn < vc->max_pfn && (vc->skip[pfn / 64] >> (pfn % 64) & 1);
+}
+
+enum vmcore_page {
+	VMCORE_KEEP,
+	VMCORE_SKIP,
+	VMCORE_ZERO,
+};
+
+static enum vmcore_page vmcore_page(const struct vmcore *vc, uint64_t pfn)
+{
+	if (vmcore_skipped(vc, pfn))
+		return VMCORE_SKIP;
+	if (vc->zero && pfn < vc->max_pfn && (vc->zero[pfn / 64] >> (pfn % 64) & 1))
+		return VMCORE_ZERO;
+	return VMCORE_KEEP;
+}
+
+/* Find the zero pages among those not left out, reading them through once */
+static int vmcore_zeros(struct vmcore *vc)
+{
+	uint64_t ps = vc->page_size;
+	if (ps > CFG_FRAME_SIZE)
+		return 0;
+	vc->zero = calloc((vc->max_pfn + 63) / 64, sizeof(*vc->zero));
+	__attribute__((cleanup(freep)))
+	uint8_t *buf = malloc(CFG_FRAME_SIZE);
+	if (!vc->zero || !buf)
+		return -1;
+
+	size_t i;
+	for (i = 0; i < vc->phnum; i++) {
+		const Elf64_Phdr *p = &vc->ph[i];
+		if (p->p_type != PT_LOAD || p->p_paddr % ps)
+			continue;
+		uint64_t at = 0;
+		while (at + ps <= p->p_filesz) {
+			uint64_t pfn = (p->p_paddr + at) / ps;
+			if (vmcore_skipped(vc, pfn)) {
+				at += ps;
+				continue;
+			}
+			uint64_t l = (p->p_filesz - at) / ps * ps;
+			if (l > CFG_FRAME_SIZE)
+				l = CFG_FRAME_SIZE;
+			ssize_t r = pread(vc->fd, buf, l, p->p_offset + at);
+			if (r < (ssize_t)ps)
+				return -1;
+
+			uint64_t o;
+			for (o = 0; o + ps <= (uint64_t)r; o += ps, pfn++) {
+				if (vmcore_skipped(vc, pfn) || buf[o] || memcmp(buf + o, buf + o + 1, ps - 1))
+					continue;
+				vc->zero[pfn / 64] |= 1ULL << (pfn % 64);
+				vc->zero_pages++;
+			}
+			at += o;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Find the pages to leave out, from the struct pages of each memory section
+ * (SPARSEMEM, with or without SPARSEMEM_EXTREME, as x86-64 always has).
+ */
+static int vmcore_filter(struct vmcore *vc)
+{
+	static const char *const need[] = {
+		"SYMBOL(init_top_pgt)", "NUMBER(phys_base)", "SYMBOL(mem_section)",
+		"LENGTH(mem_section)", "SIZE(mem_section)", "OFFSET(mem_section.section_mem_map)",
+		"NUMBER(SECTION_SIZE_BITS)", "NUMBER(MAX_PHYSMEM_BITS)", "SIZE(page)",
+		"OFFSET(page.flags)", "OFFSET(page.mapping)", "OFFSET(page.private)",
+		"NUMBER(PG_lru)", "NUMBER(PG_private)", "NUMBER(PAGE_BUDDY_MAPCOUNT_VALUE)",
+	};
+	int64_t v[ARRAY_SIZE(need)], mapcount_off, swapcache = -1, num;
+	size_t i;
+	if (vc->eh.e_machine != EM_X86_64 || !vc->info) {
+		pr_warn("not filtering pages: not an x86-64 vmcore with VMCOREINFO\n");
+		return 0;
+	}
+	for (i = 0; i < ARRAY_SIZE(need); i++) {
+		if (!vmcore_key(vc, need[i], &v[i])) {
+			pr_warn("not filtering pages: no %s in VMCOREINFO\n", need[i]);
+			return 0;
+		}
+	}
+	if (!vmcore_key(vc, "OFFSET(page._mapcount)", &mapcount_off)
+			&& !vmcore_key(vc, "OFFSET(page.page_type)", &mapcount_off)) {
+		pr_warn("not filtering pages: no OFFSET(page._mapcount) in VMCOREINFO\n");
+		return 0;
+	}
+	vmcore_key(vc, "NUMBER(PG_swapcache)", &swapcache);
+	if (vmcore_key(vc, "NUMBER(pgtable_l5_enabled)", &num))
+		vc->l5 = num;
+	if (vmcore_key(vc, "NUMBER(sme_mask)", &num))
+		vc->sme_mask = num;
+
+	uint64_t mem_section = v[2], roots = v[3], ms_size = v[4], ms_map_off = v[5],
+		 section_bits = v[6], phys_bits = v[7], page_sz = v[8], flags_off = v[9],
+		 mapping_off = v[10], private_off = v[11];
+	uint64_t lru = 1ULL << v[12], priv = 1ULL << v[13];
+	uint64_t swap = swapcache >= 0 ? 1ULL << swapcache : 0;
+	uint32_t buddy = v[14];
+	vc->phys_base = v[1];
+	vc->top_pgt = v[0] - VMCORE_KERNEL_MAP + vc->phys_base;
+
+	unsigned page_shift = __builtin_ctzll(vc->page_size);
+	if (section_bits <= page_shift || section_bits >= phys_bits || phys_bits > 60
+			|| !ms_size || page_sz < 32 || page_sz > 1024
+			|| flags_off + 8 > page_sz || mapping_off + 8 > page_sz
+			|| private_off + 8 > page_sz || (uint64_t)mapcount_off + 4 > page_sz) {
+		pr_warn("not filtering pages: VMCOREINFO doesn't add up\n");
+		return 0;
+	}
+
+	uint64_t pps = 1ULL << (section_bits - page_shift),
+		 sections = (vc->max_pfn + pps - 1) / pps,
+		 per_root = 1;
+	/* SPARSEMEM_EXTREME: mem_section points to roots of pages of sections */
+	bool extreme = roots != 1ULL << (phys_bits - section_bits);
+	if (extreme) {
+		per_root = vc->page_size / ms_size;
+		if (vmcore_pread_virt(vc, mem_section, &mem_section, sizeof(mem_section)) < 0) {
+			pr_warn("not filtering pages: could not read mem_section\n");
+			return 0;
+		}
+	}
+
+	vc->skip = calloc((vc->max_pfn + 63) / 64, sizeof(*vc->skip));
+	uint8_t *pages = malloc(VMCORE_PAGES_BLOCK * page_sz);
+	if (!vc->skip || !pages) {
+		free(pages);
+		return -1;
+	}
+
+	uint64_t s, root = UINT64_MAX, root_addr = 0;
+	for (s = 0; s < sections; s++) {
+		uint64_t ms_addr, smm;
+		if (extreme) {
+			if (s / per_root != root) {
+				root = s / per_root;
+				if (root >= roots || vmcore_pread_virt(vc, mem_section + root * 8,
+							&root_addr, sizeof(root_addr)) < 0)
+					root_addr = 0;
+			}
+			if (!root_addr)
+				continue;
+			ms_addr = root_addr + (s % per_root) * ms_size;
+		} else {
+			ms_addr = mem_section + s * ms_size;
+		}
+		if (vmcore_pread_virt(vc, ms_addr + ms_map_off, &smm, sizeof(smm)) < 0
+				|| !(smm & VMCORE_SECTION_MAP_MASK))
+			continue;
+
+		/* section_mem_map is the section's mem_map less its first pfn */
+		uint64_t start = s * pps, ct = vc->max_pfn - start < pps ? vc->max_pfn - start : pps;
+		uint64_t map = (smm & VMCORE_SECTION_MAP_MASK) + start * page_sz;
+
+		/* a block at a time, as parts of it may not be mapped */
+		uint64_t p, blk = UINT64_MAX;
+		bool have = false;
+		for (p = 0; p < ct; p++) {
+			if (p / VMCORE_PAGES_BLOCK != blk) {
+				blk = p / VMCORE_PAGES_BLOCK;
+				uint64_t n = ct - blk * VMCORE_PAGES_BLOCK;
+				if (n > VMCORE_PAGES_BLOCK)
+					n = VMCORE_PAGES_BLOCK;
+				have = vmcore_pread_virt(vc, map + blk * VMCORE_PAGES_BLOCK * page_sz,
+						pages, n * page_sz) == 0;
+			}
+			if (!have)
+				continue;
+
+			const uint8_t *pg = pages + (p % VMCORE_PAGES_BLOCK) * page_sz;
+			uint64_t flags, mapping, private;
+			uint32_t mapcount;
+			memcpy(&flags, pg + flags_off, sizeof(flags));
+			memcpy(&mapping, pg + mapping_off, sizeof(mapping));
+			memcpy(&private, pg + private_off, sizeof(private));
+			memcpy(&mapcount, pg + mapcount_off, sizeof(mapcount));
+
+			/* the head of a free block of 2^private pages; newer kernels
+			 * keep the type in page_type's top byte */
+			if ((mapcount == buddy || (!(buddy & 0xffffff) && (mapcount & 0xff000000) == buddy))
+					&& private < 20) {
+				vmcore_skip(vc, start + p, 1ULL << private);
+				vc->free_pages += 1ULL << private;
+				p += (1ULL << private) - 1;
+				continue;
+			}
+			/* clean page cache: on an LRU, file backed, nothing private */
+			if ((flags & lru) && mapping && !(mapping & 1) && !(flags & (priv | swap))) {
+				vmcore_skip(vc, start + p, 1);
+				vc->cache_pages++;
+			}
+		}
+	}
+	free(pages);
+	return 0;
+}
+
+/* Write the filtered vmcore to out_fd, for store_dump() to read */
+static int vmcore_write(struct vmcore *vc, int out_fd)
+{
+	/*
+	 * Runs of kept pages in each PT_LOAD become PT_LOADs of their own, and
+	 * runs of zero pages ones with no data in the file (p_filesz 0).
+	 */
+	Elf64_Phdr *out = NULL;
+	size_t out_ct = 0, out_alloc = 0, i;
+	for (i = 0; i < vc->phnum; i++) {
+		const Elf64_Phdr *p = &vc->ph[i];
+		uint64_t at = 0, ps = vc->page_size;
+		do {
+			uint64_t end = at;
+			enum vmcore_page kind = p->p_type == PT_LOAD
+				? vmcore_page(vc, (p->p_paddr + at) / ps) : VMCORE_KEEP;
+			if (p->p_type == PT_LOAD)
+				while (end < p->p_filesz && vmcore_page(vc, (p->p_paddr + end) / ps) == kind)
+					end = (end + ps) / ps * ps;
+			if (end > p->p_filesz || p->p_type != PT_LOAD)
+				end = p->p_filesz;
+
+			if (kind != VMCORE_SKIP) {
+				if (out_ct == out_alloc) {
+					out_alloc = out_alloc ? out_alloc * 2 : 64;
+					Elf64_Phdr *n = realloc(out, out_alloc * sizeof(*n));
+					if (!n) {
+						free(out);
+						return EXIT_FAILURE;
+					}
+					out = n;
+				}
+				Elf64_Phdr *o = &out[out_ct++];
+				*o = *p;
+				o->p_offset += at;
+				o->p_vaddr += at;
+				o->p_paddr += at;
+				o->p_filesz = kind == VMCORE_ZERO ? 0 : end - at;
+				/* the part past p_filesz goes with the last run */
+				o->p_memsz = end == p->p_filesz ? p->p_memsz - at : end - at;
+			}
+			at = end;
+		} while (at < p->p_filesz);
+	}
+
+	bool xnum = out_ct >= PN_XNUM;
+	Elf64_Ehdr eh = vc->eh;
+	eh.e_phoff = sizeof(eh) + (xnum ? sizeof(Elf64_Shdr) : 0);
+	eh.e_phnum = xnum ? PN_XNUM : out_ct;
+	eh.e_shoff = xnum ? sizeof(eh) : 0;
+	eh.e_shentsize = xnum ? sizeof(Elf64_Shdr) : 0;
+	eh.e_shnum = xnum ? 1 : 0;
+	eh.e_shstrndx = SHN_UNDEF;
+
+	/* data in the order it's in the vmcore, notes first */
+	uint64_t off = eh.e_phoff + out_ct * sizeof(Elf64_Phdr);
+	uint64_t *src = malloc(out_ct * sizeof(*src));
+	if (!src) {
+		free(out);
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < out_ct; i++) {
+		src[i] = out[i].p_offset;
+		out[i].p_offset = off;
+		off += out[i].p_filesz;
+	}
+
+	int e = EXIT_FAILURE;
+	uint8_t *buf = malloc(CFG_FRAME_SIZE);
+	if (!buf || write_all(out_fd, &eh, sizeof(eh)) < 0)
+		goto out;
+	if (xnum) {
+		Elf64_Shdr sh = { .sh_info = out_ct };
+		if (write_all(out_fd, &sh, sizeof(sh)) < 0)
+			goto out;
+	}
+	if (write_all(out_fd, out, out_ct * sizeof(*out)) < 0)
+		goto out;
+	for (i = 0; i < out_ct; i++) {
+		uint64_t done = 0;
+		while (done < out[i].p_filesz) {
+			size_t l = out[i].p_filesz - done < CFG_FRAME_SIZE ? out[i].p_filesz - done : CFG_FRAME_SIZE;
+			ssize_t r = pread(vc->fd, buf, l, src[i] + done);
+			if (r <= 0 || write_all(out_fd, buf, r) < 0)
+				goto out;
+			done += r;
+		}
+	}
+	e = EXIT_SUCCESS;
+out:
+	free(buf);
+	free(src);
+	free(out);
+	return e;
+}
+
+static int store_vmcore(char *dir, int argc, char *argv[])
+{
+	if (argc != 3) {
+		pr_err("store --vmcore requires a vmcore\n");
+		return EXIT_FAILURE;
+	}
+
+	struct vmcore vc;
+	struct stat st;
+	int e = EXIT_FAILURE;
+	if (vmcore_open(&vc, argv[2]) < 0 || fstat(vc.fd, &st) < 0)
+		goto out;
+	if (vmcore_filter(&vc) < 0 || vmcore_zeros(&vc) < 0)
+		goto out;
+
+	char abs_dir[PATH_MAX], cwd[PATH_MAX];
+	if (dir[0] == '/')
+		snprintf(abs_dir, sizeof(abs_dir), "%s", dir);
+	else if (!getcwd(cwd, sizeof(cwd))
+			|| snprintf(abs_dir, sizeof(abs_dir), "%s/%s", cwd, dir) >= (int)sizeof(abs_dir))
+		goto out;
+
+	/* the kernel release stands in for the executable */
+	char release[128] = "?";
+	const char *r = vc.info ? strstr(vc.info, "OSRELEASE=") : NULL;
+	if (r)
+		snprintf(release, sizeof(release), "%.*s", (int)strcspn(r + 10, "\n"), r + 10);
+	struct dump_meta m = {
+		.ts = st.st_mtime,
+		.comm = "kernel",
+		.path = release,
+		.limit = UINT64_MAX,
+	};
+	pr_info("storing vmcore of %s, leaving out %ju free, %ju page cache & %ju zero pages\n",
+			release, (uintmax_t)vc.free_pages, (uintmax_t)vc.cache_pages,
+			(uintmax_t)vc.zero_pages);
+
+	/* there's no process to take binaries from */
+	cfg.keep_binaries = false;
+
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) == -1)
+		goto out;
+	pid_t w = fork();
+	if (w == 0) {
+		close(fds[0]);
+		_exit(vmcore_write(&vc, fds[1]));
+	}
+	close(fds[1]);
+	if (w == -1 || dup2(fds[0], STDIN_FILENO) == -1) {
+		close(fds[0]);
+		goto out;
+	}
+	close(fds[0]);
+
+	e = store_dump(abs_dir, &m);
+
+	int status;
+	if (waitpid(w, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		pr_err("could not read all of '%s'\n", argv[2]);
+		e = EXIT_FAILURE;
+	}
+out:
+	vmcore_close(&vc);
+	return e;
+}
+
+static int act_store(char *dir, int argc, char *argv[])
+{
+	if (argc > 1 && !strcmp(argv[1], "--vmcore"))
+		return store_vmcore(dir, argc, argv);
+
+	int err = 0;
+	if (argc != 8 && argc != 9) {
+		pr_err("store requires 8 or 9 arguments, got %d\n", argc);
+		err++;
+	}
+
+	/* for store, we require an absolute path */
+	if (dir[0] != '/') {
+		pr_err("store requires an absolute path, but got '%s'\n", dir);
+		err++;
+	}
+
+	if (err)
+		return EXIT_FAILURE;
+
+	/* FIXME: allow these to be non-fatal errors */
+	uintmax_t pid = parse_unum(argv[1], "pid"),
+		  uid = parse_unum(argv[2], "uid"),
+		  gid = parse_unum(argv[3], "gid"),
+		  sig = parse_unum(argv[4], "signal"),
+		  ts  = parse_unum(argv[5], "timestamp");
+	/* +6 = core limit */
+	const char *comm = argv[7];
+
+	/* FIXME: path gotten this way is mangled... for some reason. unmangle.
+	 * Also check if this can be confused (by embedded whitespace or other
+	 * junk */
+	char *path = argv[8];
+
+	pr_err("'%s' aborted with signal %ju (pid = %ju, uid = %ju, path = %s)\n",
+			comm, sig, pid, uid, path);
+
+	struct dump_meta m = {
+		.pid = pid,
+		.uid = uid,
+		.gid = gid,
+		.sig = sig,
+		.ts = ts,
+		.comm = comm,
+		.path = path,
+	};
+
+	/* the rest of the service is captured while we store the core, before
+	 * it notices the crash */
+	char group[NAME_MAX + 1];
+	pid_t grp = -1;
+	if (group_rule_find(&m) && dump_name(group, sizeof(group), &m) == 0)
+		grp = group_capture_start(dir, &m, group);
+	if (grp > 0)
+		m.group = group;
+
+	int e = store_dump(dir, &m);
+	if (grp > 0)
+		waitpid(grp, NULL, 0);
+	return e;
+}
+
+static int setup_temporal(const char *path)
+{
+	pr_info("registering using path '%s'\n", path);
+
+	__attribute__((cleanup(fclosep)))
+	FILE *f = fopen("/proc/sys/kernel/core_pattern", "w");
+	if (!f) {
+		pr_err("could not open /proc/sys/kernel/core_pattern file to configure system: %s\n", strerror(errno));
+		return -1;
+	}
+
+	int r = fprintf(f, "|%s store %%P %%u %%g %%s %%t %%c %%e %%E", path);
+	if (r <= 0) {
+		pr_err("failed to write to core_pattern (but open worked): %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int setup_perm(const char *path)
+{
+	/* TODO: use create+rename to avoid intermediate */
+	__attribute__((cleanup(fclosep)))
+	FILE *f = fopen("/etc/sysctl.d/80-dumpctl.conf", "w");
+	if (!f) {
+		pr_err("could not open /etc/sysctl.d/80-dumpctl.conf file to configure system: %s\n", strerror(errno));
+		return -1;
 	}
 
 	int r = fprintf(f, "kernel.core_pattern=|%s store %%P %%u %%g %%s %%t %%c %%e %%E\n", path);
@@ -524,7 +10343,143 @@ static int setup_perm(const char *path)
 	return 0;
 }
 
-static int act_setup(const char *self)
+static int cg_write(int cg_fd, const char *file, const char *val)
+{
+	int fd = openat(cg_fd, file, O_WRONLY);
+	if (fd == -1)
+		return -1;
+	int r = dprintf(fd, "%s\n", val);
+	int e = errno;
+	close(fd);
+	errno = e;
+	return r < 0 ? -1 : 0;
+}
+
+/*
+ * io.max wants the whole disk our storage lives on, not a partition of it.
+ * The storage dir is made by the first store, so until then it's the disk
+ * of the nearest directory above it that exists.
+ */
+static int storage_disk(const char *dir, char *buf, size_t len)
+{
+	struct stat st;
+	char d[PATH_MAX];
+	snprintf(d, sizeof(d), "%s", dir);
+	while (stat(d, &st) == -1) {
+		char *slash = strrchr(d, '/');
+		if (errno != ENOENT || !slash || !d[1])
+			return -1;
+		if (slash == d)
+			slash[1] = '\0';
+		else
+			*slash = '\0';
+	}
+
+	unsigned ma = major(st.st_dev), mi = minor(st.st_dev);
+	char p[PATH_MAX];
+	snprintf(p, sizeof(p), "/sys/dev/block/%u:%u/partition", ma, mi);
+	if (access(p, F_OK) == 0) {
+		snprintf(p, sizeof(p), "/sys/dev/block/%u:%u/../dev", ma, mi);
+		__attribute__((cleanup(fclosep)))
+		FILE *f = fopen(p, "r");
+		if (!f || fscanf(f, "%u:%u", &ma, &mi) != 2)
+			return -1;
+	}
+
+	snprintf(buf, len, "%u:%u", ma, mi);
+	return 0;
+}
+
+/*
+ * Create the cgroup 'polite' stores move themselves into. Not having
+ * cgroup2 is not an error: store falls back to io priority & nice.
+ */
+static int setup_cgroup(const char *dir)
+{
+	if (cfg.isolation != ISOLATE_POLITE)
+		return 0;
+
+	int r = mkdir(cfg.cgroup, 0755);
+	if (r == -1 && errno != EEXIST) {
+		pr_warn("could not create cgroup '%s': %s\n", cfg.cgroup, strerror(errno));
+		return 0;
+	}
+
+	/* the controllers need to be enabled in our parent for the limits to exist */
+	char parent[PATH_MAX];
+	snprintf(parent, sizeof(parent), "%s", cfg.cgroup);
+	char *slash = strrchr(parent, '/');
+	if (slash && slash != parent) {
+		*slash = '\0';
+		int p_fd = open(parent, O_DIRECTORY|O_RDONLY);
+		if (p_fd != -1) {
+			if (cg_write(p_fd, "cgroup.subtree_control", "+io +cpu +memory") == -1)
+				pr_warn("could not enable cgroup controllers in '%s': %s\n", parent, strerror(errno));
+			close(p_fd);
+		}
+	}
+
+	int cg_fd = open(cfg.cgroup, O_DIRECTORY|O_RDONLY);
+	if (cg_fd == -1) {
+		pr_warn("could not open cgroup '%s': %s\n", cfg.cgroup, strerror(errno));
+		return 0;
+	}
+
+	int err = 0;
+	if (cfg.cgroup_cpu_max && cg_write(cg_fd, "cpu.max", cfg.cgroup_cpu_max) == -1) {
+		pr_err("could not set cpu.max: %s\n", strerror(errno));
+		err++;
+	}
+
+	if (cfg.cgroup_memory_max && cg_write(cg_fd, "memory.max", cfg.cgroup_memory_max) == -1) {
+		pr_err("could not set memory.max: %s\n", strerror(errno));
+		err++;
+	}
+
+	if (cfg.cgroup_io_max) {
+		char disk[32], v[256];
+		if (storage_disk(dir, disk, sizeof(disk)) == -1) {
+			pr_err("could not find the disk under '%s' for io.max\n", dir);
+			err++;
+		} else {
+			snprintf(v, sizeof(v), "%s %s", disk, cfg.cgroup_io_max);
+			if (cg_write(cg_fd, "io.max", v) == -1) {
+				pr_err("could not set io.max to '%s': %s\n", v, strerror(errno));
+				err++;
+			}
+		}
+	}
+
+	close(cg_fd);
+	return err ? -1 : 0;
+}
+
+/* Allocate the ring file now rather than while storing the first core */
+static int setup_ring(const char *dir)
+{
+	if (cfg.backend != BACKEND_RING)
+		return 0;
+
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		pr_err("could not create storage dir '%s': %s\n", dir, strerror(errno));
+		return -1;
+	}
+
+	int dir_fd = open(dir, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+	if (dir_fd == -1) {
+		pr_err("could not open storage dir '%s': %s\n", dir, strerror(errno));
+		return -1;
+	}
+
+	struct ring r;
+	int ret = ring_open(&r, dir_fd, true);
+	if (ret == 0)
+		ring_close(&r);
+	close(dir_fd);
+	return ret;
+}
+
+static int act_setup(const char *dir, const char *self)
 {
 	char path[PATH_MAX + 1];
 	ssize_t n = readlink("/proc/self/exe", path, sizeof(path) -1);
@@ -551,6 +10506,14 @@ static int act_setup(const char *self)
 	if (r < 0)
 		return r;
 
+	r = setup_cgroup(dir);
+	if (r < 0)
+		return r;
+
+	r = setup_ring(dir);
+	if (r < 0)
+		return r;
+
 	return 0;
 }
 
@@ -560,12 +10523,6 @@ static bool fd_is_open(int fd)
 	return r != -1 || errno != EBADF;
 }
 
-static void freep(void *p_)
-{
-	void **p = p_;
-	free(*p);
-}
-
 int main(int argc, char *argv[])
 {
         /* Make sure we never enter a loop */
@@ -600,6 +10557,8 @@ int main(int argc, char *argv[])
 
 	__attribute__((cleanup(freep)))
 	char *dir = strdup(default_path);
+	const char *config = default_config;
+	bool config_given = false;
 	const char *prgmname = argc?argv[0]:PRGMNAME_DEFAULT;
 	
 	int err = 0;
@@ -607,6 +10566,10 @@ int main(int argc, char *argv[])
 
 	while ((opt = getopt(argc, argv, opts)) != -1) {
 		switch (opt) {
+		case 'c':
+			config = optarg;
+			config_given = true;
+			break;
 		case 'd':
 			free(dir);
 			dir = strdup(optarg);
@@ -641,13 +10604,51 @@ int main(int argc, char *argv[])
 	if (err)
 		usage(EXIT_FAILURE);
 
+	/* a broken config must not stop us from storing the core */
+	if (config_load(config, config_given) < 0 && act != ACT_STORE)
+		return EXIT_FAILURE;
+
 	argc -= optind;
 	argv += optind;
 	switch (act) {
 	case ACT_STORE:
 		return act_store(dir, argc, argv);
 	case ACT_SETUP:
-		return act_setup(prgmname);
+		return act_setup(dir, prgmname);
+	case ACT_MIGRATE:
+		return migrate_all(dir) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	case ACT_EXTRACT:
+		return act_extract(dir, argc, argv);
+	case ACT_LIST:
+		return act_list(dir);
+	case ACT_EXPORT:
+		return act_export(dir, argc, argv);
+	case ACT_INFO:
+		return act_info(dir, argc, argv);
+	case ACT_GDB:
+		return act_gdb(dir, argc, argv);
+	case ACT_BENCH:
+		return act_bench(argc, argv);
+	case ACT_SERVE:
+		return act_serve(dir, argc, argv);
+	case ACT_TRIAGE:
+		return act_triage(dir, argc, argv);
+	case ACT_SEARCH:
+		return act_search(dir, argc, argv);
+	case ACT_SIMILAR:
+		return act_similar(dir, argc, argv);
+	case ACT_CLUSTER:
+		return act_cluster(dir, argc, argv);
+	case ACT_VACUUM:
+		return act_vacuum(dir, argc, argv);
+	case ACT_GREP:
+		return act_grep(dir, argc, argv);
+	case ACT_DIFF:
+		return act_diff(dir, argc, argv);
+	case ACT_ANALYZE_STORAGE:
+		return act_analyze_storage(dir, argc, argv);
+	case ACT_SNAPSHOT:
+		return act_snapshot(dir, argc, argv);
 	default:
 		pr_warn("action %s is unimplimented\n", action);
 		return EXIT_FAILURE;